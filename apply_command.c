@@ -5,77 +5,46 @@
 #include "error.h"
 #include "apply_command.h"
 #include "utils.h"
+#include "lazy.h"
+#include "pnm.h"
+#include "output.h"
 
 #define APPLY_ARG_COUNT 1
 #define APPLY_SUCCESS_MSG "APPLY %s done\n"
-#define KERNEL_SIZE 3
 
-typedef enum {
-	INVALID_APPLY_PARAM,
-	EDGE,
-	SHARPEN,
-	BLUR,
-	GAUSSIAN_BLUR
-} APPLY_PARAM;
-
-static int apply_filter(image_t *image, APPLY_PARAM apply_param);
 static int apply_edge(image_t *image);
 static int apply_sharpen(image_t *image);
 static int apply_blur(image_t *image);
 static int apply_gaussian_blur(image_t *image);
 static int apply_kernel(image_t *image, const double kernel[][KERNEL_SIZE]);
-
-static inline APPLY_PARAM str_to_apply_param(const char *str)
-{
-	if (!str)
-		return INVALID_APPLY_PARAM;
-
-	static const struct {
-		APPLY_PARAM param;
-		const char *str;
-	} conversion[] = {
-		{EDGE, "EDGE"},
-		{SHARPEN, "SHARPEN"},
-		{BLUR, "BLUR"},
-		{GAUSSIAN_BLUR, "GAUSSIAN_BLUR"}
-	};
-
-	// bypass check-style warning
-	unsigned int size = sizeof(conversion);
-	size /= sizeof(conversion[0]);
-
-	for (unsigned int i = 0; i < size; i++)
-		if (!strcmp(str, conversion[i].str))
-			return conversion[i].param;
-
-	return INVALID_APPLY_PARAM;
-}
-
-static inline const char *apply_param_to_str(APPLY_PARAM apply_param)
-{
-	if (apply_param == INVALID_APPLY_PARAM)
-		return NULL;
-
-	static const struct {
-		APPLY_PARAM param;
-		const char *str;
-	} conversion[] = {
-		{EDGE, "EDGE"},
-		{SHARPEN, "SHARPEN"},
-		{BLUR, "BLUR"},
-		{GAUSSIAN_BLUR, "GAUSSIAN_BLUR"}
-	};
-
-	// bypass check-style warning
-	unsigned int size = sizeof(conversion);
-	size /= sizeof(conversion[0]);
-
-	for (unsigned int i = 0; i < size; i++)
-		if (apply_param == conversion[i].param)
-			return conversion[i].str;
-
-	return NULL;
-}
+static void convolve_plane(const double *const rows[KERNEL_SIZE], double *dest,
+						   size_t from, size_t to, size_t width,
+						   const double kernel[][KERNEL_SIZE],
+						   unsigned short *max_val);
+
+static const double edge_kernel[][KERNEL_SIZE] = {
+	{-1.0, -1.0, -1.0},
+	{-1.0,    8, -1.0},
+	{-1.0, -1.0, -1.0}
+};
+
+static const double sharpen_kernel[][KERNEL_SIZE] = {
+	{   0, -1.0,    0},
+	{-1.0,    5, -1.0},
+	{   0, -1.0,    0}
+};
+
+static const double blur_kernel[][KERNEL_SIZE] = {
+	{1.0 / 9, 1.0 / 9, 1.0 / 9},
+	{1.0 / 9, 1.0 / 9, 1.0 / 9},
+	{1.0 / 9, 1.0 / 9, 1.0 / 9}
+};
+
+static const double gaussian_blur_kernel[][KERNEL_SIZE] = {
+	{1.0 / 16, 1.0 / 8, 1.0 / 16},
+	{1.0 /  8, 1.0 / 4, 1.0 /  8},
+	{1.0 / 16, 1.0 / 8, 1.0 / 16}
+};
 
 void apply_command(image_t *image, char **argv, int argc, jmp_buf ex_buf__)
 {
@@ -93,16 +62,24 @@ void apply_command(image_t *image, char **argv, int argc, jmp_buf ex_buf__)
 	if (apply_param == INVALID_APPLY_PARAM)
 		longjmp(ex_buf__, E_INVALID_APPLY_PARAM);
 
-	if (!is_color(image->magic_word))
+	if (is_pam(image->magic_word) ? pam_is_grayscale(image) :
+									!is_color(image->magic_word))
 		longjmp(ex_buf__, E_GRAYSCALE_IMAGE);
 
-	if (apply_filter(image, apply_param) == -1)
+	image_op_t op = {
+		.type = OP_APPLY,
+		.param = apply_param,
+		.selection = image->selection
+	};
+
+	if (submit_image_op(image, op) == -1)
 		longjmp(ex_buf__, E_FUNC_FAILED);
 
-	printf(APPLY_SUCCESS_MSG, apply_param_to_str(apply_param));
+	out_printf(APPLY_SUCCESS_MSG, apply_param_to_str(apply_param));
 }
 
-static int apply_filter(image_t *image, APPLY_PARAM apply_param)
+// convolves the selection with the kernel of the given APPLY parameter
+int apply_filter(image_t *image, APPLY_PARAM apply_param)
 {
 	if (!image)
 		return -1;
@@ -126,12 +103,6 @@ static int apply_edge(image_t *image)
 	if (!image)
 		return -1;
 
-	static const double edge_kernel[][KERNEL_SIZE] = {
-		{-1.0, -1.0, -1.0},
-		{-1.0,    8, -1.0},
-		{-1.0, -1.0, -1.0}
-	};
-
 	return apply_kernel(image, edge_kernel);
 }
 
@@ -140,12 +111,6 @@ static int apply_sharpen(image_t *image)
 	if (!image)
 		return -1;
 
-	static const double sharpen_kernel[][KERNEL_SIZE] = {
-		{   0, -1.0,    0},
-		{-1.0,    5, -1.0},
-		{   0, -1.0,    0}
-	};
-
 	return apply_kernel(image, sharpen_kernel);
 }
 
@@ -154,12 +119,6 @@ static int apply_blur(image_t *image)
 	if (!image)
 		return -1;
 
-	static const double blur_kernel[][KERNEL_SIZE] = {
-		{1.0 / 9, 1.0 / 9, 1.0 / 9},
-		{1.0 / 9, 1.0 / 9, 1.0 / 9},
-		{1.0 / 9, 1.0 / 9, 1.0 / 9}
-	};
-
 	return apply_kernel(image, blur_kernel);
 }
 
@@ -168,15 +127,113 @@ static int apply_gaussian_blur(image_t *image)
 	if (!image)
 		return -1;
 
-	static const double gaussian_blur_kernel[][KERNEL_SIZE] = {
-		{1.0 / 16, 1.0 / 8, 1.0 / 16},
-		{1.0 /  8, 1.0 / 4, 1.0 /  8},
-		{1.0 / 16, 1.0 / 8, 1.0 / 16}
-	};
-
 	return apply_kernel(image, gaussian_blur_kernel);
 }
 
+// returns the convolution kernel used by an APPLY parameter
+const double (*apply_param_to_kernel(APPLY_PARAM apply_param))[KERNEL_SIZE]
+{
+	switch (apply_param) {
+	case EDGE:
+		return edge_kernel;
+	case SHARPEN:
+		return sharpen_kernel;
+	case BLUR:
+		return blur_kernel;
+	case GAUSSIAN_BLUR:
+		return gaussian_blur_kernel;
+	default:
+		return NULL;
+	}
+}
+
+/*
+ * convolves columns [from, to) of the middle row of rows[] into dest; border
+ * columns are left untouched and max_val is raised to the highest new value
+ */
+void convolve_row(const pixel_t *const rows[KERNEL_SIZE], pixel_t *dest,
+				  size_t from, size_t to, size_t width,
+				  const double kernel[][KERNEL_SIZE], unsigned short *max_val)
+{
+	unsigned int limit = pixel_limit(*max_val);
+
+	for (size_t j = from; j < to; j++) {
+		// pixel can't be processed
+		if (!j || j == width - 1)
+			continue;
+
+		// process pixel
+		pixel_t processed_pixel;
+
+		processed_pixel.color.red   = 0;
+		processed_pixel.color.green = 0;
+		processed_pixel.color.blue  = 0;
+
+		for (size_t k = 0; k < KERNEL_SIZE; k++) {
+			for (size_t l = 0; l < KERNEL_SIZE; l++) {
+				processed_pixel.color.red +=
+				rows[k][j - 1 + l].color.red * kernel[k][l];
+
+				processed_pixel.color.green +=
+				rows[k][j - 1 + l].color.green * kernel[k][l];
+
+				processed_pixel.color.blue +=
+				rows[k][j - 1 + l].color.blue * kernel[k][l];
+			}
+		}
+
+		processed_pixel.color.red =
+		clamp_value(processed_pixel.color.red, limit);
+
+		processed_pixel.color.green =
+		clamp_value(processed_pixel.color.green, limit);
+
+		processed_pixel.color.blue =
+		clamp_value(processed_pixel.color.blue, limit);
+
+		if (processed_pixel.color.red > *max_val)
+			*max_val = processed_pixel.color.red;
+
+		if (processed_pixel.color.green > *max_val)
+			*max_val = processed_pixel.color.green;
+
+		if (processed_pixel.color.blue > *max_val)
+			*max_val = processed_pixel.color.blue;
+
+		dest[j] = processed_pixel;
+	}
+}
+
+/*
+ * convolve_row() for a single plane of a PAM row; the samples are next to each
+ * other, so every kernel tap is a multiply-add over a run of the row
+ */
+static void convolve_plane(const double *const rows[KERNEL_SIZE], double *dest,
+						   size_t from, size_t to, size_t width,
+						   const double kernel[][KERNEL_SIZE],
+						   unsigned short *max_val)
+{
+	unsigned int limit = pixel_limit(*max_val);
+	double highest = *max_val;
+
+	// border columns can't be processed
+	from = from ? from : 1;
+	to = min(to, width - 1);
+
+	for (size_t j = from; j < to; j++) {
+		double sum = 0;
+
+		for (size_t k = 0; k < KERNEL_SIZE; k++)
+			for (size_t l = 0; l < KERNEL_SIZE; l++)
+				sum += rows[k][j - 1 + l] * kernel[k][l];
+
+		dest[j] = clamp_value(sum, limit);
+		highest = dest[j] > highest ? dest[j] : highest;
+	}
+
+	*max_val = highest;
+}
+
 static int apply_kernel(image_t *image, const double kernel[][KERNEL_SIZE])
 {
 	image_t res;
@@ -188,55 +245,43 @@ static int apply_kernel(image_t *image, const double kernel[][KERNEL_SIZE])
 
 	for (size_t i = image->selection.upper_left.y;
 		 i < image->selection.lower_right.y; i++) {
-		for (size_t j = image->selection.upper_left.x;
-			 j < image->selection.lower_right.x; j++) {
-			// pixel can't be processed
-			if (!i || !j || i == image->height - 1 || j == image->width - 1)
-				continue;
-
-			// process pixel
-			pixel_t processed_pixel;
-
-			processed_pixel.color.red   = 0;
-			processed_pixel.color.green = 0;
-			processed_pixel.color.blue  = 0;
-
-			for (size_t k = 0; k < KERNEL_SIZE; k++) {
-				for (size_t l = 0; l < KERNEL_SIZE; l++) {
-					processed_pixel.color.red +=
-					image->matrix[i - 1 + k][j - 1 + l].color.red *
-					kernel[k][l];
-
-					processed_pixel.color.green +=
-					image->matrix[i - 1 + k][j - 1 + l].color.green *
-					kernel[k][l];
-
-					processed_pixel.color.blue +=
-					image->matrix[i - 1 + k][j - 1 + l].color.blue *
-					kernel[k][l];
-				}
-			}
+		advise_row_access(image, i);
+		advise_row_access(&res, i);
 
-			processed_pixel.color.red =
-			clamp_value(processed_pixel.color.red);
+		// row can't be processed
+		if (!i || i == image->height - 1)
+			continue;
 
-			processed_pixel.color.green =
-			clamp_value(processed_pixel.color.green);
-
-			processed_pixel.color.blue =
-			clamp_value(processed_pixel.color.blue);
+		// res shares the rows of the image until now
+		if (make_row_writable(&res, i) == -1) {
+			reset_image(&res);
+			return -1;
+		}
 
-			if (processed_pixel.color.red > res.max_val)
-				res.max_val = processed_pixel.color.red;
+		// the alpha plane of a PAM image is left as it is
+		for (size_t c = 0; is_pam(image->magic_word) &&
+			 c < pam_color_planes(image); c++) {
+			const double *const planes[KERNEL_SIZE] = {
+				pam_plane(image, i - 1, c), pam_plane(image, i, c),
+				pam_plane(image, i + 1, c)
+			};
+
+			convolve_plane(planes, pam_plane(&res, i, c),
+						   image->selection.upper_left.x,
+						   image->selection.lower_right.x, image->width, kernel,
+						   &res.max_val);
+		}
 
-			if (processed_pixel.color.green > res.max_val)
-				res.max_val = processed_pixel.color.green;
+		if (is_pam(image->magic_word))
+			continue;
 
-			if (processed_pixel.color.blue > res.max_val)
-				res.max_val = processed_pixel.color.blue;
+		const pixel_t *const rows[KERNEL_SIZE] = {
+			image->matrix[i - 1], image->matrix[i], image->matrix[i + 1]
+		};
 
-			res.matrix[i][j] = processed_pixel;
-		}
+		convolve_row(rows, res.matrix[i], image->selection.upper_left.x,
+					 image->selection.lower_right.x, image->width, kernel,
+					 &res.max_val);
 	}
 
 	if (copy_image(image, &res) == -1)
@@ -1,7 +1,78 @@
 #pragma once
 
 #include <setjmp.h>
+#include <string.h>
 
 #include "image.h"
 
+#define KERNEL_SIZE 3
+
+typedef enum {
+	INVALID_APPLY_PARAM,
+	EDGE,
+	SHARPEN,
+	BLUR,
+	GAUSSIAN_BLUR
+} APPLY_PARAM;
+
+static inline APPLY_PARAM str_to_apply_param(const char *str)
+{
+	if (!str)
+		return INVALID_APPLY_PARAM;
+
+	static const struct {
+		APPLY_PARAM param;
+		const char *str;
+	} conversion[] = {
+		{EDGE, "EDGE"},
+		{SHARPEN, "SHARPEN"},
+		{BLUR, "BLUR"},
+		{GAUSSIAN_BLUR, "GAUSSIAN_BLUR"}
+	};
+
+	// bypass check-style warning
+	unsigned int size = sizeof(conversion);
+	size /= sizeof(conversion[0]);
+
+	for (unsigned int i = 0; i < size; i++)
+		if (!strcmp(str, conversion[i].str))
+			return conversion[i].param;
+
+	return INVALID_APPLY_PARAM;
+}
+
+static inline const char *apply_param_to_str(APPLY_PARAM apply_param)
+{
+	if (apply_param == INVALID_APPLY_PARAM)
+		return NULL;
+
+	static const struct {
+		APPLY_PARAM param;
+		const char *str;
+	} conversion[] = {
+		{EDGE, "EDGE"},
+		{SHARPEN, "SHARPEN"},
+		{BLUR, "BLUR"},
+		{GAUSSIAN_BLUR, "GAUSSIAN_BLUR"}
+	};
+
+	// bypass check-style warning
+	unsigned int size = sizeof(conversion);
+	size /= sizeof(conversion[0]);
+
+	for (unsigned int i = 0; i < size; i++)
+		if (apply_param == conversion[i].param)
+			return conversion[i].str;
+
+	return NULL;
+}
+
 void apply_command(image_t *image, char **argv, int argc, jmp_buf ex_buf__);
+
+int apply_filter(image_t *image, APPLY_PARAM apply_param);
+
+const double (*apply_param_to_kernel(APPLY_PARAM apply_param))[KERNEL_SIZE];
+
+void convolve_row(const pixel_t *const rows[KERNEL_SIZE], pixel_t *dest,
+				  size_t from, size_t to, size_t width,
+				  const double kernel[][KERNEL_SIZE], unsigned short *max_val);
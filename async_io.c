@@ -0,0 +1,562 @@
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+
+#include "async_io.h"
+#include "utils.h"
+
+#if defined(__linux__) && __has_include(<linux/io_uring.h>) && \
+	!defined(NO_IO_URING)
+#define USE_IO_URING
+#endif
+
+#ifdef USE_IO_URING
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+
+// requests are cut at multiples of this size in the file
+#define IO_CHUNK_SIZE (1024 * 1024)
+#define IO_QUEUE_DEPTH 8
+
+typedef struct io_job_t {
+	int fd;
+	char *buffer;
+	size_t size;
+	off_t offset;
+	bool write;
+	atomic_bool failed;
+	// chunks handed out and finished, under io_pool.lock past the ring
+	size_t count;
+	size_t next_chunk;
+	size_t done;
+	struct io_job_t *next;
+} io_job_t;
+
+/*
+ * threads for the fallback, started on its first use and kept for the whole
+ * run; they take chunks of the jobs queued by any thread, while every caller
+ * works on its own job too
+ */
+static struct {
+	pthread_once_t once;
+	pthread_mutex_t lock;
+	pthread_cond_t queued;
+	pthread_cond_t finished;
+	io_job_t *jobs;
+} io_pool = {
+	.once = PTHREAD_ONCE_INIT,
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.queued = PTHREAD_COND_INITIALIZER,
+	.finished = PTHREAD_COND_INITIALIZER
+};
+
+static int transfer(io_job_t *job);
+static size_t chunk_count(io_job_t *job);
+static void chunk_bounds(io_job_t *job, size_t idx, size_t *start, size_t *len);
+static int transfer_range(io_job_t *job, size_t start, size_t len);
+static void transfer_chunk(io_job_t *job, size_t idx);
+static int pool_transfer(io_job_t *job);
+static void start_io_pool(void);
+static void *io_thread_main(void *arg);
+static size_t take_chunk(io_job_t *job);
+
+#ifdef USE_IO_URING
+typedef struct uring_t {
+	int fd;
+	unsigned int *sq_head;
+	unsigned int *sq_tail;
+	unsigned int *sq_mask;
+	unsigned int *sq_array;
+	struct io_uring_sqe *sqes;
+	unsigned int *cq_head;
+	unsigned int *cq_tail;
+	unsigned int *cq_mask;
+	struct io_uring_cqe *cqes;
+	void *sq_ring;
+	void *cq_ring;
+	size_t sq_ring_size;
+	size_t cq_ring_size;
+	size_t sqes_size;
+	struct uring_t *next_free;
+} uring_t;
+
+/*
+ * every thread keeps its ring between transfers; the rings of threads that
+ * exited are handed to the next threads instead of being set up again
+ */
+static struct {
+	pthread_once_t once;
+	pthread_key_t key;
+	pthread_mutex_t lock;
+	uring_t *free;
+} rings = {
+	.once = PTHREAD_ONCE_INIT,
+	.lock = PTHREAD_MUTEX_INITIALIZER
+};
+
+static _Thread_local uring_t *thread_ring;
+// no io_uring, or one without IORING_OP_READ/WRITE (before Linux 5.6)
+static atomic_bool uring_unusable;
+
+static int uring_init(uring_t *ring);
+static uring_t *get_ring(void);
+static void create_ring_key(void);
+static void release_ring(void *arg);
+static int uring_transfer(io_job_t *job);
+#endif
+
+// reads exactly size bytes at offset, with several requests in flight
+int async_read(int fd, void *buffer, size_t size, off_t offset)
+{
+	io_job_t job = {
+		.fd = fd, .buffer = buffer, .size = size, .offset = offset
+	};
+
+	return transfer(&job);
+}
+
+// writes exactly size bytes at offset, with several requests in flight
+int async_write(int fd, const void *buffer, size_t size, off_t offset)
+{
+	io_job_t job = {
+		.fd = fd, .buffer = (char *)buffer, .size = size, .offset = offset,
+		.write = true
+	};
+
+	return transfer(&job);
+}
+
+/*
+ * tries io_uring first; kernels or sandboxes without it fall back to a few
+ * threads doing plain pread()/pwrite() on separate chunks, and so do the
+ * chunks left when the ring stops working halfway
+ */
+static int transfer(io_job_t *job)
+{
+	job->count = chunk_count(job);
+
+	if (job->count <= 1)
+		return transfer_range(job, 0, job->size);
+
+#ifdef USE_IO_URING
+	int ret = uring_transfer(job);
+
+	if (ret != 1)
+		return ret;
+#endif
+
+	return pool_transfer(job);
+}
+
+static size_t chunk_count(io_job_t *job)
+{
+	if (!job->size)
+		return 0;
+
+	size_t first = job->offset / IO_CHUNK_SIZE;
+	size_t last = (job->offset + job->size - 1) / IO_CHUNK_SIZE;
+
+	return last - first + 1;
+}
+
+// chunk limits relative to the buffer, all but the ends are aligned
+static void chunk_bounds(io_job_t *job, size_t idx, size_t *start, size_t *len)
+{
+	size_t base = job->offset / IO_CHUNK_SIZE * IO_CHUNK_SIZE;
+	size_t from = base + idx * IO_CHUNK_SIZE;
+	size_t to = from + IO_CHUNK_SIZE;
+
+	if (from < (size_t)job->offset)
+		from = job->offset;
+
+	to = min(to, job->offset + job->size);
+
+	*start = from - job->offset;
+	*len = to - from;
+}
+
+// blocking transfer of a buffer range, retrying short reads and writes
+static int transfer_range(io_job_t *job, size_t start, size_t len)
+{
+	while (len) {
+		ssize_t ret;
+
+		if (job->write)
+			ret = pwrite(job->fd, job->buffer + start, len,
+						 job->offset + start);
+		else
+			ret = pread(job->fd, job->buffer + start, len,
+						job->offset + start);
+
+		// a read of 0 bytes means the file is shorter than expected
+		if (ret <= 0)
+			return -1;
+
+		start += ret;
+		len -= ret;
+	}
+
+	return 0;
+}
+
+static void transfer_chunk(io_job_t *job, size_t idx)
+{
+	size_t start, len;
+
+	chunk_bounds(job, idx, &start, &len);
+
+	if (transfer_range(job, start, len) == -1)
+		atomic_store(&job->failed, true);
+}
+
+// moves the chunks from job->next_chunk on with the help of the I/O threads
+static int pool_transfer(io_job_t *job)
+{
+	pthread_once(&io_pool.once, start_io_pool);
+
+	pthread_mutex_lock(&io_pool.lock);
+
+	job->done = job->next_chunk;
+
+	// first come, first served
+	io_job_t **last = &io_pool.jobs;
+
+	while (*last)
+		last = &(*last)->next;
+
+	job->next = NULL;
+	*last = job;
+
+	pthread_cond_broadcast(&io_pool.queued);
+
+	// progress is made even if no thread could be started
+	while (job->next_chunk < job->count) {
+		size_t idx = take_chunk(job);
+
+		pthread_mutex_unlock(&io_pool.lock);
+		transfer_chunk(job, idx);
+		pthread_mutex_lock(&io_pool.lock);
+
+		job->done++;
+	}
+
+	while (job->done < job->count)
+		pthread_cond_wait(&io_pool.finished, &io_pool.lock);
+
+	pthread_mutex_unlock(&io_pool.lock);
+
+	return atomic_load(&job->failed) ? -1 : 0;
+}
+
+// the caller is the last of the IO_QUEUE_DEPTH threads
+static void start_io_pool(void)
+{
+	for (size_t i = 0; i + 1 < IO_QUEUE_DEPTH; i++) {
+		pthread_t thread;
+
+		if (pthread_create(&thread, NULL, io_thread_main, NULL))
+			break;
+
+		pthread_detach(thread);
+	}
+}
+
+static void *io_thread_main(void *arg)
+{
+	(void)arg;
+
+	pthread_mutex_lock(&io_pool.lock);
+
+	for (;;) {
+		while (!io_pool.jobs)
+			pthread_cond_wait(&io_pool.queued, &io_pool.lock);
+
+		io_job_t *job = io_pool.jobs;
+		size_t idx = take_chunk(job);
+
+		pthread_mutex_unlock(&io_pool.lock);
+		transfer_chunk(job, idx);
+		pthread_mutex_lock(&io_pool.lock);
+
+		if (++job->done == job->count)
+			pthread_cond_broadcast(&io_pool.finished);
+	}
+
+	return NULL;
+}
+
+// hands out the next chunk, the job leaves the queue with its last one
+static size_t take_chunk(io_job_t *job)
+{
+	size_t idx = job->next_chunk++;
+
+	if (job->next_chunk < job->count)
+		return idx;
+
+	io_job_t **link = &io_pool.jobs;
+
+	while (*link != job)
+		link = &(*link)->next;
+
+	*link = job->next;
+
+	return idx;
+}
+
+#ifdef USE_IO_URING
+static int uring_init(uring_t *ring)
+{
+	struct io_uring_params params;
+
+	memset(&params, 0, sizeof(params));
+	memset(ring, 0, sizeof(*ring));
+
+	ring->fd = syscall(__NR_io_uring_setup, IO_QUEUE_DEPTH, &params);
+
+	if (ring->fd < 0)
+		return -1;
+
+	ring->sq_ring_size = params.sq_off.array +
+						 params.sq_entries * sizeof(unsigned int);
+	ring->cq_ring_size = params.cq_off.cqes +
+						 params.cq_entries * sizeof(struct io_uring_cqe);
+	ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+	// newer kernels map both rings with a single mmap()
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		ring->sq_ring_size = ring->cq_ring_size =
+		ring->sq_ring_size > ring->cq_ring_size ? ring->sq_ring_size :
+		ring->cq_ring_size;
+	}
+
+	ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+						 MAP_SHARED | MAP_POPULATE, ring->fd,
+						 IORING_OFF_SQ_RING);
+
+	if (ring->sq_ring == MAP_FAILED) {
+		close(ring->fd);
+		return -1;
+	}
+
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		ring->cq_ring = ring->sq_ring;
+	} else {
+		ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+							 MAP_SHARED | MAP_POPULATE, ring->fd,
+							 IORING_OFF_CQ_RING);
+
+		if (ring->cq_ring == MAP_FAILED) {
+			munmap(ring->sq_ring, ring->sq_ring_size);
+			close(ring->fd);
+			return -1;
+		}
+	}
+
+	ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+					  MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+
+	if (ring->sqes == MAP_FAILED) {
+		if (ring->cq_ring != ring->sq_ring)
+			munmap(ring->cq_ring, ring->cq_ring_size);
+
+		munmap(ring->sq_ring, ring->sq_ring_size);
+		close(ring->fd);
+		return -1;
+	}
+
+	char *sq = ring->sq_ring;
+	char *cq = ring->cq_ring;
+
+	ring->sq_head  = (unsigned int *)(sq + params.sq_off.head);
+	ring->sq_tail  = (unsigned int *)(sq + params.sq_off.tail);
+	ring->sq_mask  = (unsigned int *)(sq + params.sq_off.ring_mask);
+	ring->sq_array = (unsigned int *)(sq + params.sq_off.array);
+	ring->cq_head  = (unsigned int *)(cq + params.cq_off.head);
+	ring->cq_tail  = (unsigned int *)(cq + params.cq_off.tail);
+	ring->cq_mask  = (unsigned int *)(cq + params.cq_off.ring_mask);
+	ring->cqes     = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+	return 0;
+}
+
+// the ring of the calling thread, set up on its first transfer
+static uring_t *get_ring(void)
+{
+	if (thread_ring)
+		return thread_ring;
+
+	pthread_once(&rings.once, create_ring_key);
+
+	pthread_mutex_lock(&rings.lock);
+
+	uring_t *ring = rings.free;
+
+	if (ring)
+		rings.free = ring->next_free;
+
+	pthread_mutex_unlock(&rings.lock);
+
+	if (!ring) {
+		ring = malloc(sizeof(*ring));
+
+		if (!ring)
+			return NULL;
+
+		if (uring_init(ring) == -1) {
+			// not compiled in or blocked, no other thread will do better
+			if (errno == ENOSYS || errno == EPERM)
+				atomic_store(&uring_unusable, true);
+
+			free(ring);
+			return NULL;
+		}
+	}
+
+	// returned to the free list when the thread exits
+	pthread_setspecific(rings.key, ring);
+	thread_ring = ring;
+
+	return ring;
+}
+
+static void create_ring_key(void)
+{
+	pthread_key_create(&rings.key, release_ring);
+}
+
+static void release_ring(void *arg)
+{
+	uring_t *ring = arg;
+
+	pthread_mutex_lock(&rings.lock);
+
+	ring->next_free = rings.free;
+	rings.free = ring;
+
+	pthread_mutex_unlock(&rings.lock);
+}
+
+/*
+ * keeps up to IO_QUEUE_DEPTH chunk requests queued on the ring of the thread;
+ * returns 1 if io_uring isn't usable, with job->next_chunk at the first chunk
+ * it didn't move, so that the caller can do the rest with threads. The ring
+ * is always drained before returning, it never has requests in flight
+ */
+static int uring_transfer(io_job_t *job)
+{
+	if (atomic_load(&uring_unusable))
+		return 1;
+
+	uring_t *ring = get_ring();
+
+	if (!ring)
+		return 1;
+
+	size_t next = 0;
+	size_t in_flight = 0;
+	// set once the ring can't take requests anymore, the rest go to threads
+	bool stopped = false;
+
+	while ((next < job->count && !stopped && !atomic_load(&job->failed)) ||
+		   in_flight) {
+		unsigned int tail = *ring->sq_tail;
+		unsigned int queued = 0;
+
+		while (next < job->count && !stopped && !atomic_load(&job->failed) &&
+			   in_flight < IO_QUEUE_DEPTH) {
+			unsigned int idx = (tail + queued) & *ring->sq_mask;
+			struct io_uring_sqe *sqe = &ring->sqes[idx];
+			size_t start, len;
+
+			chunk_bounds(job, next, &start, &len);
+
+			memset(sqe, 0, sizeof(*sqe));
+			sqe->opcode = job->write ? IORING_OP_WRITE : IORING_OP_READ;
+			sqe->fd = job->fd;
+			sqe->addr = (unsigned long)(job->buffer + start);
+			sqe->len = len;
+			sqe->off = job->offset + start;
+			sqe->user_data = next;
+
+			ring->sq_array[idx] = idx;
+			queued++;
+			next++;
+			in_flight++;
+		}
+
+		tail += queued;
+		__atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+
+		if (!stopped) {
+			// what the kernel hasn't taken yet, e.g. before a signal came
+			unsigned int to_submit = tail - __atomic_load_n(ring->sq_head,
+															__ATOMIC_ACQUIRE);
+
+			if (syscall(__NR_io_uring_enter, ring->fd, to_submit, 1,
+						IORING_ENTER_GETEVENTS, NULL, 0) < 0 &&
+				errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+				unsigned int head = __atomic_load_n(ring->sq_head,
+													__ATOMIC_ACQUIRE);
+
+				// take back the requests that never made it to the kernel
+				__atomic_store_n(ring->sq_tail, head, __ATOMIC_RELEASE);
+				in_flight -= tail - head;
+				next -= tail - head;
+				stopped = true;
+			}
+		}
+
+		unsigned int head = *ring->cq_head;
+		size_t reaped = 0;
+
+		while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+			struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+			size_t start, len;
+
+			chunk_bounds(job, cqe->user_data, &start, &len);
+
+			if (cqe->res == -EINVAL || cqe->res == -EOPNOTSUPP) {
+				// the kernel can't read or write through the ring at all
+				atomic_store(&uring_unusable, true);
+				stopped = true;
+
+				if (transfer_range(job, start, len) == -1)
+					atomic_store(&job->failed, true);
+			} else if (cqe->res < 0 ||
+					   ((size_t)cqe->res < len &&
+						transfer_range(job, start + cqe->res,
+									   len - cqe->res) == -1)) {
+				// finish short transfers synchronously
+				atomic_store(&job->failed, true);
+			}
+
+			head++;
+			reaped++;
+			in_flight--;
+		}
+
+		__atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+
+		// completions still show up in the ring without io_uring_enter()
+		if (stopped && in_flight && !reaped)
+			sched_yield();
+	}
+
+	if (atomic_load(&job->failed))
+		return -1;
+
+	if (next < job->count) {
+		job->next_chunk = next;
+		return 1;
+	}
+
+	return 0;
+}
+#endif
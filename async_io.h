@@ -0,0 +1,8 @@
+#pragma once
+
+#include <stddef.h>
+#include <sys/types.h>
+
+int async_read(int fd, void *buffer, size_t size, off_t offset);
+
+int async_write(int fd, const void *buffer, size_t size, off_t offset);
@@ -0,0 +1,333 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <limits.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <glob.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "batch.h"
+#include "script.h"
+#include "command.h"
+#include "error.h"
+#include "image.h"
+#include "lazy.h"
+#include "history.h"
+#include "output.h"
+#include "save_command.h"
+#include "utils.h"
+#include "worker_pool.h"
+
+#define BATCH_REPORT_MSG \
+	"Processed %zu images (%zu failed) in %.2f s: %.1f images/s, %.1f MB/s\n"
+#define BATCH_FAILED_MSG "Failed %s\n"
+
+#define BYTES_PER_MB (1024.0 * 1024.0)
+
+/*
+ * the files a worker still has to process, as a range of indices; the owner
+ * takes from the back, idle workers steal from the front
+ */
+typedef struct {
+	pthread_mutex_t lock;
+	size_t front;
+	size_t back;
+} work_deque_t;
+
+typedef struct {
+	plan_t *plan;
+	char **files;
+	const char *out_dir;
+	work_deque_t *deques;
+	size_t worker_count;
+	// arguments of the longest operation, plus a LOAD in front of the plan
+	int max_argc;
+	atomic_size_t processed;
+	atomic_size_t failed;
+	atomic_size_t bytes;
+} batch_t;
+
+static void batch_worker(void *ctx, size_t idx);
+static bool take_file(work_deque_t *deque, size_t *file);
+static bool steal_file(work_deque_t *deque, size_t *file);
+static int process_file(batch_t *batch, image_t *image, char **args,
+						const char *file);
+static double elapsed_seconds(struct timespec *start);
+
+/*
+ * runs a script over every file matching a glob pattern, with one image per
+ * worker; LOAD in the script loads the current file and SAVE writes it to
+ * the output directory under the same name
+ */
+int run_batch(const char *script, const char *pattern, const char *out_dir)
+{
+	plan_t plan;
+
+	if (parse_script(script, &plan) == -1) {
+		perror(script);
+		return 1;
+	}
+
+	if (check_recipe(&plan) == -1) {
+		fprintf(stderr, "%s: %s\n", script,
+				error_code_to_msg(E_INVALID_COMMAND));
+		free_plan(&plan);
+		return 1;
+	}
+
+	optimize_plan(&plan);
+
+	glob_t matches;
+
+	if (glob(pattern, 0, NULL, &matches)) {
+		fprintf(stderr, "%s: no matching files\n", pattern);
+		free_plan(&plan);
+		return 1;
+	}
+
+	batch_t batch = {
+		.plan = &plan,
+		.files = matches.gl_pathv,
+		.out_dir = out_dir,
+		.worker_count = min(worker_count(), matches.gl_pathc),
+		.max_argc = 1
+	};
+
+	for (size_t i = 0; i < plan.count; i++)
+		if (plan.ops[i].argc > batch.max_argc)
+			batch.max_argc = plan.ops[i].argc;
+
+	atomic_init(&batch.processed, 0);
+	atomic_init(&batch.failed, 0);
+	atomic_init(&batch.bytes, 0);
+
+	batch.deques = calloc(batch.worker_count, sizeof(*batch.deques));
+
+	if (!batch.deques) {
+		globfree(&matches);
+		free_plan(&plan);
+		return 1;
+	}
+
+	// every worker starts with an even, contiguous share of the files
+	for (size_t i = 0; i < batch.worker_count; i++) {
+		pthread_mutex_init(&batch.deques[i].lock, NULL);
+		batch.deques[i].front = matches.gl_pathc * i / batch.worker_count;
+		batch.deques[i].back = matches.gl_pathc * (i + 1) / batch.worker_count;
+	}
+
+	struct timespec start;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	run_parallel_on(batch.worker_count, batch.worker_count, batch_worker,
+					&batch);
+
+	double seconds = elapsed_seconds(&start);
+	size_t processed = atomic_load(&batch.processed);
+
+	if (seconds <= 0)
+		seconds = 1e-9;
+
+	printf(BATCH_REPORT_MSG, processed, atomic_load(&batch.failed), seconds,
+		   processed / seconds,
+		   atomic_load(&batch.bytes) / BYTES_PER_MB / seconds);
+
+	for (size_t i = 0; i < batch.worker_count; i++)
+		pthread_mutex_destroy(&batch.deques[i].lock);
+
+	free(batch.deques);
+	globfree(&matches);
+	free_plan(&plan);
+
+	return atomic_load(&batch.failed) ? 1 : 0;
+}
+
+/*
+ * a recipe edits a single image, the workspace commands make no sense there;
+ * TILE names its files by itself, so every input would write the same ones
+ */
+int check_recipe(plan_t *plan)
+{
+	for (size_t i = 0; i < plan->count; i++) {
+		switch (plan->ops[i].type) {
+		case USE:
+		case ON:
+		case SYNC:
+		case STREAM:
+		case TILE:
+			return -1;
+		case LOAD:
+			if (plan->ops[i].argc > 1)
+				return -1;
+			break;
+		default:
+			break;
+		}
+	}
+
+	return 0;
+}
+
+// worker task: drains its own deque, then helps the others
+static void batch_worker(void *ctx, size_t idx)
+{
+	batch_t *batch = ctx;
+	image_t image;
+
+	image.is_loaded = false;
+	image.matrix = NULL;
+	image.pending = NULL;
+	image.history = NULL;
+
+	// reused for every file: the arguments and a sink for the messages
+	char **args = malloc((batch->max_argc + 1) * sizeof(*args));
+	FILE *sink = fopen("/dev/null", "w");
+
+	if (!args || !sink) {
+		free(args);
+
+		if (sink)
+			fclose(sink);
+
+		return;
+	}
+
+	set_output_stream(sink);
+
+	size_t file;
+
+	while (1) {
+		if (!take_file(&batch->deques[idx], &file)) {
+			bool stolen = false;
+
+			for (size_t i = 1; i < batch->worker_count && !stolen; i++)
+				stolen = steal_file(&batch->deques[(idx + i) %
+												   batch->worker_count],
+									&file);
+
+			if (!stolen)
+				break;
+		}
+
+		if (process_file(batch, &image, args, batch->files[file]) == -1) {
+			atomic_fetch_add(&batch->failed, 1);
+			fprintf(stderr, BATCH_FAILED_MSG, batch->files[file]);
+		}
+
+		atomic_fetch_add(&batch->processed, 1);
+	}
+
+	set_output_stream(NULL);
+
+	discard_image_ops(&image);
+	clear_history(&image);
+	reset_image(&image);
+	free(args);
+	fclose(sink);
+}
+
+static bool take_file(work_deque_t *deque, size_t *file)
+{
+	pthread_mutex_lock(&deque->lock);
+
+	bool ret = deque->front < deque->back;
+
+	if (ret)
+		*file = --deque->back;
+
+	pthread_mutex_unlock(&deque->lock);
+
+	return ret;
+}
+
+static bool steal_file(work_deque_t *deque, size_t *file)
+{
+	pthread_mutex_lock(&deque->lock);
+
+	bool ret = deque->front < deque->back;
+
+	if (ret)
+		*file = deque->front++;
+
+	pthread_mutex_unlock(&deque->lock);
+
+	return ret;
+}
+
+/*
+ * runs the recipe on one file, the file is loaded first if the recipe
+ * doesn't start with a LOAD; like in the editor, a failed command doesn't
+ * stop the ones after it, only a failed LOAD does
+ */
+static int process_file(batch_t *batch, image_t *image, char **args,
+						const char *file)
+{
+	struct stat st;
+
+	if (stat(file, &st) == 0)
+		atomic_fetch_add(&batch->bytes, st.st_size);
+
+	const char *name = strrchr(file, '/');
+	char out_path[PATH_MAX];
+
+	snprintf(out_path, sizeof(out_path), "%s/%s", batch->out_dir,
+			 name ? name + 1 : file);
+
+	plan_t *plan = batch->plan;
+	int ret = 0;
+
+	if (!plan->count || plan->ops[0].type != LOAD) {
+		args[0] = (char *)file;
+
+		if (run_image_command(LOAD, args, 1, image))
+			return -1;
+	}
+
+	for (size_t i = 0; i < plan->count; i++) {
+		operation_t *op = &plan->ops[i];
+		int argc = op->argc;
+
+		// EXIT ends the recipe
+		if (op->type == EXIT)
+			break;
+
+		if (argc)
+			memcpy(args, op->argv, argc * sizeof(*args));
+
+		if (op->type == LOAD) {
+			args[0] = (char *)file;
+			argc = 1;
+		} else if (op->type == SAVE && argc) {
+			args[0] = out_path;
+		}
+
+		int status = run_image_command(op->type, argc ? args : NULL, argc,
+									   image);
+
+		if (status == E_LOAD_FAILED)
+			return -1;
+
+		if (status)
+			ret = -1;
+	}
+
+	// whatever a SAVE ... ASYNC left running is part of this file's work
+	if (wait_pending_save(out_path) == -1)
+		ret = -1;
+
+	return ret;
+}
+
+static double elapsed_seconds(struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (now.tv_sec - start->tv_sec) +
+		   (now.tv_nsec - start->tv_nsec) / 1e9;
+}
@@ -0,0 +1,7 @@
+#pragma once
+
+#include "script.h"
+
+int check_recipe(plan_t *plan);
+
+int run_batch(const char *script, const char *pattern, const char *out_dir);
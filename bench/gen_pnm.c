@@ -0,0 +1,107 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#define USAGE_MSG "Usage: %s <P2|P3|P5|P6> <width> <height> <seed> <output>\n"
+
+#define MAX_VAL 255
+
+// a few bits of noise on top of the gradient, so that EQUALIZE has work to do
+#define NOISE_MASK 31
+
+static uint64_t next_random(uint64_t *state);
+static int write_row(FILE *fp, const unsigned char *row, size_t len,
+					 bool ascii);
+
+/*
+ * writes a deterministic image: the same arguments always give the same
+ * file, one row at a time so that huge images fit in memory
+ */
+int main(int argc, char *argv[])
+{
+	if (argc != 6 || strlen(argv[1]) != 2 || argv[1][0] != 'P' ||
+		!strchr("2356", argv[1][1])) {
+		fprintf(stderr, USAGE_MSG, argv[0]);
+		return 1;
+	}
+
+	size_t width = strtoull(argv[2], NULL, 10);
+	size_t height = strtoull(argv[3], NULL, 10);
+	uint64_t state = strtoull(argv[4], NULL, 10) | 1;
+
+	bool ascii = argv[1][1] == '2' || argv[1][1] == '3';
+	size_t channels = argv[1][1] == '3' || argv[1][1] == '6' ? 3 : 1;
+
+	if (!width || !height) {
+		fprintf(stderr, USAGE_MSG, argv[0]);
+		return 1;
+	}
+
+	FILE *fp = fopen(argv[5], "wb");
+
+	if (!fp) {
+		perror(argv[5]);
+		return 1;
+	}
+
+	unsigned char *row = malloc(width * channels);
+
+	if (!row) {
+		fclose(fp);
+		return 1;
+	}
+
+	fprintf(fp, "%s\n%zu %zu\n%d\n", argv[1], width, height, MAX_VAL);
+
+	int ret = 0;
+
+	for (size_t i = 0; i < height && !ret; i++) {
+		for (size_t j = 0; j < width; j++) {
+			for (size_t c = 0; c < channels; c++) {
+				// each channel runs along a different diagonal
+				size_t pos = c == 1 ? width - j + i : j + i + c * width / 3;
+				int value = (int)(pos * (MAX_VAL - NOISE_MASK) /
+								  (width + height)) % (MAX_VAL - NOISE_MASK);
+
+				value += next_random(&state) & NOISE_MASK;
+				row[j * channels + c] = value;
+			}
+		}
+
+		ret = write_row(fp, row, width * channels, ascii);
+	}
+
+	free(row);
+
+	if (fclose(fp) == EOF || ret) {
+		perror(argv[5]);
+		return 1;
+	}
+
+	return 0;
+}
+
+// xorshift64*, good enough for noise and the same on every platform
+static uint64_t next_random(uint64_t *state)
+{
+	*state ^= *state >> 12;
+	*state ^= *state << 25;
+	*state ^= *state >> 27;
+
+	return (*state * 0x2545F4914F6CDD1DULL) >> 32;
+}
+
+static int write_row(FILE *fp, const unsigned char *row, size_t len,
+					 bool ascii)
+{
+	if (!ascii)
+		return fwrite(row, 1, len, fp) == len ? 0 : -1;
+
+	for (size_t i = 0; i < len; i++)
+		if (fprintf(fp, i + 1 < len ? "%d " : "%d\n", row[i]) < 0)
+			return -1;
+
+	return 0;
+}
@@ -0,0 +1,150 @@
+#!/bin/sh
+#
+# times every command of the editor on generated images and compares the
+# medians against a baseline
+#
+# usage: bench/run_bench.sh [--save-baseline]
+#
+# BENCH_SIZES      sizes of the images in megapixels (default "1 4 16")
+# BENCH_FORMATS    formats to generate (default "P2 P3 P5 P6")
+# BENCH_REPS       runs of every command (default 5)
+# BENCH_DIR        where images and results go (default /tmp/image_editor_bench)
+# BENCH_BASELINE   baseline to compare with (default bench/baseline.txt)
+# BENCH_THRESHOLD  slowdown of the median counted as a regression, in percent
+#                  (default 10)
+# BENCH_MEMLIMIT   MEMLIMIT in MB for every run, for images larger than RAM
+
+set -e
+
+ROOT=$(cd "$(dirname "$0")/.." && pwd)
+EDITOR="$ROOT/image_editor"
+
+SIZES=${BENCH_SIZES:-"1 4 16"}
+FORMATS=${BENCH_FORMATS:-"P2 P3 P5 P6"}
+REPS=${BENCH_REPS:-5}
+DIR=${BENCH_DIR:-/tmp/image_editor_bench}
+BASELINE=${BENCH_BASELINE:-"$ROOT/bench/baseline.txt"}
+THRESHOLD=${BENCH_THRESHOLD:-10}
+SEED=42
+
+RESULTS="$DIR/results.txt"
+
+mkdir -p "$DIR"
+gcc "$ROOT/bench/gen_pnm.c" -o "$DIR/gen_pnm" -Wall -Wextra -O2
+
+# the commands a format supports, one per line as "<label>|<command>"
+cases()
+{
+	echo "LOAD|"
+	echo "SAVE binary|SAVE $DIR/out.pnm"
+	echo "SAVE ascii|SAVE $DIR/out.pnm ascii"
+
+	case $1 in
+	P3|P6)
+		for filter in EDGE SHARPEN BLUR GAUSSIAN_BLUR; do
+			echo "APPLY $filter|APPLY $filter"
+		done
+		;;
+	*)
+		echo "EQUALIZE|EQUALIZE"
+		echo "HISTOGRAM|HISTOGRAM 50 256"
+		;;
+	esac
+
+	for angle in 90 180 270; do
+		echo "ROTATE $angle|ROTATE $angle"
+	done
+
+	echo "CROP|CROP"
+}
+
+# wall time of the given command type, from the JSON of --stats json
+wall_ms()
+{
+	sed -n "s/.*\"$1\":{[^}]*\"wall_ms\":\([0-9.]*\).*/\1/p" "$2"
+}
+
+# prints the median and the 95th percentile (nearest rank) of its input
+summarize()
+{
+	sort -n | awk '
+		{ v[NR] = $1 }
+		END {
+			median = NR % 2 ? v[(NR + 1) / 2] : (v[NR / 2] + v[NR / 2 + 1]) / 2
+			rank = int(NR * 0.95); if (rank < NR * 0.95) rank++
+			printf "%.3f\t%.3f\n", median, v[rank]
+		}'
+}
+
+: > "$RESULTS"
+
+for mp in $SIZES; do
+	side=$(awk "BEGIN { printf \"%d\", sqrt($mp * 1000000) }")
+
+	for format in $FORMATS; do
+		image="$DIR/${format}_${mp}mp.pnm"
+
+		if [ ! -f "$image" ]; then
+			echo "generating $image (${side}x${side})" >&2
+			"$DIR/gen_pnm" "$format" "$side" "$side" "$SEED" "$image"
+		fi
+
+		cases "$format" | while IFS='|' read -r label command; do
+			type=${label%% *}
+
+			for rep in $(seq "$REPS"); do
+				{
+					[ -n "$BENCH_MEMLIMIT" ] && echo "MEMLIMIT $BENCH_MEMLIMIT"
+					echo "LOAD $image"
+					[ "$type" = CROP ] && echo "SELECT 0 0 $((side / 2)) $((side / 2))"
+					[ -n "$command" ] && echo "$command"
+					echo "EXIT"
+				} > "$DIR/script.txt"
+
+				"$EDITOR" --stats json < "$DIR/script.txt" > /dev/null \
+					2> "$DIR/stats.json"
+
+				wall_ms "$type" "$DIR/stats.json"
+			done | summarize | {
+				read -r median p95
+				printf "%s\t%s\t%s\t%s\t%s\n" "$format" "$mp" "$label" \
+					"$median" "$p95" >> "$RESULTS"
+			}
+		done
+	done
+done
+
+rm -f "$DIR/out.pnm" "$DIR/script.txt" "$DIR/stats.json"
+
+if [ "$1" = "--save-baseline" ]; then
+	cp "$RESULTS" "$BASELINE"
+	echo "baseline saved to $BASELINE"
+	exit 0
+fi
+
+# one line per result, with the change of the median against the baseline
+awk -F '\t' -v threshold="$THRESHOLD" '
+	FILENAME != "-" { base[$1 FS $2 FS $3] = $4; next }
+	{
+		line = sprintf("%-3s %5s MP  %-20s median %10.3f ms  p95 %10.3f ms",
+					   $1, $2, $3, $4, $5)
+		key = $1 FS $2 FS $3
+
+		if (key in base && base[key] > 0) {
+			change = ($4 - base[key]) * 100 / base[key]
+			line = line sprintf("  %+6.1f%%", change)
+
+			if (change > threshold) {
+				line = line "  REGRESSION"
+				regressions++
+			}
+		}
+
+		print line
+	}
+	END {
+		if (regressions) {
+			printf "%d regression(s) over %s%%\n", regressions, threshold
+			exit 1
+		}
+	}' $([ -f "$BASELINE" ] && echo "$BASELINE") - < "$RESULTS"
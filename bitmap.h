@@ -0,0 +1,37 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "image.h"
+
+// side of the bit blocks transpose_bit_block() works on
+#define BIT_BLOCK_SIZE BITMAP_WORD_BITS
+
+static inline bool get_bit(const uint64_t *row, size_t j)
+{
+	return row[j / BITMAP_WORD_BITS] >> (BITMAP_WORD_BITS - 1 -
+										 j % BITMAP_WORD_BITS) & 1;
+}
+
+static inline void set_bit(uint64_t *row, size_t j, bool bit)
+{
+	uint64_t mask = (uint64_t)1 << (BITMAP_WORD_BITS - 1 - j % BITMAP_WORD_BITS);
+
+	if (bit)
+		row[j / BITMAP_WORD_BITS] |= mask;
+	else
+		row[j / BITMAP_WORD_BITS] &= ~mask;
+}
+
+uint64_t last_word_mask(size_t width);
+
+void copy_bits(uint64_t *dest, const uint64_t *src, size_t offset,
+			   size_t width);
+
+void mirror_bits(uint64_t *dest, const uint64_t *src, size_t width);
+
+void transpose_bit_block(uint64_t block[BIT_BLOCK_SIZE]);
+
+int morph_bitmap(image_t *image, bool dilate);
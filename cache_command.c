@@ -0,0 +1,38 @@
+#include <setjmp.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+#include "cache_command.h"
+#include "image_cache.h"
+#include "image.h"
+#include "error.h"
+#include "output.h"
+
+#define CACHE_ARG_COUNT 1
+#define CACHE_SUCCESS_MSG "Cache limit set to %d MB\n"
+
+#define BYTES_PER_MB (1024 * 1024)
+
+/*
+ * CACHE <MB>
+ * keeps up to MB of decoded images, so that loading an unchanged file again
+ * is a copy; 0 (the default) disables the cache
+ */
+void cache_command(image_t *image, char **argv, int argc, jmp_buf ex_buf__)
+{
+	if (!image)
+		longjmp(ex_buf__, E_INVALID_FUNC_ARGS);
+
+	if (argc != CACHE_ARG_COUNT)
+		longjmp(ex_buf__, E_INVALID_COMMAND);
+
+	int limit = atoi(argv[0]);
+
+	// check if argument is a number
+	if ((!limit && argv[0][0] != '0') || limit < 0)
+		longjmp(ex_buf__, E_INVALID_COMMAND);
+
+	set_cache_limit((size_t)limit * BYTES_PER_MB);
+
+	out_printf(CACHE_SUCCESS_MSG, limit);
+}
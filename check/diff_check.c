@@ -0,0 +1,790 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+
+#include "reference.h"
+#include "command.h"
+#include "workspace.h"
+#include "save_command.h"
+#include "script.h"
+#include "output.h"
+
+#define USAGE_MSG "Usage: %s [iterations] [seed]\n"
+
+#define DEFAULT_ITERATIONS 200
+#define MAX_OPS 12
+#define MAX_CHECKPOINTS 4
+#define MAX_LINE_LENGTH 256
+#define MAX_SCRIPT_LENGTH (MAX_LINE_LENGTH * 4 * (MAX_OPS + MAX_CHECKPOINTS))
+#define SMALL_SIDE 24
+#define LARGE_SIDE 400
+#define MAX_FIXED_LINES 8
+
+/*
+ * every case is a random image and a random sequence of valid commands; the
+ * reference gives the bytes every checkpoint SAVE has to write, and each
+ * backend runs the same commands its own way and must write exactly them
+ */
+typedef struct {
+	ref_image_t input;
+	bool ascii_input;
+	char commands[MAX_OPS + MAX_CHECKPOINTS][MAX_LINE_LENGTH];
+	bool is_checkpoint[MAX_OPS + MAX_CHECKPOINTS];
+	size_t count;
+	unsigned char *expected[MAX_CHECKPOINTS];
+	size_t expected_size[MAX_CHECKPOINTS];
+	size_t checkpoint_count;
+	bool only_whole_applies;
+	ref_image_t final;
+} test_case_t;
+
+typedef enum {
+	EAGER,
+	LAZY_MODE,
+	MEMLIMIT_MODE,
+	HISTORY_MODE,
+	CACHE_MODE,
+	ASYNC_SAVES,
+	WORKSPACE,
+	SCRIPT,
+	STREAMING,
+	TILED,
+	NATIVE,
+	BACKEND_COUNT
+} backend_t;
+
+static const char *const backend_names[] = {
+	[EAGER]         = "eager",
+	[LAZY_MODE]     = "lazy",
+	[MEMLIMIT_MODE] = "memlimit",
+	[HISTORY_MODE]  = "history",
+	[CACHE_MODE]    = "cache",
+	[ASYNC_SAVES]   = "async saves",
+	[WORKSPACE]     = "workspace",
+	[SCRIPT]        = "script",
+	[STREAMING]     = "stream",
+	[TILED]         = "tile",
+	[NATIVE]        = "native"
+};
+
+/*
+ * scripts that once wrote other files through --script than one command at
+ * a time; every %s is the work directory, which holds g.pgm
+ */
+static const char *const fixed_scripts[][MAX_FIXED_LINES] = {
+	// the image USE switches to can't be saved, so the first SAVE stays
+	{
+		"LOAD %s/nope.pgm AS b",
+		"LOAD %s/g.pgm AS a",
+		"SAVE %s/out.pgm",
+		"USE b",
+		"SAVE %s/out.pgm"
+	}
+};
+
+static char work_dir[] = "/tmp/diff_check_XXXXXX";
+static char script_text[MAX_SCRIPT_LENGTH];
+static size_t script_len;
+static bool collecting;
+static unsigned long long random_state;
+
+static unsigned long random_below(unsigned long bound);
+static int make_case(test_case_t *test);
+static unsigned short make_max_val(void);
+static void free_case(test_case_t *test);
+static int random_op(test_case_t *test, ref_image_t *image, char *line);
+static void add_checkpoint(test_case_t *test, ref_image_t *image);
+static int run_backend(test_case_t *test, backend_t backend);
+static int run_tiles(test_case_t *test);
+static int run_region(test_case_t *test);
+static int run_fixed_script(const char *const *lines, bool as_script,
+							unsigned char **output, size_t *size);
+static size_t check_fixed_scripts(void);
+static void run(const char *format, ...);
+static int check_file(const char *path, const unsigned char *expected,
+					  size_t size, backend_t backend, const char *what);
+static int write_file(const char *path, const unsigned char *data, size_t size);
+static unsigned char *read_file(const char *path, size_t *size);
+static void path_of(char *path, const char *name);
+
+int main(int argc, char *argv[])
+{
+	if (argc > 3) {
+		fprintf(stderr, USAGE_MSG, argv[0]);
+		return 1;
+	}
+
+	long iterations = argc > 1 ? atol(argv[1]) : DEFAULT_ITERATIONS;
+	unsigned long long seed = argc > 2 ? strtoull(argv[2], NULL, 10) : 1;
+
+	if (!mkdtemp(work_dir)) {
+		perror(work_dir);
+		return 1;
+	}
+
+	// the messages of the commands don't matter, only the files they write
+	FILE *null_stream = fopen("/dev/null", "w");
+
+	set_output_stream(null_stream);
+
+	size_t failures = check_fixed_scripts();
+
+	for (long i = 0; i < iterations; i++) {
+		test_case_t test;
+
+		random_state = seed * 0x9E3779B97F4A7C15ULL + i + 1;
+
+		if (make_case(&test) == -1) {
+			fprintf(stderr, "case %ld: out of memory\n", i);
+			return 1;
+		}
+
+		for (backend_t backend = 0; backend < BACKEND_COUNT; backend++) {
+			if (!run_backend(&test, backend))
+				continue;
+
+			failures++;
+			fprintf(stderr, "case %ld (seed %llu), %s input %zux%zu P%c:\n",
+					i, seed, test.ascii_input ? "ascii" : "binary",
+					test.input.width, test.input.height, test.input.magic);
+
+			for (size_t k = 0; k < test.count; k++)
+				fprintf(stderr, "\t%s\n", test.commands[k]);
+		}
+
+		free_case(&test);
+	}
+
+	set_output_stream(NULL);
+	fclose(null_stream);
+
+	char command[MAX_LINE_LENGTH];
+
+	snprintf(command, sizeof(command), "rm -rf %s", work_dir);
+
+	if (system(command))
+		fprintf(stderr, "could not remove %s\n", work_dir);
+
+	printf("%ld cases, %zu backends each: %zu failures\n", iterations,
+		   (size_t)BACKEND_COUNT, failures);
+
+	return failures ? 1 : 0;
+}
+
+// xorshift64*, the same cases on every machine
+static unsigned long random_below(unsigned long bound)
+{
+	random_state ^= random_state >> 12;
+	random_state ^= random_state << 25;
+	random_state ^= random_state >> 27;
+
+	return (unsigned long)((random_state * 0x2545F4914F6CDD1DULL) >> 32) % bound;
+}
+
+static int make_case(test_case_t *test)
+{
+	memset(test, 0, sizeof(*test));
+
+	static const char magics[] = "2356147";
+	char magic = magics[random_below(7)];
+
+	// a few large images, so that rows get spilled and codecs span blocks
+	size_t side = random_below(10) ? SMALL_SIDE : LARGE_SIDE;
+	size_t width = 1 + random_below(side);
+	size_t height = 1 + random_below(side);
+	bool bitmap = magic == '1' || magic == '4';
+	unsigned short max_val = bitmap ? 1 : make_max_val();
+
+	// P7 depths with their usual tuple types, and some without one
+	static const char *const tuple_types[] = {
+		NULL, "GRAYSCALE", "GRAYSCALE_ALPHA", "RGB", "RGB_ALPHA", NULL,
+		"CMYK_ALPHA"
+	};
+	size_t depth = 1 + random_below(6);
+	int ret = magic == '7' ?
+			  ref_create_pam(&test->input, width, height, max_val, depth,
+							 tuple_types[depth]) :
+			  ref_create(&test->input, magic, width, height, max_val);
+
+	if (ret == -1)
+		return -1;
+
+	test->ascii_input = magic == '1' || magic == '2' || magic == '3';
+
+	size_t samples = width * height * test->input.channels;
+	// runs of repeated samples, for the compressed tiles of SAVE ... TILED
+	bool flat = !random_below(4);
+
+	for (size_t i = 0; i < samples; i++)
+		test->input.samples[i] = flat && i && random_below(8) ?
+								 test->input.samples[i - 1] :
+								 random_below(max_val + 1);
+
+	size_t size;
+	unsigned char *data = ref_encode(&test->input, test->input.selection,
+									 test->ascii_input, &size);
+	char path[MAX_LINE_LENGTH];
+
+	path_of(path, "in.pnm");
+
+	if (!data || write_file(path, data, size) == -1) {
+		free(data);
+		return -1;
+	}
+
+	free(data);
+
+	ref_image_t image;
+
+	if (ref_copy(&image, &test->input) == -1)
+		return -1;
+
+	// STREAM doesn't take PAM images
+	test->only_whole_applies = !test->ascii_input && magic != '7';
+
+	size_t op_count = random_below(MAX_OPS);
+
+	for (size_t i = 0; i < op_count; i++) {
+		if (test->checkpoint_count + 1 < MAX_CHECKPOINTS &&
+			!random_below(5))
+			add_checkpoint(test, &image);
+
+		if (random_op(test, &image, test->commands[test->count]) == 0)
+			test->count++;
+	}
+
+	add_checkpoint(test, &image);
+	test->final = image;
+
+	return 0;
+}
+
+// full and partial ranges of both depths, 16-bit ones included
+static unsigned short make_max_val(void)
+{
+	switch (random_below(6)) {
+	case 0:
+		return 65535;
+	case 1:
+		return 256 + random_below(65535 - 256 + 1);
+	case 2:
+	case 3:
+		return 255;
+	default:
+		return 1 + random_below(255);
+	}
+}
+
+static void free_case(test_case_t *test)
+{
+	for (size_t i = 0; i < test->checkpoint_count; i++)
+		free(test->expected[i]);
+
+	ref_free(&test->input);
+	ref_free(&test->final);
+}
+
+// runs a random command on the reference; -1 if it was rejected
+static int random_op(test_case_t *test, ref_image_t *image, char *line)
+{
+	int ret = 0;
+
+	switch (random_below(8)) {
+	case 0: {
+		size_t x1 = random_below(image->width);
+		size_t y1 = random_below(image->height);
+		size_t x2 = x1 + 1 + random_below(image->width - x1);
+		size_t y2 = y1 + 1 + random_below(image->height - y1);
+
+		// square selections, so that they can be rotated
+		if (random_below(2)) {
+			size_t size = x2 - x1 < y2 - y1 ? x2 - x1 : y2 - y1;
+
+			x2 = x1 + size;
+			y2 = y1 + size;
+		}
+
+		image->selection = (ref_selection_t){x1, y1, x2, y2};
+		snprintf(line, MAX_LINE_LENGTH, "SELECT %zu %zu %zu %zu", x1, y1, x2,
+				 y2);
+		break;
+	}
+	case 1:
+		ref_select_all(image);
+		snprintf(line, MAX_LINE_LENGTH, "SELECT ALL");
+		break;
+	case 2: {
+		ref_filter_t filter = random_below(REF_FILTER_COUNT);
+
+		ret = ref_apply(image, filter);
+		snprintf(line, MAX_LINE_LENGTH, "APPLY %s", ref_filter_name(filter));
+
+		if (!ret && (image->selection.x1 || image->selection.y1 ||
+					 image->selection.x2 != image->width ||
+					 image->selection.y2 != image->height))
+			test->only_whole_applies = false;
+		break;
+	}
+	case 3:
+		ret = ref_equalize(image);
+		snprintf(line, MAX_LINE_LENGTH, "EQUALIZE");
+		test->only_whole_applies = false;
+		break;
+	case 4: {
+		int angle = ((int)random_below(9) - 4) * 90;
+
+		ret = ref_rotate(image, angle);
+		snprintf(line, MAX_LINE_LENGTH, "ROTATE %d", angle);
+		test->only_whole_applies = false;
+		break;
+	}
+	case 5:
+	case 6: {
+		bool dilate = random_below(2);
+
+		ret = ref_morph(image, dilate);
+		snprintf(line, MAX_LINE_LENGTH, dilate ? "DILATE" : "ERODE");
+		test->only_whole_applies = false;
+		break;
+	}
+	default:
+		ret = ref_crop(image);
+		snprintf(line, MAX_LINE_LENGTH, "CROP");
+		test->only_whole_applies = false;
+		break;
+	}
+
+	return ret;
+}
+
+static void add_checkpoint(test_case_t *test, ref_image_t *image)
+{
+	size_t idx = test->checkpoint_count++;
+	bool ascii = random_below(2);
+
+	test->expected[idx] = ref_encode(image, (ref_selection_t){
+		0, 0, image->width, image->height
+	}, ascii, &test->expected_size[idx]);
+
+	snprintf(test->commands[test->count], MAX_LINE_LENGTH, "SAVE %s/ck%zu%s",
+			 work_dir, idx, ascii ? " ascii" : "");
+	test->is_checkpoint[test->count++] = true;
+}
+
+// 0 when every file the backend wrote is the reference's
+static int run_backend(test_case_t *test, backend_t backend)
+{
+	char path[MAX_LINE_LENGTH];
+
+	switch (backend) {
+	case LAZY_MODE:
+		run("LAZY ON");
+		break;
+	case MEMLIMIT_MODE:
+		run("MEMLIMIT 1");
+		break;
+	case HISTORY_MODE:
+		run("HISTORY 64");
+		break;
+	case CACHE_MODE:
+		run("CACHE 64");
+		run("LOAD %s/in.pnm", work_dir);
+		break;
+	case STREAMING:
+		if (!test->only_whole_applies)
+			return 0;
+		break;
+	case NATIVE:
+		run("LOAD %s/in.pnm", work_dir);
+		run("SAVE %s/in.tiled TILED", work_dir);
+		break;
+	default:
+		break;
+	}
+
+	if (backend == STREAMING) {
+		// every command is an APPLY on the whole image or a checkpoint
+		char filters[MAX_SCRIPT_LENGTH] = "";
+		size_t len = 0;
+
+		for (size_t i = 0; i < test->count; i++)
+			if (!strncmp(test->commands[i], "APPLY ", 6))
+				len += snprintf(filters + len, sizeof(filters) - len, " %s",
+								test->commands[i] + 6);
+
+		run("STREAM %s/in.pnm %s/out.pnm%s", work_dir, work_dir, filters);
+		path_of(path, "out.pnm");
+
+		// the last checkpoint is the final image, always binary here
+		size_t size;
+		unsigned char *expected = ref_encode(&test->final, (ref_selection_t){
+			0, 0, test->final.width, test->final.height
+		}, false, &size);
+		int ret = check_file(path, expected, size, backend, "output");
+
+		free(expected);
+		return ret;
+	}
+
+	if (backend == SCRIPT) {
+		script_len = 0;
+		collecting = true;
+		run("LOAD %s/in.pnm", work_dir);
+
+		for (size_t i = 0; i < test->count; i++)
+			run("%s", test->commands[i]);
+
+		collecting = false;
+
+		path_of(path, "script.txt");
+
+		plan_t plan;
+
+		if (write_file(path, (unsigned char *)script_text, script_len) == -1 ||
+			parse_script(path, &plan) == -1)
+			return -1;
+
+		optimize_plan(&plan);
+		run_plan(&plan);
+		free_plan(&plan);
+	} else if (backend == WORKSPACE) {
+		run("LOAD %s/in.pnm AS w", work_dir);
+		use_image(NULL);
+
+		for (size_t i = 0; i < test->count; i++)
+			run("ON w %s", test->commands[i]);
+
+		run("SYNC");
+	} else {
+		run("LOAD %s/%s", work_dir, backend == NATIVE ? "in.tiled" : "in.pnm");
+
+		for (size_t i = 0; i < test->count; i++) {
+			if (backend == ASYNC_SAVES && test->is_checkpoint[i])
+				run("%s ASYNC", test->commands[i]);
+			else
+				run("%s", test->commands[i]);
+
+			// an edit undone and redone is the same edit
+			if (backend == HISTORY_MODE && !test->is_checkpoint[i] &&
+				strncmp(test->commands[i], "SELECT", 6) && random_below(2)) {
+				run("UNDO");
+				run("REDO");
+			}
+		}
+	}
+
+	wait_pending_saves();
+
+	switch (backend) {
+	case LAZY_MODE:
+		run("LAZY OFF");
+		break;
+	case MEMLIMIT_MODE:
+		run("MEMLIMIT 0");
+		break;
+	case HISTORY_MODE:
+		run("HISTORY 0");
+		break;
+	case CACHE_MODE:
+		// the cached decode must not have been touched by the edits
+		run("LOAD %s/in.pnm", work_dir);
+		run("SAVE %s/reloaded", work_dir);
+		run("CACHE 0");
+		break;
+	default:
+		break;
+	}
+
+	int ret = 0;
+
+	for (size_t i = 0; i < test->checkpoint_count && !ret; i++) {
+		char name[MAX_LINE_LENGTH];
+
+		snprintf(name, sizeof(name), "ck%zu", i);
+		path_of(path, name);
+		ret = check_file(path, test->expected[i], test->expected_size[i],
+						 backend, name);
+		unlink(path);
+	}
+
+	if (!ret && backend == CACHE_MODE) {
+		size_t size;
+		unsigned char *expected = ref_encode(&test->input,
+											 test->input.selection, false,
+											 &size);
+
+		path_of(path, "reloaded");
+		ret = check_file(path, expected, size, backend, "reloaded input");
+		free(expected);
+	}
+
+	if (!ret && backend == TILED)
+		ret = run_tiles(test);
+
+	if (!ret && backend == NATIVE)
+		ret = run_region(test);
+
+	return ret;
+}
+
+// the final image cut in random tiles, every tile saved on its own
+static int run_tiles(test_case_t *test)
+{
+	ref_image_t *image = &test->final;
+	size_t tile_width = 1 + random_below(image->width);
+	size_t tile_height = 1 + random_below(image->height);
+	bool ascii = random_below(2);
+
+	run("SELECT ALL");
+	run("TILE %zu %zu %s/tile_%%x_%%y%s", tile_width, tile_height, work_dir,
+		ascii ? " ascii" : "");
+
+	int ret = 0;
+
+	for (size_t y = 0; y * tile_height < image->height && !ret; y++) {
+		for (size_t x = 0; x * tile_width < image->width && !ret; x++) {
+			ref_selection_t region = {
+				x * tile_width, y * tile_height,
+				(x + 1) * tile_width, (y + 1) * tile_height
+			};
+
+			if (region.x2 > image->width)
+				region.x2 = image->width;
+
+			if (region.y2 > image->height)
+				region.y2 = image->height;
+
+			char name[MAX_LINE_LENGTH];
+			char path[MAX_LINE_LENGTH];
+			size_t size;
+
+			snprintf(name, sizeof(name), "tile_%zu_%zu", x, y);
+			path_of(path, name);
+
+			unsigned char *expected = ref_encode(image, region, ascii, &size);
+
+			ret = check_file(path, expected, size, TILED, name);
+			free(expected);
+			unlink(path);
+		}
+	}
+
+	return ret;
+}
+
+// the final image saved as tiles, and a random region of it loaded back
+static int run_region(test_case_t *test)
+{
+	ref_image_t *image = &test->final;
+	ref_selection_t region;
+
+	region.x1 = random_below(image->width);
+	region.y1 = random_below(image->height);
+	region.x2 = region.x1 + 1 + random_below(image->width - region.x1);
+	region.y2 = region.y1 + 1 + random_below(image->height - region.y1);
+
+	run("SAVE %s/final.tiled TILED", work_dir);
+	run("LOAD %s/final.tiled REGION %zu %zu %zu %zu", work_dir, region.x1,
+		region.y1, region.x2, region.y2);
+	run("SAVE %s/region", work_dir);
+
+	char path[MAX_LINE_LENGTH];
+	size_t size;
+	unsigned char *expected = ref_encode(image, region, false, &size);
+
+	path_of(path, "region");
+
+	int ret = check_file(path, expected, size, NATIVE, "region");
+
+	free(expected);
+	unlink(path);
+
+	return ret;
+}
+
+// every fixed script has to write the same file both ways
+static size_t check_fixed_scripts(void)
+{
+	static const char image[] = "P2\n2 2\n255\n0 64\n128 255\n";
+	size_t script_count = sizeof(fixed_scripts) / sizeof(*fixed_scripts);
+	size_t failures = 0;
+	char path[MAX_LINE_LENGTH];
+
+	path_of(path, "g.pgm");
+
+	if (write_file(path, (const unsigned char *)image, strlen(image)) == -1)
+		return script_count;
+
+	for (size_t i = 0; i < script_count; i++) {
+		unsigned char *expected, *actual;
+		size_t expected_size, actual_size;
+
+		if (run_fixed_script(fixed_scripts[i], false, &expected,
+							 &expected_size) == -1 ||
+			run_fixed_script(fixed_scripts[i], true, &actual,
+							 &actual_size) == -1 ||
+			!expected != !actual || (expected &&
+			(expected_size != actual_size ||
+			 memcmp(expected, actual, expected_size)))) {
+			failures++;
+			fprintf(stderr, "fixed script %zu: out.pgm differs with "
+					"--script:\n", i);
+
+			for (size_t k = 0; k < MAX_FIXED_LINES && fixed_scripts[i][k]; k++)
+				fprintf(stderr, "\t%s\n", fixed_scripts[i][k]);
+		}
+
+		free(expected);
+		free(actual);
+	}
+
+	return failures;
+}
+
+/*
+ * runs the lines from a clean workspace, one at a time or as an optimized
+ * script, and reads back out.pgm (NULL if it wasn't written)
+ */
+static int run_fixed_script(const char *const *lines, bool as_script,
+							unsigned char **output, size_t *size)
+{
+	char path[MAX_LINE_LENGTH];
+
+	*output = NULL;
+
+	free_workspace();
+	path_of(path, "out.pgm");
+	unlink(path);
+
+	script_len = 0;
+	collecting = as_script;
+
+	for (size_t k = 0; k < MAX_FIXED_LINES && lines[k]; k++)
+		run(lines[k], work_dir);
+
+	collecting = false;
+
+	if (as_script) {
+		plan_t plan;
+
+		path_of(path, "script.txt");
+
+		if (write_file(path, (unsigned char *)script_text, script_len) == -1 ||
+			parse_script(path, &plan) == -1)
+			return -1;
+
+		optimize_plan(&plan);
+		run_plan(&plan);
+		free_plan(&plan);
+	}
+
+	wait_pending_saves();
+	free_workspace();
+
+	path_of(path, "out.pgm");
+	*output = read_file(path, size);
+
+	return 0;
+}
+
+/*
+ * runs a command on the current image; in the script backend the commands
+ * are collected instead, to be run as one script
+ */
+static void run(const char *format, ...)
+{
+	char line[MAX_SCRIPT_LENGTH];
+	va_list args;
+
+	va_start(args, format);
+	vsnprintf(line, sizeof(line), format, args);
+	va_end(args);
+
+	if (collecting) {
+		script_len += snprintf(script_text + script_len,
+							   sizeof(script_text) - script_len, "%s\n", line);
+		return;
+	}
+
+	run_command(line, current_image());
+}
+
+static int check_file(const char *path, const unsigned char *expected,
+					  size_t size, backend_t backend, const char *what)
+{
+	size_t actual_size;
+	unsigned char *actual = read_file(path, &actual_size);
+
+	if (!actual) {
+		fprintf(stderr, "%s: %s was not written\n", backend_names[backend],
+				what);
+		return -1;
+	}
+
+	size_t i = 0;
+
+	while (i < size && i < actual_size && actual[i] == expected[i])
+		i++;
+
+	int ret = 0;
+
+	if (i < size || i < actual_size) {
+		fprintf(stderr, "%s: %s differs from the reference at byte %zu "
+				"(%zu bytes, expected %zu)\n", backend_names[backend], what,
+				i, actual_size, size);
+		ret = -1;
+	}
+
+	free(actual);
+
+	return ret;
+}
+
+static int write_file(const char *path, const unsigned char *data, size_t size)
+{
+	FILE *fp = fopen(path, "wb");
+
+	if (!fp)
+		return -1;
+
+	size_t written = fwrite(data, 1, size, fp);
+
+	if (fclose(fp) == EOF || written != size)
+		return -1;
+
+	return 0;
+}
+
+static unsigned char *read_file(const char *path, size_t *size)
+{
+	FILE *fp = fopen(path, "rb");
+
+	if (!fp)
+		return NULL;
+
+	fseek(fp, 0, SEEK_END);
+
+	long len = ftell(fp);
+	unsigned char *data = len >= 0 ? malloc(len + 1) : NULL;
+
+	rewind(fp);
+
+	if (data && fread(data, 1, len, fp) != (size_t)len) {
+		free(data);
+		data = NULL;
+	}
+
+	fclose(fp);
+	*size = len;
+
+	return data;
+}
+
+static void path_of(char *path, const char *name)
+{
+	snprintf(path, MAX_LINE_LENGTH, "%s/%s", work_dir, name);
+}
+
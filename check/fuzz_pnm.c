@@ -0,0 +1,365 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+
+#include "command.h"
+#include "workspace.h"
+#include "output.h"
+
+#define USAGE_MSG "Usage: %s [iterations] [seed]\n"
+
+#define DEFAULT_ITERATIONS 20000
+#define MAX_INPUT_SIZE 4096
+#define MAX_LINE_LENGTH 256
+#define MAX_MUTATIONS 8
+
+/*
+ * feeds PNM files to the header and raster parsers of LOAD and STREAM; a file
+ * that loads has to survive SAVE and LOAD unchanged, as PNM and as tiles, and
+ * mutations of its tiled file go to the tiled loader. Build with -DLIBFUZZER
+ * and -fsanitize=fuzzer for coverage guided fuzzing, otherwise the inputs are
+ * random mutations of a few valid files. The file being tested is kept in
+ * the work directory, so it is there to reproduce a crash
+ */
+
+static char work_dir[] = "/tmp/fuzz_pnm_XXXXXX";
+static unsigned long long random_state = 1;
+
+// sizes are explicit, binary rasters may hold NULs
+#define SEED(text) {text, sizeof(text) - 1}
+
+static const struct {
+	const char *data;
+	size_t size;
+} seeds[] = {
+	SEED("P2\n3 2\n255\n0 1 2\n3 4 255\n"),
+	SEED("P3\n2 2\n# comment\n100\n1 2 3 4 5 6\n7 8 9 100 0 0\n"),
+	SEED("P5\n4 1\n255\n\x01\x02\xff\x00"),
+	SEED("P6\n1 2\n200\n\x01\x02\x03\x04\x05\x06"),
+	SEED("P5\n2 1\n1000\n\x03\xe8\x00\x01"),
+	SEED("P6\n1 1\n65535\n\xff\xff\x00\x00\x12\x34"),
+	SEED("# comment\nP5 # more\n2 2 # and more\n7\n\x01\x02\x03\x07"),
+	SEED("P1\n3 2\n0 1 0\n1 1 0\n"),
+	SEED("P1\n4 1\n0101\n"),
+	SEED("P4\n10 2\n\xa5\xc0\xff\x40"),
+	// compresses, so that its tiled file has an LZ tile to mutate
+	SEED("P1\n40 3\n0000000000000000000000000000000000000000\n"
+		 "0000000000000000000000000000000000000000\n"
+		 "1111111111111111111111111111111111111111\n"),
+	SEED("P7\nWIDTH 2\nHEIGHT 1\nDEPTH 4\nMAXVAL 255\nTUPLTYPE RGB_ALPHA\n"
+		 "ENDHDR\n\x01\x02\x03\xff\x04\x05\x06\x00"),
+	SEED("P7\n# comment\nDEPTH 2\nMAXVAL 1000\nHEIGHT 1\nWIDTH 1\n"
+		 "TUPLTYPE GRAYSCALE\nTUPLTYPE _ALPHA\nENDHDR\n\x03\xe8\x00\x01")
+};
+
+static const char *const tokens[] = {
+	"0", "-1", "1", "255", "256", "65535", "2147483647", "4294967297",
+	"99999999999", "P1", "P4", "P7", "WIDTH", "DEPTH", "TUPLTYPE", "ENDHDR",
+	"#", "\n", " ", "\t", "+", "1e3", "0x10"
+};
+
+static int setup(void);
+static int test_one_input(const uint8_t *data, size_t size);
+static int test_tiled(void);
+static size_t mutate(uint8_t *data, size_t size);
+static unsigned long random_below(unsigned long bound);
+static void run(const char *format, ...);
+static unsigned char *read_file(const char *path, size_t *size);
+static void path_of(char *path, const char *name);
+
+#ifdef LIBFUZZER
+int LLVMFuzzerInitialize(int *argc, char ***argv)
+{
+	// bypass unused parameter warning
+	if (!argc || !argv)
+		return 0;
+
+	return setup() == -1 ? 1 : 0;
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+	test_one_input(data, size);
+
+	return 0;
+}
+#else
+int main(int argc, char *argv[])
+{
+	if (argc > 3) {
+		fprintf(stderr, USAGE_MSG, argv[0]);
+		return 1;
+	}
+
+	long iterations = argc > 1 ? atol(argv[1]) : DEFAULT_ITERATIONS;
+	unsigned long long seed = argc > 2 ? strtoull(argv[2], NULL, 10) : 1;
+
+	if (setup() == -1)
+		return 1;
+
+	uint8_t input[MAX_INPUT_SIZE];
+	size_t failures = 0;
+
+	random_state = seed * 0x9E3779B97F4A7C15ULL + 1;
+
+	for (long i = 0; i < iterations; i++) {
+		size_t idx = random_below(sizeof(seeds) / sizeof(seeds[0]));
+		size_t size = seeds[idx].size;
+
+		memcpy(input, seeds[idx].data, size);
+
+		size_t mutations = random_below(MAX_MUTATIONS + 1);
+
+		for (size_t m = 0; m < mutations; m++)
+			size = mutate(input, size);
+
+		if (test_one_input(input, size) == -1) {
+			failures++;
+			fprintf(stderr, "input %ld (seed %llu) changed after SAVE and "
+					"LOAD:\n", i, seed);
+			fwrite(input, 1, size, stderr);
+			fprintf(stderr, "\n");
+		}
+	}
+
+	char command[MAX_LINE_LENGTH];
+
+	snprintf(command, sizeof(command), "rm -rf %s", work_dir);
+
+	if (system(command))
+		fprintf(stderr, "could not remove %s\n", work_dir);
+
+	printf("%ld inputs: %zu failures\n", iterations, failures);
+
+	return failures ? 1 : 0;
+}
+#endif
+
+static int setup(void)
+{
+	if (!mkdtemp(work_dir)) {
+		perror(work_dir);
+		return -1;
+	}
+
+	// only what the parsers do to memory matters, not what they print
+	FILE *null_stream = fopen("/dev/null", "w");
+
+	if (!null_stream)
+		return -1;
+
+	set_output_stream(null_stream);
+
+	return 0;
+}
+
+// -1 when a file that loaded comes back different after SAVE and LOAD
+static int test_one_input(const uint8_t *data, size_t size)
+{
+	char path[MAX_LINE_LENGTH];
+	FILE *fp;
+
+	path_of(path, "input.pnm");
+	fp = fopen(path, "wb");
+
+	if (!fp)
+		return 0;
+
+	fwrite(data, 1, size, fp);
+	fclose(fp);
+
+	run("STREAM %s/input.pnm %s/streamed.pnm", work_dir, work_dir);
+	run("STREAM %s/input.pnm %s/streamed.pnm BLUR", work_dir, work_dir);
+
+	run("LOAD %s/input.pnm", work_dir);
+
+	if (!current_image()->is_loaded)
+		return 0;
+
+	bool ascii = random_below(2);
+
+	run("SAVE %s/first.pnm%s", work_dir, ascii ? " ascii" : "");
+	run("LOAD %s/first.pnm", work_dir);
+	run("SAVE %s/second.pnm%s", work_dir, ascii ? " ascii" : "");
+
+	size_t first_size, second_size;
+	char first_path[MAX_LINE_LENGTH], second_path[MAX_LINE_LENGTH];
+
+	path_of(first_path, "first.pnm");
+	path_of(second_path, "second.pnm");
+
+	unsigned char *first = read_file(first_path, &first_size);
+	unsigned char *second = read_file(second_path, &second_size);
+
+	int ret = first && second && first_size == second_size &&
+			  !memcmp(first, second, first_size) ? 0 : -1;
+
+	free(first);
+	free(second);
+
+	return ret ? ret : test_tiled();
+}
+
+/*
+ * -1 when the loaded image comes back different from its tiled file; the
+ * tiled file is then mutated for the tiled loader, whole and by region
+ */
+static int test_tiled(void)
+{
+	char path[MAX_LINE_LENGTH], third_path[MAX_LINE_LENGTH];
+
+	run("SAVE %s/binary.pnm", work_dir);
+	run("SAVE %s/tiled TILED", work_dir);
+	run("LOAD %s/tiled", work_dir);
+	run("SAVE %s/third.pnm", work_dir);
+
+	size_t binary_size, third_size;
+
+	path_of(path, "binary.pnm");
+	path_of(third_path, "third.pnm");
+
+	unsigned char *binary = read_file(path, &binary_size);
+	unsigned char *third = read_file(third_path, &third_size);
+
+	int ret = binary && third && binary_size == third_size &&
+			  !memcmp(binary, third, binary_size) ? 0 : -1;
+
+	free(binary);
+	free(third);
+
+	path_of(path, "tiled");
+
+	size_t size;
+	unsigned char *tiled = read_file(path, &size);
+
+	if (tiled && size <= MAX_INPUT_SIZE) {
+		uint8_t input[MAX_INPUT_SIZE];
+
+		memcpy(input, tiled, size);
+
+		size_t mutations = 1 + random_below(MAX_MUTATIONS);
+
+		for (size_t m = 0; m < mutations; m++)
+			size = mutate(input, size);
+
+		path_of(path, "mutated");
+
+		FILE *fp = fopen(path, "wb");
+
+		if (fp) {
+			fwrite(input, 1, size, fp);
+			fclose(fp);
+
+			run("LOAD %s/mutated", work_dir);
+			run("LOAD %s/mutated REGION 0 0 1 1", work_dir);
+			run("LOAD %s/mutated REGION 7 300 260 3", work_dir);
+		}
+	}
+
+	free(tiled);
+
+	return ret;
+}
+
+// flips bits, repeats, drops or truncates bytes, or splices in a token
+static size_t mutate(uint8_t *data, size_t size)
+{
+	size_t pos = size ? random_below(size) : 0;
+
+	switch (random_below(6)) {
+	case 0:
+		if (size)
+			data[pos] ^= 1 << random_below(8);
+		break;
+	case 1:
+		if (size)
+			data[pos] = random_below(256);
+		break;
+	case 2:
+		if (size && size < MAX_INPUT_SIZE) {
+			memmove(data + pos + 1, data + pos, size - pos);
+			size++;
+		}
+		break;
+	case 3:
+		if (size) {
+			memmove(data + pos, data + pos + 1, size - pos - 1);
+			size--;
+		}
+		break;
+	case 4:
+		size = pos;
+		break;
+	default: {
+		const char *token = tokens[random_below(sizeof(tokens) /
+												sizeof(tokens[0]))];
+		size_t len = strlen(token);
+
+		if (size + len > MAX_INPUT_SIZE)
+			break;
+
+		memmove(data + pos + len, data + pos, size - pos);
+		memcpy(data + pos, token, len);
+		size += len;
+		break;
+	}
+	}
+
+	return size;
+}
+
+// xorshift64*, the same inputs on every machine
+static unsigned long random_below(unsigned long bound)
+{
+	random_state ^= random_state >> 12;
+	random_state ^= random_state << 25;
+	random_state ^= random_state >> 27;
+
+	return (unsigned long)((random_state * 0x2545F4914F6CDD1DULL) >> 32) % bound;
+}
+
+static void run(const char *format, ...)
+{
+	char line[MAX_LINE_LENGTH];
+	va_list args;
+
+	va_start(args, format);
+	vsnprintf(line, sizeof(line), format, args);
+	va_end(args);
+
+	run_command(line, current_image());
+}
+
+static unsigned char *read_file(const char *path, size_t *size)
+{
+	FILE *fp = fopen(path, "rb");
+
+	if (!fp)
+		return NULL;
+
+	fseek(fp, 0, SEEK_END);
+
+	long len = ftell(fp);
+	unsigned char *data = len >= 0 ? malloc(len + 1) : NULL;
+
+	rewind(fp);
+
+	if (data && fread(data, 1, len, fp) != (size_t)len) {
+		free(data);
+		data = NULL;
+	}
+
+	fclose(fp);
+	*size = len;
+
+	return data;
+}
+
+static void path_of(char *path, const char *name)
+{
+	snprintf(path, MAX_LINE_LENGTH, "%s/%s", work_dir, name);
+}
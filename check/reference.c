@@ -0,0 +1,475 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "reference.h"
+
+#define KERNEL_SIZE 3
+#define MAX_SAMPLE 255
+#define MAX_WIDE_SAMPLE 65535
+#define MAX_HEADER_SIZE 256
+
+static const double kernels[REF_FILTER_COUNT][KERNEL_SIZE][KERNEL_SIZE] = {
+	[REF_EDGE] = {
+		{-1.0, -1.0, -1.0},
+		{-1.0,    8, -1.0},
+		{-1.0, -1.0, -1.0}
+	},
+	[REF_SHARPEN] = {
+		{   0, -1.0,    0},
+		{-1.0,    5, -1.0},
+		{   0, -1.0,    0}
+	},
+	[REF_BLUR] = {
+		{1.0 / 9, 1.0 / 9, 1.0 / 9},
+		{1.0 / 9, 1.0 / 9, 1.0 / 9},
+		{1.0 / 9, 1.0 / 9, 1.0 / 9}
+	},
+	[REF_GAUSSIAN_BLUR] = {
+		{1.0 / 16, 1.0 / 8, 1.0 / 16},
+		{1.0 /  8, 1.0 / 4, 1.0 /  8},
+		{1.0 / 16, 1.0 / 8, 1.0 / 16}
+	}
+};
+
+static double *sample(const ref_image_t *image, size_t i, size_t j, size_t c);
+static unsigned int sample_limit(const ref_image_t *image);
+static unsigned int round_sample(const ref_image_t *image, double value);
+static double clamp(double value, unsigned int limit);
+static bool is_bitmap(const ref_image_t *image);
+static size_t color_channels(const ref_image_t *image);
+static int create_like(ref_image_t *res, const ref_image_t *image,
+					   size_t width, size_t height);
+static bool whole_image_selected(const ref_image_t *image);
+static void rotate_once(ref_image_t *image, ref_image_t *res);
+
+int ref_create(ref_image_t *image, char magic, size_t width, size_t height,
+			   unsigned short max_val)
+{
+	image->magic = magic;
+	image->width = width;
+	image->height = height;
+	image->max_val = max_val;
+	image->channels = magic == '3' || magic == '6' ? 3 : 1;
+	image->tuple_type = NULL;
+	image->samples = calloc(width * height * image->channels,
+							sizeof(*image->samples));
+
+	ref_select_all(image);
+
+	return image->samples ? 0 : -1;
+}
+
+int ref_create_pam(ref_image_t *image, size_t width, size_t height,
+				   unsigned short max_val, size_t depth,
+				   const char *tuple_type)
+{
+	if (ref_create(image, '7', width, height, max_val) == -1)
+		return -1;
+
+	free(image->samples);
+
+	image->channels = depth;
+	image->tuple_type = tuple_type;
+	image->samples = calloc(width * height * depth, sizeof(*image->samples));
+
+	return image->samples ? 0 : -1;
+}
+
+void ref_free(ref_image_t *image)
+{
+	free(image->samples);
+	image->samples = NULL;
+}
+
+int ref_copy(ref_image_t *dest, const ref_image_t *src)
+{
+	if (create_like(dest, src, src->width, src->height) == -1)
+		return -1;
+
+	memcpy(dest->samples, src->samples,
+		   src->width * src->height * src->channels * sizeof(*src->samples));
+	dest->selection = src->selection;
+
+	return 0;
+}
+
+void ref_select_all(ref_image_t *image)
+{
+	image->selection = (ref_selection_t){0, 0, image->width, image->height};
+}
+
+// border pixels stay, max_val only grows (and is truncated, not rounded)
+int ref_apply(ref_image_t *image, ref_filter_t filter)
+{
+	size_t channels = color_channels(image);
+
+	if (!channels || filter >= REF_FILTER_COUNT)
+		return -1;
+
+	ref_image_t res;
+
+	if (ref_copy(&res, image) == -1)
+		return -1;
+
+	ref_selection_t sel = image->selection;
+
+	for (size_t i = sel.y1; i < sel.y2; i++) {
+		if (!i || i == image->height - 1)
+			continue;
+
+		for (size_t j = sel.x1; j < sel.x2; j++) {
+			if (!j || j == image->width - 1)
+				continue;
+
+			for (size_t c = 0; c < channels; c++) {
+				double value = 0;
+
+				for (size_t k = 0; k < KERNEL_SIZE; k++)
+					for (size_t l = 0; l < KERNEL_SIZE; l++)
+						value += *sample(image, i - 1 + k, j - 1 + l, c) *
+								 kernels[filter][k][l];
+
+				value = clamp(value, sample_limit(image));
+
+				if (value > res.max_val)
+					res.max_val = value;
+
+				*sample(&res, i, j, c) = value;
+			}
+		}
+	}
+
+	ref_free(image);
+	*image = res;
+
+	return 0;
+}
+
+// the histogram is the whole image's, whatever the selection
+int ref_equalize(ref_image_t *image)
+{
+	if (image->channels != 1 || is_bitmap(image) || image->magic == '7')
+		return -1;
+
+	unsigned int limit = sample_limit(image);
+	size_t *freq = calloc(limit + 1, sizeof(*freq));
+	size_t area = image->width * image->height;
+
+	if (!freq)
+		return -1;
+
+	for (size_t i = 0; i < area; i++)
+		freq[round_sample(image, image->samples[i])]++;
+
+	// cumulative, freq[k] counts the samples up to k
+	for (size_t k = 1; k <= limit; k++)
+		freq[k] += freq[k - 1];
+
+	for (size_t i = 0; i < area; i++) {
+		size_t sum = freq[round_sample(image, image->samples[i])];
+
+		image->samples[i] = clamp((double)(limit * sum) / area, limit);
+
+		unsigned int value = round_sample(image, image->samples[i]);
+
+		if (value > image->max_val)
+			image->max_val = value;
+	}
+
+	free(freq);
+
+	return 0;
+}
+
+// clockwise, the whole image or a square selection
+int ref_rotate(ref_image_t *image, int angle)
+{
+	ref_selection_t sel = image->selection;
+
+	if (angle % 90 || angle > 360 || angle < -360)
+		return -1;
+
+	if (!whole_image_selected(image) && sel.x2 - sel.x1 != sel.y2 - sel.y1)
+		return -1;
+
+	int count = angle / 90;
+
+	if (count < 0)
+		count += 4;
+
+	for (int n = 0; n < count; n++) {
+		ref_image_t res;
+
+		if (whole_image_selected(image)) {
+			if (create_like(&res, image, image->height, image->width) == -1)
+				return -1;
+
+			rotate_once(image, &res);
+			ref_free(image);
+			*image = res;
+			continue;
+		}
+
+		if (ref_copy(&res, image) == -1)
+			return -1;
+
+		size_t size = sel.x2 - sel.x1;
+
+		for (size_t i = 0; i < size; i++)
+			for (size_t j = 0; j < size; j++)
+				for (size_t c = 0; c < image->channels; c++)
+					*sample(&res, sel.y1 + i, sel.x1 + j, c) =
+						*sample(image, sel.y1 + size - 1 - j, sel.x1 + i, c);
+
+		ref_free(image);
+		*image = res;
+	}
+
+	return 0;
+}
+
+int ref_crop(ref_image_t *image)
+{
+	ref_selection_t sel = image->selection;
+	ref_image_t res;
+
+	if (create_like(&res, image, sel.x2 - sel.x1, sel.y2 - sel.y1) == -1)
+		return -1;
+
+	for (size_t i = 0; i < res.height; i++)
+		for (size_t j = 0; j < res.width; j++)
+			for (size_t c = 0; c < image->channels; c++)
+				*sample(&res, i, j, c) = *sample(image, sel.y1 + i,
+												 sel.x1 + j, c);
+
+	ref_free(image);
+	*image = res;
+
+	return 0;
+}
+
+/*
+ * a selected pixel of a bitmap becomes black if all (ERODE) or any (DILATE)
+ * of the pixels of its 3x3 square inside the image are
+ */
+int ref_morph(ref_image_t *image, bool dilate)
+{
+	if (!is_bitmap(image))
+		return -1;
+
+	ref_image_t res;
+
+	if (ref_copy(&res, image) == -1)
+		return -1;
+
+	ref_selection_t sel = image->selection;
+
+	for (size_t i = sel.y1; i < sel.y2; i++) {
+		for (size_t j = sel.x1; j < sel.x2; j++) {
+			bool all = true, any = false;
+
+			for (size_t k = i ? i - 1 : 0; k <= i + 1 && k < image->height;
+				 k++) {
+				for (size_t l = j ? j - 1 : 0; l <= j + 1 && l < image->width;
+					 l++) {
+					bool black = *sample(image, k, l, 0) != 0;
+
+					all = all && black;
+					any = any || black;
+				}
+			}
+
+			*sample(&res, i, j, 0) = dilate ? any : all;
+		}
+	}
+
+	ref_free(image);
+	*image = res;
+
+	return 0;
+}
+
+/*
+ * the bytes SAVE writes for a region of the image: P2/P3 or P5/P6 by the
+ * number of channels, every ascii sample followed by a space; P7 images are
+ * always binary
+ */
+unsigned char *ref_encode(const ref_image_t *image, ref_selection_t region,
+						  bool ascii, size_t *size)
+{
+	size_t width = region.x2 - region.x1;
+	size_t height = region.y2 - region.y1;
+	char magic = image->channels == 3 ? (ascii ? '3' : '6') :
+										(ascii ? '2' : '5');
+
+	if (is_bitmap(image))
+		magic = ascii ? '1' : '4';
+
+	// "65535 " per sample and a newline per row at most
+	size_t capacity = MAX_HEADER_SIZE +
+					  height * (width * image->channels * 6 + 1);
+	unsigned char *buffer = malloc(capacity);
+
+	if (!buffer)
+		return NULL;
+
+	size_t len = snprintf((char *)buffer, MAX_HEADER_SIZE, "P%c\n%zu %zu\n",
+						  magic, width, height);
+
+	if (!is_bitmap(image))
+		len += sprintf((char *)buffer + len, "%hu\n", image->max_val);
+
+	if (image->magic == '7') {
+		ascii = false;
+		len = sprintf((char *)buffer, "P7\nWIDTH %zu\nHEIGHT %zu\nDEPTH %zu\n"
+					  "MAXVAL %hu\n", width, height, image->channels,
+					  image->max_val);
+
+		if (image->tuple_type)
+			len += sprintf((char *)buffer + len, "TUPLTYPE %s\n",
+						   image->tuple_type);
+
+		len += sprintf((char *)buffer + len, "ENDHDR\n");
+	}
+
+	for (size_t i = region.y1; i < region.y2; i++) {
+		// P4 rows are bits, the first pixel in the highest bit of a byte
+		if (is_bitmap(image) && !ascii) {
+			for (size_t j = region.x1; j < region.x2; j += 8) {
+				unsigned char byte = 0;
+
+				for (size_t b = 0; b < 8 && j + b < region.x2; b++)
+					if (*sample(image, i, j + b, 0))
+						byte |= 0x80 >> b;
+
+				buffer[len++] = byte;
+			}
+
+			continue;
+		}
+
+		for (size_t j = region.x1; j < region.x2; j++) {
+			for (size_t c = 0; c < image->channels; c++) {
+				unsigned int value = round_sample(image,
+												  *sample(image, i, j, c));
+
+				if (ascii) {
+					len += sprintf((char *)buffer + len, "%u ", value);
+				} else if (sample_limit(image) == MAX_WIDE_SAMPLE) {
+					// 16-bit samples are big-endian
+					buffer[len++] = value >> 8;
+					buffer[len++] = value & 0xff;
+				} else {
+					buffer[len++] = value;
+				}
+			}
+		}
+
+		if (ascii)
+			buffer[len++] = '\n';
+	}
+
+	*size = len;
+
+	return buffer;
+}
+
+const char *ref_filter_name(ref_filter_t filter)
+{
+	static const char *const names[] = {
+		[REF_EDGE]          = "EDGE",
+		[REF_SHARPEN]       = "SHARPEN",
+		[REF_BLUR]          = "BLUR",
+		[REF_GAUSSIAN_BLUR] = "GAUSSIAN_BLUR"
+	};
+
+	return filter < REF_FILTER_COUNT ? names[filter] : NULL;
+}
+
+static double *sample(const ref_image_t *image, size_t i, size_t j, size_t c)
+{
+	return &image->samples[(i * image->width + j) * image->channels + c];
+}
+
+// images with a max value over 255 are 16-bit
+static unsigned int sample_limit(const ref_image_t *image)
+{
+	return image->max_val > MAX_SAMPLE ? MAX_WIDE_SAMPLE : MAX_SAMPLE;
+}
+
+// rounded, then wrapped to the sample width like a cast
+static unsigned int round_sample(const ref_image_t *image, double value)
+{
+	if (sample_limit(image) == MAX_WIDE_SAMPLE)
+		return (unsigned short)round(value);
+
+	return (unsigned char)round(value);
+}
+
+static double clamp(double value, unsigned int limit)
+{
+	if (value > limit)
+		return limit;
+
+	if (value < 0)
+		return 0;
+
+	return value;
+}
+
+static bool is_bitmap(const ref_image_t *image)
+{
+	return image->magic == '1' || image->magic == '4';
+}
+
+/*
+ * channels APPLY filters: all three of P3/P6, none of the other PNM images, and
+ * all but the alpha of P7 images that aren't gray
+ */
+static size_t color_channels(const ref_image_t *image)
+{
+	if (image->magic != '7')
+		return image->channels == 3 ? 3 : 0;
+
+	const char *type = image->tuple_type ? image->tuple_type : "";
+
+	if (!strncmp(type, "GRAYSCALE", 9) || !strncmp(type, "BLACKANDWHITE", 13))
+		return 0;
+
+	size_t len = strlen(type);
+
+	if (len > 6 && !strcmp(type + len - 6, "_ALPHA") && image->channels > 1)
+		return image->channels - 1;
+
+	return image->channels;
+}
+
+static int create_like(ref_image_t *res, const ref_image_t *image,
+					   size_t width, size_t height)
+{
+	if (image->magic == '7')
+		return ref_create_pam(res, width, height, image->max_val,
+							  image->channels, image->tuple_type);
+
+	return ref_create(res, image->magic, width, height, image->max_val);
+}
+
+static bool whole_image_selected(const ref_image_t *image)
+{
+	ref_selection_t sel = image->selection;
+
+	return !sel.x1 && !sel.y1 && sel.x2 == image->width &&
+		   sel.y2 == image->height;
+}
+
+// res is image turned clockwise: the first row of res is the first column
+static void rotate_once(ref_image_t *image, ref_image_t *res)
+{
+	for (size_t i = 0; i < res->height; i++)
+		for (size_t j = 0; j < res->width; j++)
+			for (size_t c = 0; c < image->channels; c++)
+				*sample(res, i, j, c) = *sample(image, image->height - 1 - j,
+												i, c);
+}
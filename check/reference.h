@@ -0,0 +1,65 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * frozen scalar implementation of the editor's pixel operations, kept apart
+ * from the editor's code so that rewrites of the fast paths can be checked
+ * against it; don't optimize anything in here
+ */
+
+typedef enum {
+	REF_EDGE,
+	REF_SHARPEN,
+	REF_BLUR,
+	REF_GAUSSIAN_BLUR,
+	REF_FILTER_COUNT
+} ref_filter_t;
+
+// [x1, x2) x [y1, y2)
+typedef struct {
+	size_t x1, y1;
+	size_t x2, y2;
+} ref_selection_t;
+
+// samples are 0/1 in bitmaps (P1/P4), 1 is black
+typedef struct {
+	char magic;
+	size_t width;
+	size_t height;
+	unsigned short max_val;
+	size_t channels;
+	// of P7 images, NULL when the header has none
+	const char *tuple_type;
+	double *samples;
+	ref_selection_t selection;
+} ref_image_t;
+
+int ref_create(ref_image_t *image, char magic, size_t width, size_t height,
+			   unsigned short max_val);
+
+int ref_create_pam(ref_image_t *image, size_t width, size_t height,
+				   unsigned short max_val, size_t depth,
+				   const char *tuple_type);
+
+void ref_free(ref_image_t *image);
+
+int ref_copy(ref_image_t *dest, const ref_image_t *src);
+
+void ref_select_all(ref_image_t *image);
+
+int ref_apply(ref_image_t *image, ref_filter_t filter);
+
+int ref_equalize(ref_image_t *image);
+
+int ref_rotate(ref_image_t *image, int angle);
+
+int ref_crop(ref_image_t *image);
+
+int ref_morph(ref_image_t *image, bool dilate);
+
+unsigned char *ref_encode(const ref_image_t *image, ref_selection_t region,
+						  bool ascii, size_t *size);
+
+const char *ref_filter_name(ref_filter_t filter);
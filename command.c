@@ -1,6 +1,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <setjmp.h>
+#include <stdbool.h>
 
 #include "command.h"
 #include "error.h"
@@ -14,22 +15,60 @@
 #include "equalize_command.h"
 #include "histogram_command.h"
 #include "rotate_command.h"
+#include "tile_command.h"
+#include "stream_command.h"
+#include "memlimit_command.h"
+#include "lazy_command.h"
+#include "lazy.h"
+#include "use_command.h"
+#include "on_command.h"
+#include "sync_command.h"
+#include "cache_command.h"
+#include "image_cache.h"
+#include "undo_command.h"
+#include "redo_command.h"
+#include "history_command.h"
+#include "history.h"
+#include "stats_command.h"
+#include "pool_command.h"
+#include "profile_command.h"
+#include "erode_command.h"
+#include "dilate_command.h"
+#include "profile.h"
+#include "trace.h"
+#include "metrics.h"
+#include "workspace.h"
+#include "output.h"
 
-typedef enum {
-	LOAD,
-	SELECT,
-	HISTOGRAM,
-	EQUALIZE,
-	ROTATE,
-	CROP,
-	APPLY,
-	SAVE,
-	EXIT,
-	INVALID_COMMAND_TYPE
-} COMMAND_TYPE;
-
-static COMMAND_TYPE get_command_type(char *command);
-static COMMAND_TYPE str_to_command_type(const char *str);
+typedef void (*command_func_t)(image_t *, char **, int, jmp_buf);
+
+static const command_func_t command_funcs[] = {
+	[LOAD]      = load_command,
+	[SELECT]    = select_command,
+	[HISTOGRAM] = histogram_command,
+	[EQUALIZE]  = equalize_command,
+	[ROTATE]    = rotate_command,
+	[CROP]      = crop_command,
+	[APPLY]     = apply_command,
+	[SAVE]      = save_command,
+	[TILE]      = tile_command,
+	[STREAM]    = stream_command,
+	[MEMLIMIT]  = memlimit_command,
+	[LAZY]      = lazy_command,
+	[USE]       = use_command,
+	[ON]        = on_command,
+	[SYNC]      = sync_command,
+	[CACHE]     = cache_command,
+	[STATS]     = stats_command,
+	[UNDO]      = undo_command,
+	[REDO]      = redo_command,
+	[HISTORY]   = history_command,
+	[POOL]      = pool_command,
+	[PROFILE]   = profile_command,
+	[ERODE]     = erode_command,
+	[DILATE]    = dilate_command,
+	[EXIT]      = exit_command
+};
 
 // parses command from stdin
 char *parse_command(void)
@@ -48,150 +87,288 @@ char *parse_command(void)
 	return buffer;
 }
 
-// returns command type from a command string
-static inline COMMAND_TYPE get_command_type(char *command)
+// whether a command needs the deferred operations of the image done first
+static bool reads_pixels(COMMAND_TYPE type)
 {
-	char *token = strtok(command, " ");
-
-	return str_to_command_type(token);
+	switch (type) {
+	case APPLY:
+	case EQUALIZE:
+	case ROTATE:
+	case CROP:
+	case ERODE:
+	case DILATE:
+	case SELECT:
+	case MEMLIMIT:
+	case STREAM:
+	case LAZY:
+	case USE:
+	case ON:
+	case SYNC:
+	case CACHE:
+	case STATS:
+	case HISTORY:
+	case POOL:
+	case PROFILE:
+		return false;
+	default:
+		return true;
+	}
 }
 
-// converts string into COMMAND_TYPE enum
-static inline COMMAND_TYPE str_to_command_type(const char *str)
+// whether a command changes the pixels, so that it can be undone
+static bool edits_pixels(COMMAND_TYPE type)
 {
-	if (!str)
-		return INVALID_COMMAND_TYPE;
-
-	static const struct {
-		COMMAND_TYPE type;
-		const char *str;
-	} conversion[] = {
-		{LOAD, "LOAD"},
-		{SELECT, "SELECT"},
-		{HISTOGRAM, "HISTOGRAM"},
-		{EQUALIZE, "EQUALIZE"},
-		{ROTATE, "ROTATE"},
-		{CROP, "CROP"},
-		{APPLY, "APPLY"},
-		{SAVE, "SAVE"},
-		{EXIT, "EXIT"}
-	};
-
-	// bypass check-style warning
-	unsigned int size = sizeof(conversion);
-	size /= sizeof(conversion[0]);
-
-	for (unsigned int i = 0; i < size; i++)
-		if (!strcmp(str, conversion[i].str))
-			return conversion[i].type;
-
-	return INVALID_COMMAND_TYPE;
+	return type == APPLY || type == EQUALIZE || type == ROTATE ||
+		   type == CROP || type == ERODE || type == DILATE;
 }
 
-// helper function for running a command
-static void __run_command(char *command, image_t *image,
-						  void (*func)(image_t *, char **, int, jmp_buf))
+static int dispatch_command(COMMAND_TYPE type, char **argv, int argc,
+							image_t *image);
+static size_t image_bytes(image_t *image);
+static size_t image_pixels(image_t *image);
+
+// helper function for running a command, returns the error it ended with
+static int __run_command(char **argv, int argc, image_t *image,
+						 command_func_t func)
 {
 	jmp_buf ex_buf__;
 
-	char **argv = NULL;
-	int argc = 0;
-
-	// split the command into arguments
-	while (command && (command = strtok(NULL, " ")) != NULL) {
-		void *ret = realloc(argv, ++argc * sizeof(*argv));
-		check_nullptr(ret, "realloc() failed");
-
-		argv = ret;
-
-		argv[argc - 1] = calloc(strlen(command) + 1,  sizeof(*argv[argc - 1]));
-		check_nullptr(argv[argc - 1], "calloc() failed");
-
-		strcpy(argv[argc - 1], command);
-	}
-
 	// basically a try-catch
-	switch (setjmp(ex_buf__)) {
+	int status = setjmp(ex_buf__);
+
+	switch (status) {
 	case 0:
 	while (1) {
 		func(image, argv, argc, ex_buf__);
 		break;
 	case E_LOAD_FAILED:
-		printf("%s %s\n", error_code_to_msg(E_LOAD_FAILED), argv[0]);
+		out_printf("%s %s\n", error_code_to_msg(E_LOAD_FAILED), argv[0]);
 		break;
 	case E_INVALID_COORD_SET:
-		printf("%s\n", error_code_to_msg(E_INVALID_COORD_SET));
+		out_printf("%s\n", error_code_to_msg(E_INVALID_COORD_SET));
 		break;
 	case E_NO_IMAGE_LOADED:
-		printf("%s\n", error_code_to_msg(E_NO_IMAGE_LOADED));
+		out_printf("%s\n", error_code_to_msg(E_NO_IMAGE_LOADED));
 		break;
 	case E_SELECTION_NOT_SQUARE:
-		printf("%s\n", error_code_to_msg(E_SELECTION_NOT_SQUARE));
+		out_printf("%s\n", error_code_to_msg(E_SELECTION_NOT_SQUARE));
 		break;
 	case E_UNSUPPORTED_ROT_ANGLE:
-		printf("%s\n", error_code_to_msg(E_UNSUPPORTED_ROT_ANGLE));
+		out_printf("%s\n", error_code_to_msg(E_UNSUPPORTED_ROT_ANGLE));
 		break;
 	case E_COLOR_IMAGE:
-		printf("%s\n", error_code_to_msg(E_COLOR_IMAGE));
+		out_printf("%s\n", error_code_to_msg(E_COLOR_IMAGE));
 		break;
 	case E_GRAYSCALE_IMAGE:
-		printf("%s\n", error_code_to_msg(E_GRAYSCALE_IMAGE));
+		out_printf("%s\n", error_code_to_msg(E_GRAYSCALE_IMAGE));
 		break;
 	case E_INVALID_APPLY_PARAM:
-		printf("%s\n", error_code_to_msg(E_INVALID_APPLY_PARAM));
+		out_printf("%s\n", error_code_to_msg(E_INVALID_APPLY_PARAM));
 		break;
 	case E_INVALID_HISTOGRAM_PARAM:
-		printf("%s\n", error_code_to_msg(E_INVALID_HISTOGRAM_PARAM));
+		out_printf("%s\n", error_code_to_msg(E_INVALID_HISTOGRAM_PARAM));
+		break;
+	case E_BITMAP_IMAGE:
+		out_printf("%s\n", error_code_to_msg(E_BITMAP_IMAGE));
+		break;
+	case E_NOT_BITMAP_IMAGE:
+		out_printf("%s\n", error_code_to_msg(E_NOT_BITMAP_IMAGE));
+		break;
+	case E_PAM_IMAGE:
+		out_printf("%s\n", error_code_to_msg(E_PAM_IMAGE));
+		break;
+	case E_UNKNOWN_IMAGE:
+		out_printf("%s %s\n", error_code_to_msg(E_UNKNOWN_IMAGE), argv[0]);
+		break;
+	case E_NOTHING_TO_UNDO:
+		out_printf("%s\n", error_code_to_msg(E_NOTHING_TO_UNDO));
+		break;
+	case E_NOTHING_TO_REDO:
+		out_printf("%s\n", error_code_to_msg(E_NOTHING_TO_REDO));
 		break;
 	case E_INVALID_COMMAND:
-		printf("%s\n", error_code_to_msg(E_INVALID_COMMAND));
+		out_printf("%s\n", error_code_to_msg(E_INVALID_COMMAND));
 		break;
 	}
 	}
 
-	for (int i = 0; i < argc; i++)
-		free(argv[i]);
+	return status;
+}
 
-	free(argv);
+/*
+ * splits a command line in place and returns the number of arguments; they
+ * point into the line itself, only the array has to be freed
+ */
+int split_command(char *command, COMMAND_TYPE *type, char ***argv)
+{
+	char *saveptr = NULL;
+	int argc = 0;
+
+	*type = str_to_command_type(strtok_r(command, " ", &saveptr));
+	*argv = NULL;
+
+	while (*type != EXIT && (command = strtok_r(NULL, " ", &saveptr)) != NULL) {
+		void *ret = realloc(*argv, ++argc * sizeof(**argv));
+		check_nullptr(ret, "realloc() failed");
+
+		*argv = ret;
+		(*argv)[argc - 1] = command;
+	}
+
+	return argc;
 }
 
 // runs the given command on the given image
-void run_command(char *command, image_t *image)
+int run_command(char *command, image_t *image)
 {
 	// save pointer to free after strtok modifications
 	char *og_command = command;
+	COMMAND_TYPE type;
+	char **argv;
+	int argc = split_command(command, &type, &argv);
 
-	switch (get_command_type(command)) {
-	case LOAD:
-		__run_command(command, image, load_command);
-		break;
-	case SELECT:
-		__run_command(command, image, select_command);
-		break;
-	case HISTOGRAM:
-		__run_command(command, image, histogram_command);
-		break;
-	case EQUALIZE:
-		__run_command(command, image, equalize_command);
-		break;
-	case ROTATE:
-		__run_command(command, image, rotate_command);
-		break;
-	case CROP:
-		__run_command(command, image, crop_command);
-		break;
-	case APPLY:
-		__run_command(command, image, apply_command);
-		break;
-	case SAVE:
-		__run_command(command, image, save_command);
-		break;
-	case EXIT:
+	// the process ends during EXIT, free everything beforehand
+	if (type == EXIT)
 		free(og_command);
-		__run_command(NULL, image, exit_command);
-		exit(EXIT_SUCCESS);
-	default:
-		printf("%s\n", error_code_to_msg(E_INVALID_COMMAND));
-		break;
+
+	int ret = run_parsed_command(type, argv, argc, image);
+
+	free(argv);
+
+	return ret;
+}
+
+// runs an already split command on the given image
+int run_parsed_command(COMMAND_TYPE type, char **argv, int argc,
+					   image_t *image)
+{
+	// everything but another ON waits for the queued commands
+	if (type != ON && run_queued_commands() == -1)
+		return E_FUNC_FAILED;
+
+	// LOAD <file> AS <name> loads into (and switches to) a named image
+	if (type == LOAD && argc == 3 && !strcmp(argv[1], "AS")) {
+		image = find_image(argv[2], true);
+
+		if (!image)
+			return E_FUNC_FAILED;
+
+		use_image(argv[2]);
+		argc = 1;
+	}
+
+	if (type == EXIT) {
+		metrics_mark_t mark;
+
+		discard_image_ops(image);
+
+		trace_span_t span;
+
+		start_metrics(&mark);
+		trace_begin(&span, "command", "EXIT", -1);
+		int status = __run_command(NULL, 0, image, exit_command);
+		trace_end(&span);
+		record_metrics(EXIT, &mark, 0, status != 0);
+
+		free_workspace();
+		// drops the cached images too
+		set_cache_limit(0);
+
+		// a background save that failed is the only error EXIT reports
+		exit(status == E_FUNC_FAILED ? EXIT_FAILURE : EXIT_SUCCESS);
+	}
+
+	lock_image(image);
+	int ret = run_image_command(type, argv, argc, image);
+	unlock_image(image);
+
+	return ret;
+}
+
+// runs a command on the given image, without looking at the workspace
+int run_image_command(COMMAND_TYPE type, char **argv, int argc,
+					  image_t *image)
+{
+	if (type >= INVALID_COMMAND_TYPE) {
+		out_printf("%s\n", error_code_to_msg(E_INVALID_COMMAND));
+		return E_INVALID_COMMAND;
+	}
+
+	metrics_mark_t mark;
+	profile_mark_t profile;
+	trace_span_t span;
+	size_t bytes = image_bytes(image);
+	size_t pixels = image_pixels(image);
+
+	start_metrics(&mark);
+	start_profile(&profile);
+	trace_begin(&span, "command", command_type_to_str(type), -1);
+
+	int status = dispatch_command(type, argv, argc, image);
+
+	trace_end(&span);
+
+	// the pixels the command went through, deferred operations included
+	if (!reads_pixels(type) && !edits_pixels(type)) {
+		bytes = 0;
+		pixels = 0;
+	} else if (image_bytes(image) > bytes) {
+		bytes = image_bytes(image);
+		pixels = image_pixels(image);
 	}
+
+	finish_profile(type, &profile, pixels);
+	record_metrics(type, &mark, bytes, status != 0);
+
+	return status;
+}
+
+static int dispatch_command(COMMAND_TYPE type, char **argv, int argc,
+							image_t *image)
+{
+	// the result of deferred operations is never seen past a LOAD
+	if (type == LOAD && argc)
+		discard_image_ops(image);
+	else if (reads_pixels(type) && flush_image_ops(image) == -1)
+		return E_FUNC_FAILED;
+
+	// a new file starts a new history
+	if (type == LOAD && argc)
+		clear_history(image);
+
+	/*
+	 * the state before an edit is kept for UNDO; it has to hold real pixels,
+	 * so a deferred edit before it is done first
+	 */
+	bool recorded = false;
+
+	if (edits_pixels(type) && history_enabled() && image->is_loaded) {
+		if (flush_image_ops(image) == -1)
+			return E_FUNC_FAILED;
+
+		recorded = record_history(image) == 0;
+	}
+
+	int status = __run_command(argv, argc, image, command_funcs[type]);
+
+	if (recorded)
+		commit_history(image, status == 0);
+
+	return status;
+}
+
+static size_t image_bytes(image_t *image)
+{
+	if (!image->is_loaded)
+		return 0;
+
+	return row_size(image) * image->height;
+}
+
+static size_t image_pixels(image_t *image)
+{
+	if (!image->is_loaded)
+		return 0;
+
+	return image->width * image->height;
 }
@@ -6,8 +6,137 @@
 #include "image.h"
 
 #define MAX_COMMAND_TYPE_LENGTH 15
-#pragma once
+
+typedef enum {
+	LOAD,
+	SELECT,
+	HISTOGRAM,
+	EQUALIZE,
+	ROTATE,
+	CROP,
+	APPLY,
+	SAVE,
+	TILE,
+	STREAM,
+	MEMLIMIT,
+	LAZY,
+	USE,
+	ON,
+	SYNC,
+	CACHE,
+	STATS,
+	UNDO,
+	REDO,
+	HISTORY,
+	POOL,
+	PROFILE,
+	ERODE,
+	DILATE,
+	EXIT,
+	INVALID_COMMAND_TYPE
+} COMMAND_TYPE;
+
+// converts string into COMMAND_TYPE enum
+static inline COMMAND_TYPE str_to_command_type(const char *str)
+{
+	if (!str)
+		return INVALID_COMMAND_TYPE;
+
+	static const struct {
+		COMMAND_TYPE type;
+		const char *str;
+	} conversion[] = {
+		{LOAD, "LOAD"},
+		{SELECT, "SELECT"},
+		{HISTOGRAM, "HISTOGRAM"},
+		{EQUALIZE, "EQUALIZE"},
+		{ROTATE, "ROTATE"},
+		{CROP, "CROP"},
+		{APPLY, "APPLY"},
+		{SAVE, "SAVE"},
+		{TILE, "TILE"},
+		{STREAM, "STREAM"},
+		{MEMLIMIT, "MEMLIMIT"},
+		{LAZY, "LAZY"},
+		{USE, "USE"},
+		{ON, "ON"},
+		{SYNC, "SYNC"},
+		{CACHE, "CACHE"},
+		{STATS, "STATS"},
+		{UNDO, "UNDO"},
+		{REDO, "REDO"},
+		{HISTORY, "HISTORY"},
+		{POOL, "POOL"},
+		{PROFILE, "PROFILE"},
+		{ERODE, "ERODE"},
+		{DILATE, "DILATE"},
+		{EXIT, "EXIT"}
+	};
+
+	// bypass check-style warning
+	unsigned int size = sizeof(conversion);
+	size /= sizeof(conversion[0]);
+
+	for (unsigned int i = 0; i < size; i++)
+		if (!strcmp(str, conversion[i].str))
+			return conversion[i].type;
+
+	return INVALID_COMMAND_TYPE;
+}
+
+// converts COMMAND_TYPE enum to string
+static inline const char *command_type_to_str(COMMAND_TYPE type)
+{
+	static const struct {
+		COMMAND_TYPE type;
+		const char *str;
+	} conversion[] = {
+		{LOAD, "LOAD"},
+		{SELECT, "SELECT"},
+		{HISTOGRAM, "HISTOGRAM"},
+		{EQUALIZE, "EQUALIZE"},
+		{ROTATE, "ROTATE"},
+		{CROP, "CROP"},
+		{APPLY, "APPLY"},
+		{SAVE, "SAVE"},
+		{TILE, "TILE"},
+		{STREAM, "STREAM"},
+		{MEMLIMIT, "MEMLIMIT"},
+		{LAZY, "LAZY"},
+		{USE, "USE"},
+		{ON, "ON"},
+		{SYNC, "SYNC"},
+		{CACHE, "CACHE"},
+		{STATS, "STATS"},
+		{UNDO, "UNDO"},
+		{REDO, "REDO"},
+		{HISTORY, "HISTORY"},
+		{POOL, "POOL"},
+		{PROFILE, "PROFILE"},
+		{ERODE, "ERODE"},
+		{DILATE, "DILATE"},
+		{EXIT, "EXIT"}
+	};
+
+	// bypass check-style warning
+	unsigned int size = sizeof(conversion);
+	size /= sizeof(conversion[0]);
+
+	for (unsigned int i = 0; i < size; i++)
+		if (type == conversion[i].type)
+			return conversion[i].str;
+
+	return NULL;
+}
 
 char *parse_command(void);
 
-void run_command(char *command, image_t *image);
+int split_command(char *command, COMMAND_TYPE *type, char ***argv);
+
+int run_command(char *command, image_t *image);
+
+int run_parsed_command(COMMAND_TYPE type, char **argv, int argc,
+					   image_t *image);
+
+int run_image_command(COMMAND_TYPE type, char **argv, int argc,
+					  image_t *image);
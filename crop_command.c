@@ -4,7 +4,10 @@
 
 #include "crop_command.h"
 #include "image.h"
+#include "bitmap.h"
 #include "error.h"
+#include "lazy.h"
+#include "output.h"
 
 #define CROP_ARG_COUNT 0
 #define CROP_SUCCESS_MSG "Image cropped\n"
@@ -24,24 +27,66 @@ void crop_command(image_t *image, char **argv, int argc, jmp_buf ex_buf__)
 	if (!argv)
 		argc++;
 
+	image_op_t op = {
+		.type = OP_CROP,
+		.selection = image->selection
+	};
+
+	if (submit_image_op(image, op) == -1)
+		longjmp(ex_buf__, E_FUNC_FAILED);
+
+	out_printf(CROP_SUCCESS_MSG);
+}
+
+// cuts the image down to its selection
+int crop_image(image_t *image)
+{
+	if (!image)
+		return -1;
+
 	size_t new_width  = image->selection.lower_right.x -
 						image->selection.upper_left.x;
 	size_t new_height = image->selection.lower_right.y -
 						image->selection.upper_left.y;
 
-	for (size_t i = 0; i < new_height; i++)
+	if (make_rows_writable(image, 0, new_height) == -1)
+		return -1;
+
+	for (size_t i = 0; i < new_height; i++) {
+		// bitmap rows are shifted into place a word at a time
+		if (is_bitmap(image->magic_word)) {
+			copy_bits(bitmap_row(image, i),
+					  bitmap_row(image, i + image->selection.upper_left.y),
+					  image->selection.upper_left.x, new_width);
+			continue;
+		}
+
+		/*
+		 * the planes get packed for the new width; every plane lands before
+		 * where it was, so in place it is only ever copied downwards
+		 */
+		if (is_pam(image->magic_word)) {
+			for (size_t c = 0; c < image->depth; c++)
+				memmove((double *)image->matrix[i] + c * new_width,
+						pam_plane(image, i + image->selection.upper_left.y, c) +
+						image->selection.upper_left.x,
+						new_width * sizeof(double));
+			continue;
+		}
+
 		for (size_t j = 0; j < new_width; j++)
 			image->matrix[i][j] =
 			image->matrix[i + image->selection.upper_left.y]
 						 [j + image->selection.upper_left.x];
+	}
 
 	if (resize_matrix(image, new_width, new_height) == -1)
-		longjmp(ex_buf__, E_FUNC_FAILED);
+		return -1;
 
 	image->selection.upper_left.x = 0;
 	image->selection.upper_left.y = 0;
 	image->selection.lower_right.x = image->width;
 	image->selection.lower_right.y = image->height;
 
-	printf(CROP_SUCCESS_MSG);
+	return 0;
 }
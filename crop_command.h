@@ -5,3 +5,5 @@
 #include "image.h"
 
 void crop_command(image_t *image, char **argv, int argc, jmp_buf ex_buf__);
+
+int crop_image(image_t *image);
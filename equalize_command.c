@@ -2,12 +2,16 @@
 #include <stdbool.h>
 #include <math.h>
 #include <stdio.h>
+#include <stdlib.h>
 
 #include "image.h"
 #include "equalize_command.h"
 #include "histogram_command.h"
 #include "error.h"
 #include "utils.h"
+#include "lazy.h"
+#include "pnm.h"
+#include "output.h"
 
 #define EQUALIZE_ARG_COUNT 0
 #define EQUALIZE_SUCCESS_MSG "Equalize done\n"
@@ -23,42 +27,80 @@ void equalize_command(image_t *image, char **argv, int argc, jmp_buf ex_buf__)
 	if (is_color(image->magic_word))
 		longjmp(ex_buf__, E_COLOR_IMAGE);
 
+	if (is_bitmap(image->magic_word))
+		longjmp(ex_buf__, E_BITMAP_IMAGE);
+
+	if (is_pam(image->magic_word))
+		longjmp(ex_buf__, E_PAM_IMAGE);
+
 	if (!argv)
 		argc += 0;
 
-	size_t freq[MAX_PIXEL_VAL + 1] = {0};
+	image_op_t op = {
+		.type = OP_EQUALIZE,
+		.selection = image->selection
+	};
+
+	if (submit_image_op(image, op) == -1)
+		longjmp(ex_buf__, E_FUNC_FAILED);
+
+	out_printf(EQUALIZE_SUCCESS_MSG);
+}
+
+/*
+ * spreads the grayscale values of the image over the whole range, with one
+ * bin for every value of its depth (65536 of them for 16-bit images)
+ */
+int equalize_image(image_t *image)
+{
+	if (!image)
+		return -1;
+
+	unsigned int limit = pixel_limit(image->max_val);
+	size_t *freq = calloc(limit + 1, sizeof(*freq));
 	size_t surface_area = image->height * image->width;
 
+	if (!freq)
+		return -1;
+
 	for (size_t i = 0; i < image->height; i++) {
-		for (size_t j = 0; j < image->width; j++) {
-			unsigned char val = (unsigned char)round
-								(image->matrix[i][j].grayscale.value);
+		advise_row_access(image, i);
 
-			freq[val]++;
-		}
+		for (size_t j = 0; j < image->width; j++)
+			freq[to_sample(image->matrix[i][j].grayscale.value, limit)]++;
 	}
 
+	// freq[k] becomes the number of pixels up to k
+	for (size_t k = 1; k <= limit; k++)
+		freq[k] += freq[k - 1];
+
 	for (size_t i = 0; i < image->height; i++) {
-		for (size_t j = 0; j < image->width; j++) {
-			unsigned char val = (unsigned char)round
-								(image->matrix[i][j].grayscale.value);
-			size_t sum = 0;
+		advise_row_access(image, i);
 
-			for (size_t k = 0; k <= val; k++)
-				sum += freq[k];
+		if (make_row_writable(image, i) == -1) {
+			free(freq);
+			return -1;
+		}
+
+		for (size_t j = 0; j < image->width; j++) {
+			size_t sum = freq[to_sample(image->matrix[i][j].grayscale.value,
+										limit)];
 
 			image->matrix[i][j].grayscale.value =
-			(double)(MAX_PIXEL_VAL * sum) / surface_area;
+			(double)(limit * sum) / surface_area;
 
 			image->matrix[i][j].grayscale.value =
-			clamp_value(image->matrix[i][j].grayscale.value);
+			clamp_value(image->matrix[i][j].grayscale.value, limit);
 
-			val = (unsigned char)round(image->matrix[i][j].grayscale.value);
+			unsigned int val = to_sample(image->matrix[i][j].grayscale.value,
+										 limit);
 
 			if (val > image->max_val)
 				image->max_val = val;
 		}
 	}
 
-	printf(EQUALIZE_SUCCESS_MSG);
+	free(freq);
+
+	return 0;
 }
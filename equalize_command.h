@@ -5,3 +5,5 @@
 #include "image.h"
 
 void equalize_command(image_t *image, char **argv, int argc, jmp_buf ex_buf__);
+
+int equalize_image(image_t *image);
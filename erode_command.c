@@ -0,0 +1,42 @@
+#include <setjmp.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+#include "erode_command.h"
+#include "image.h"
+#include "error.h"
+#include "lazy.h"
+#include "output.h"
+
+#define ERODE_ARG_COUNT 0
+#define ERODE_SUCCESS_MSG "Erode done\n"
+
+// shrinks the black areas of the selection of a bitmap by a pixel
+void erode_command(image_t *image, char **argv, int argc, jmp_buf ex_buf__)
+{
+	if (!image)
+		longjmp(ex_buf__, E_INVALID_FUNC_ARGS);
+
+	if (argc != ERODE_ARG_COUNT)
+		longjmp(ex_buf__, E_INVALID_COMMAND);
+
+	if (!image->is_loaded)
+		longjmp(ex_buf__, E_NO_IMAGE_LOADED);
+
+	if (!is_bitmap(image->magic_word))
+		longjmp(ex_buf__, E_NOT_BITMAP_IMAGE);
+
+	// bypass unused parameter warning
+	if (!argv)
+		argc++;
+
+	image_op_t op = {
+		.type = OP_ERODE,
+		.selection = image->selection
+	};
+
+	if (submit_image_op(image, op) == -1)
+		longjmp(ex_buf__, E_FUNC_FAILED);
+
+	out_printf(ERODE_SUCCESS_MSG);
+}
@@ -11,6 +11,12 @@ typedef enum {
 	E_GRAYSCALE_IMAGE,
 	E_INVALID_APPLY_PARAM,
 	E_INVALID_HISTOGRAM_PARAM,
+	E_BITMAP_IMAGE,
+	E_NOT_BITMAP_IMAGE,
+	E_PAM_IMAGE,
+	E_UNKNOWN_IMAGE,
+	E_NOTHING_TO_UNDO,
+	E_NOTHING_TO_REDO,
 	E_INVALID_FUNC_ARGS,
 	E_FUNC_FAILED
 } ERROR_CODE;
@@ -28,6 +34,12 @@ static inline const char *error_code_to_msg(ERROR_CODE error_code)
 		[E_GRAYSCALE_IMAGE]         = "Easy, Charlie Chaplin",
 		[E_INVALID_APPLY_PARAM]     = "APPLY parameter invalid",
 		[E_INVALID_HISTOGRAM_PARAM] = "Invalid set of parameters",
+		[E_BITMAP_IMAGE]            = "Grayscale image needed",
+		[E_NOT_BITMAP_IMAGE]        = "Bitmap image needed",
+		[E_PAM_IMAGE]               = "PNM image needed",
+		[E_UNKNOWN_IMAGE]           = "No image named",
+		[E_NOTHING_TO_UNDO]         = "Nothing to undo",
+		[E_NOTHING_TO_REDO]         = "Nothing to redo",
 		[E_INVALID_FUNC_ARGS]       = "Invalid function arguments",
 		[E_FUNC_FAILED]             = "Function failed"
 	};
@@ -4,6 +4,7 @@
 
 #include "image.h"
 #include "exit_command.h"
+#include "save_command.h"
 #include "error.h"
 
 void exit_command(image_t *image, char **argv, int argc, jmp_buf ex_buf__)
@@ -11,6 +12,10 @@ void exit_command(image_t *image, char **argv, int argc, jmp_buf ex_buf__)
 	if (!image)
 		longjmp(ex_buf__, E_INVALID_FUNC_ARGS);
 
+	// background saves must reach the disk before the process ends
+	if (wait_pending_saves() == -1)
+		longjmp(ex_buf__, E_FUNC_FAILED);
+
 	if (!image->is_loaded)
 		longjmp(ex_buf__, E_NO_IMAGE_LOADED);
 
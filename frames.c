@@ -0,0 +1,457 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "frames.h"
+#include "batch.h"
+#include "script.h"
+#include "command.h"
+#include "error.h"
+#include "image.h"
+#include "lazy.h"
+#include "history.h"
+#include "load_command.h"
+#include "save_command.h"
+#include "async_io.h"
+#include "output.h"
+#include "pnm.h"
+#include "utils.h"
+#include "trace.h"
+#include "worker_pool.h"
+
+#define FRAMES_REPORT_MSG \
+	"Processed %zu frames (%zu failed) in %.2f s: %.1f frames/s, %.1f MB/s\n"
+#define FRAME_FAILED_MSG "Failed frame %zu\n"
+#define FRAME_UNREADABLE_MSG "Frame %zu can't be read, stopping\n"
+
+#define BYTES_PER_MB (1024.0 * 1024.0)
+// bytes of a saved frame copied to the output at once
+#define COPY_CHUNK_SIZE (1024 * 1024)
+
+typedef struct {
+	plan_t *plan;
+	FILE *in;
+	int out_fd;
+	// arguments of the longest operation
+	int max_argc;
+	// frames are only delimited by their headers, one worker reads at a time
+	pthread_mutex_t read_lock;
+	size_t frames_read;
+	bool input_done;
+	// and they are written in the order they were read
+	pthread_mutex_t write_lock;
+	pthread_cond_t written;
+	size_t frames_written;
+	bool output_failed;
+	atomic_size_t failed;
+	atomic_size_t bytes;
+} frames_t;
+
+// the header and raw raster of a frame, the buffer is kept for the next one
+typedef struct {
+	image_t header;
+	unsigned char *raster;
+	size_t capacity;
+	size_t idx;
+} frame_t;
+
+static void frames_worker(void *ctx, size_t idx);
+static int read_frame(frames_t *frames, frame_t *frame);
+static int read_next_frame(frames_t *frames, frame_t *frame);
+static int load_frame(image_t *image, frame_t *frame);
+static int process_frame(frames_t *frames, image_t *image, char **args,
+						 frame_t *frame);
+static void write_frame(frames_t *frames, size_t idx, int fd, size_t size,
+						unsigned char *chunk);
+static int write_all(int fd, const unsigned char *buffer, size_t size);
+static double elapsed_seconds(struct timespec *start);
+
+/*
+ * runs a recipe over every frame of a stream of concatenated binary images
+ * (stdin and stdout for "-"); the frames are spread over the workers and
+ * written back in their original order: every SAVE in the recipe appends the
+ * frame to the output, every LOAD loads the current frame again
+ */
+int run_frames(const char *script, const char *input, const char *output)
+{
+	plan_t plan;
+
+	if (parse_script(script, &plan) == -1) {
+		perror(script);
+		return 1;
+	}
+
+	if (check_recipe(&plan) == -1) {
+		fprintf(stderr, "%s: %s\n", script,
+				error_code_to_msg(E_INVALID_COMMAND));
+		free_plan(&plan);
+		return 1;
+	}
+
+	// not optimized: two SAVEs of the same file are two frames here
+
+	bool from_stdin = !strcmp(input, "-");
+	bool to_stdout = !strcmp(output, "-");
+
+	frames_t frames = {
+		.plan = &plan,
+		.in = from_stdin ? stdin : fopen(input, "rb"),
+		.out_fd = to_stdout ? STDOUT_FILENO :
+							  open(output, O_WRONLY | O_CREAT | O_TRUNC, 0666),
+		.max_argc = 1
+	};
+
+	if (!frames.in || frames.out_fd == -1) {
+		perror(frames.in ? output : input);
+
+		if (frames.in && !from_stdin)
+			fclose(frames.in);
+
+		free_plan(&plan);
+		return 1;
+	}
+
+	for (size_t i = 0; i < plan.count; i++)
+		if (plan.ops[i].argc > frames.max_argc)
+			frames.max_argc = plan.ops[i].argc;
+
+	pthread_mutex_init(&frames.read_lock, NULL);
+	pthread_mutex_init(&frames.write_lock, NULL);
+	pthread_cond_init(&frames.written, NULL);
+	atomic_init(&frames.failed, 0);
+	atomic_init(&frames.bytes, 0);
+
+	struct timespec start;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	run_parallel_on(worker_count(), worker_count(), frames_worker, &frames);
+
+	double seconds = elapsed_seconds(&start);
+
+	if (seconds <= 0)
+		seconds = 1e-9;
+
+	// stdout may be the output, the report goes to stderr
+	fprintf(stderr, FRAMES_REPORT_MSG, frames.frames_written,
+			atomic_load(&frames.failed), seconds,
+			frames.frames_written / seconds,
+			atomic_load(&frames.bytes) / BYTES_PER_MB / seconds);
+
+	pthread_cond_destroy(&frames.written);
+	pthread_mutex_destroy(&frames.write_lock);
+	pthread_mutex_destroy(&frames.read_lock);
+
+	if (!from_stdin)
+		fclose(frames.in);
+
+	if (!to_stdout && close(frames.out_fd) == -1)
+		frames.output_failed = true;
+
+	free_plan(&plan);
+
+	return atomic_load(&frames.failed) || frames.output_failed ? 1 : 0;
+}
+
+// worker task: reads, edits and writes frames until the input runs out
+static void frames_worker(void *ctx, size_t idx)
+{
+	frames_t *frames = ctx;
+	image_t image;
+	frame_t frame;
+
+	// bypass unused parameter warning
+	if (!idx)
+		idx++;
+
+	image.is_loaded = false;
+	image.matrix = NULL;
+	image.pending = NULL;
+	image.history = NULL;
+
+	memset(&frame, 0, sizeof(frame));
+
+	/*
+	 * reused for every frame: the arguments, a sink for the messages and a
+	 * scratch file for what the recipe saves
+	 */
+	char **args = malloc((frames->max_argc + 1) * sizeof(*args));
+	unsigned char *chunk = malloc(COPY_CHUNK_SIZE);
+	FILE *sink = fopen("/dev/null", "w");
+	FILE *scratch = tmpfile();
+
+	if (!args || !chunk || !sink || !scratch)
+		goto out;
+
+	set_output_stream(sink);
+	set_save_sink(fileno(scratch));
+
+	while (read_frame(frames, &frame) == 0) {
+		trace_span_t span;
+
+		trace_begin(&span, "frame", "frame", frame.idx);
+
+		bool cleared = ftruncate(fileno(scratch), 0) == 0;
+		int ret = cleared ? process_frame(frames, &image, args, &frame) : -1;
+		off_t size = cleared ? lseek(fileno(scratch), 0, SEEK_END) : 0;
+
+		trace_end(&span);
+
+		if (ret == -1 || size == -1) {
+			atomic_fetch_add(&frames->failed, 1);
+			fprintf(stderr, FRAME_FAILED_MSG, frame.idx);
+		}
+
+		// the next frames wait for this one, it is written even if it failed
+		write_frame(frames, frame.idx, fileno(scratch), size == -1 ? 0 : size,
+					chunk);
+	}
+
+	set_output_stream(NULL);
+	set_save_sink(-1);
+
+out:
+	discard_image_ops(&image);
+	clear_history(&image);
+	reset_image(&image);
+	free(frame.raster);
+	free(args);
+	free(chunk);
+
+	if (sink)
+		fclose(sink);
+
+	if (scratch)
+		fclose(scratch);
+}
+
+// takes the next frame of the input, -1 once there are no more
+static int read_frame(frames_t *frames, frame_t *frame)
+{
+	pthread_mutex_lock(&frames->read_lock);
+
+	int ret = frames->input_done ? -1 : read_next_frame(frames, frame);
+
+	if (ret == -1)
+		frames->input_done = true;
+
+	pthread_mutex_unlock(&frames->read_lock);
+
+	return ret;
+}
+
+/*
+ * reads a header and the raster it announces; only binary frames can be
+ * told apart without decoding them, a plain one ends the input like a
+ * broken one does
+ */
+static int read_next_frame(frames_t *frames, frame_t *frame)
+{
+	int c;
+
+	// there may be whitespace after the last frame
+	while ((c = fgetc(frames->in)) != EOF && isspace(c))
+		;
+
+	if (c == EOF)
+		return -1;
+
+	ungetc(c, frames->in);
+
+	image_t *header = &frame->header;
+
+	memset(header, 0, sizeof(*header));
+	header->magic_word = INVALID_MAGIC_WORD;
+
+	size_t row_size = 0;
+
+	if (read_header(frames->in, header) == 0 &&
+		is_binary(header->magic_word)) {
+		// a single whitespace character ends the header
+		fgetc(frames->in);
+		row_size = encoded_row_size(header);
+	}
+
+	size_t size = row_size * header->height;
+
+	if (!row_size || header->height > SIZE_MAX / row_size)
+		goto fail;
+
+	if (size > frame->capacity) {
+		void *ret = realloc(frame->raster, size);
+
+		if (!ret)
+			goto fail;
+
+		frame->raster = ret;
+		frame->capacity = size;
+	}
+
+	if (fread(frame->raster, 1, size, frames->in) != size)
+		goto fail;
+
+	frame->idx = frames->frames_read++;
+	atomic_fetch_add(&frames->bytes, size);
+
+	return 0;
+
+fail:
+	atomic_fetch_add(&frames->failed, 1);
+	fprintf(stderr, FRAME_UNREADABLE_MSG, frames->frames_read);
+
+	return -1;
+}
+
+// decodes the frame into the image, dropping whatever the image held
+static int load_frame(image_t *image, frame_t *frame)
+{
+	discard_image_ops(image);
+	clear_history(image);
+	reset_image(image);
+
+	image->magic_word = frame->header.magic_word;
+	image->width      = frame->header.width;
+	image->height     = frame->header.height;
+	image->max_val    = frame->header.max_val;
+	image->depth      = frame->header.depth;
+
+	memcpy(image->tuple_type, frame->header.tuple_type,
+		   sizeof(image->tuple_type));
+
+	if (create_matrix(image) == -1)
+		return -1;
+
+	size_t row_size = encoded_row_size(image);
+
+	for (size_t i = 0; i < image->height; i++) {
+		advise_row_access(image, i);
+		decode_image_row(frame->raster + i * row_size, image, i);
+	}
+
+	image->is_loaded = true;
+
+	image->selection.upper_left.x  = 0;
+	image->selection.upper_left.y  = 0;
+	image->selection.lower_right.x = image->width;
+	image->selection.lower_right.y = image->height;
+
+	return 0;
+}
+
+/*
+ * runs the recipe on one frame, the frame is loaded first if the recipe
+ * doesn't start with a LOAD; as in --batch, a failed command doesn't stop
+ * the ones after it
+ */
+static int process_frame(frames_t *frames, image_t *image, char **args,
+						 frame_t *frame)
+{
+	plan_t *plan = frames->plan;
+	int ret = 0;
+
+	if ((!plan->count || plan->ops[0].type != LOAD) &&
+		load_frame(image, frame) == -1)
+		return -1;
+
+	for (size_t i = 0; i < plan->count; i++) {
+		operation_t *op = &plan->ops[i];
+
+		// EXIT ends the recipe
+		if (op->type == EXIT)
+			break;
+
+		if (op->type == LOAD) {
+			if (load_frame(image, frame) == -1)
+				return -1;
+
+			continue;
+		}
+
+		if (op->argc)
+			memcpy(args, op->argv, op->argc * sizeof(*args));
+
+		if (run_image_command(op->type, op->argc ? args : NULL, op->argc,
+							  image))
+			ret = -1;
+	}
+
+	return ret;
+}
+
+/*
+ * copies what the recipe saved of a frame to the output, once every frame
+ * before it is there; a broken output stops the input too
+ */
+static void write_frame(frames_t *frames, size_t idx, int fd, size_t size,
+						unsigned char *chunk)
+{
+	pthread_mutex_lock(&frames->write_lock);
+
+	while (frames->frames_written != idx)
+		pthread_cond_wait(&frames->written, &frames->write_lock);
+
+	bool failed = frames->output_failed;
+
+	pthread_mutex_unlock(&frames->write_lock);
+
+	// the other workers wait for frames_written to move, no lock needed
+	for (size_t offset = 0; offset < size && !failed;
+		 offset += COPY_CHUNK_SIZE) {
+		size_t len = min(COPY_CHUNK_SIZE, size - offset);
+
+		failed = async_read(fd, chunk, len, offset) == -1 ||
+				 write_all(frames->out_fd, chunk, len) == -1;
+	}
+
+	if (failed) {
+		pthread_mutex_lock(&frames->read_lock);
+		frames->input_done = true;
+		pthread_mutex_unlock(&frames->read_lock);
+	}
+
+	pthread_mutex_lock(&frames->write_lock);
+
+	frames->output_failed = failed;
+	frames->frames_written++;
+	pthread_cond_broadcast(&frames->written);
+
+	pthread_mutex_unlock(&frames->write_lock);
+}
+
+// write() until everything is out, the output may be a pipe
+static int write_all(int fd, const unsigned char *buffer, size_t size)
+{
+	while (size) {
+		ssize_t ret = write(fd, buffer, size);
+
+		if (ret == -1 && errno == EINTR)
+			continue;
+
+		if (ret <= 0)
+			return -1;
+
+		buffer += ret;
+		size -= ret;
+	}
+
+	return 0;
+}
+
+static double elapsed_seconds(struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (now.tv_sec - start->tv_sec) +
+		   (now.tv_nsec - start->tv_nsec) / 1e9;
+}
@@ -0,0 +1,3 @@
+#pragma once
+
+int run_frames(const char *script, const char *input, const char *output);
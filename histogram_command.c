@@ -2,10 +2,13 @@
 #include <stdbool.h>
 #include <math.h>
 #include <stdio.h>
+#include <stdlib.h>
 
 #include "image.h"
 #include "histogram_command.h"
 #include "error.h"
+#include "output.h"
+#include "pnm.h"
 
 #define HISTOGRAM_ARG_COUNT 2
 
@@ -37,6 +40,12 @@ void histogram_command(image_t *image, char **argv, int argc, jmp_buf ex_buf__)
 	if (is_color(image->magic_word))
 		longjmp(ex_buf__, E_COLOR_IMAGE);
 
+	if (is_bitmap(image->magic_word))
+		longjmp(ex_buf__, E_BITMAP_IMAGE);
+
+	if (is_pam(image->magic_word))
+		longjmp(ex_buf__, E_PAM_IMAGE);
+
 	histogram_t histogram;
 
 	if (create_histogram(&histogram, image, (size_t)temp[1],
@@ -61,20 +70,25 @@ static int create_histogram(histogram_t *histogram, image_t *image, size_t bins,
 	if (!histogram->values)
 		return -1;
 
-	size_t freq[MAX_PIXEL_VAL + 1] = {0};
+	// one bin for every value of the depth, grouped into the requested bins
+	unsigned int limit = pixel_limit(image->max_val);
+	size_t *freq = calloc(limit + 1, sizeof(*freq));
 	size_t max_freq = 0;
 
+	if (!freq) {
+		free(histogram->values);
+		return -1;
+	}
+
 	for (size_t i = 0; i < image->height; i++) {
-		for (size_t j = 0; j < image->width; j++) {
-			unsigned char val = (unsigned char)round
-								(image->matrix[i][j].grayscale.value);
+		advise_row_access(image, i);
 
-			freq[val]++;
-		}
+		for (size_t j = 0; j < image->width; j++)
+			freq[to_sample(image->matrix[i][j].grayscale.value, limit)]++;
 	}
 
-	for (size_t i = 0; i <= MAX_PIXEL_VAL; i++) {
-		size_t idx = i * bins / (MAX_PIXEL_VAL + 1);
+	for (size_t i = 0; i <= limit; i++) {
+		size_t idx = i * bins / (limit + 1);
 
 		histogram->values[idx] += freq[i];
 
@@ -82,6 +96,8 @@ static int create_histogram(histogram_t *histogram, image_t *image, size_t bins,
 			max_freq = histogram->values[idx];
 	}
 
+	free(freq);
+
 	for (size_t i = 0; i < bins; i++) {
 		histogram->values[i] *= max_val;
 		histogram->values[i] = floor((double)histogram->values[i] /
@@ -94,15 +110,15 @@ static int create_histogram(histogram_t *histogram, image_t *image, size_t bins,
 static void print_histogram(histogram_t histogram)
 {
 	for (size_t i = 0; i < histogram.bins; i++) {
-		printf("%zu\t|\t", histogram.values[i]);
+		out_printf("%zu\t|\t", histogram.values[i]);
 
 		if (histogram.values[i] > 10000)
 			continue;
 
 		for (size_t j = 0; j < histogram.values[i]; j++)
-			printf("*");
+			out_printf("*");
 
-		printf("\n");
+		out_printf("\n");
 	}
 }
 
@@ -0,0 +1,284 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+
+#include "history.h"
+#include "image.h"
+#include "lazy.h"
+
+/*
+ * a state of the image; its rows are shared with the states around it, so
+ * it only costs the rows that the next edit replaced
+ */
+typedef struct {
+	image_t image;
+	size_t bytes;
+} snapshot_t;
+
+typedef struct {
+	snapshot_t *items;
+	size_t count;
+	size_t capacity;
+} snapshot_stack_t;
+
+struct history {
+	snapshot_stack_t undo;
+	snapshot_stack_t redo;
+	size_t bytes;
+};
+
+// budget of the history of every image, 0 disables it
+static atomic_size_t history_limit;
+
+static struct history *get_history(image_t *image);
+static int push_snapshot(snapshot_stack_t *stack, image_t *image);
+static void drop_snapshot(struct history *history, snapshot_t *snapshot);
+static void clear_stack(struct history *history, snapshot_stack_t *stack);
+static void restore_snapshot(struct history *history, image_t *image,
+							 snapshot_t *snapshot);
+static size_t snapshot_cost(image_t *snapshot, image_t *next);
+static void evict_history(struct history *history);
+
+void set_history_limit(size_t limit)
+{
+	atomic_store(&history_limit, limit);
+}
+
+bool history_enabled(void)
+{
+	return atomic_load(&history_limit) != 0;
+}
+
+// saves the state of the image before an edit
+int record_history(image_t *image)
+{
+	struct history *history = get_history(image);
+
+	if (!history || !image->is_loaded)
+		return -1;
+
+	// the previous state's cost is final now that its successor is known
+	if (history->undo.count) {
+		snapshot_t *top = &history->undo.items[history->undo.count - 1];
+
+		history->bytes -= top->bytes;
+		top->bytes = snapshot_cost(&top->image, image);
+		history->bytes += top->bytes;
+	}
+
+	return push_snapshot(&history->undo, image);
+}
+
+/*
+ * keeps the state saved by record_history() if the edit went through; a new
+ * edit makes the undone states unreachable, a failed one leaves them alone
+ */
+void commit_history(image_t *image, bool keep)
+{
+	struct history *history = image->history;
+
+	if (!history || !history->undo.count)
+		return;
+
+	snapshot_t *top = &history->undo.items[history->undo.count - 1];
+
+	if (!keep) {
+		drop_snapshot(history, top);
+		history->undo.count--;
+		return;
+	}
+
+	clear_stack(history, &history->redo);
+
+	top->bytes = snapshot_cost(&top->image, image);
+	history->bytes += top->bytes;
+
+	evict_history(history);
+}
+
+// goes back to the state before the last edit
+int undo_image(image_t *image)
+{
+	struct history *history = image->history;
+
+	if (!history || !history->undo.count)
+		return -1;
+
+	if (push_snapshot(&history->redo, image) == -1)
+		return -1;
+
+	snapshot_t *top = &history->undo.items[--history->undo.count];
+	snapshot_t *redo = &history->redo.items[history->redo.count - 1];
+
+	// the state that was just left now costs what the undone one did
+	redo->bytes = top->bytes;
+	history->bytes += redo->bytes;
+
+	discard_image_ops(image);
+	restore_snapshot(history, image, top);
+
+	evict_history(history);
+
+	return 0;
+}
+
+// goes forward to the state the last UNDO left
+int redo_image(image_t *image)
+{
+	struct history *history = image->history;
+
+	if (!history || !history->redo.count)
+		return -1;
+
+	if (push_snapshot(&history->undo, image) == -1)
+		return -1;
+
+	snapshot_t *top = &history->redo.items[--history->redo.count];
+	snapshot_t *undo = &history->undo.items[history->undo.count - 1];
+
+	undo->bytes = top->bytes;
+	history->bytes += undo->bytes;
+
+	discard_image_ops(image);
+	restore_snapshot(history, image, top);
+
+	evict_history(history);
+
+	return 0;
+}
+
+// forgets every state of the image, e.g. when another file is loaded
+void clear_history(image_t *image)
+{
+	struct history *history = image->history;
+
+	if (!history)
+		return;
+
+	clear_stack(history, &history->undo);
+	clear_stack(history, &history->redo);
+
+	free(history->undo.items);
+	free(history->redo.items);
+	free(history);
+
+	image->history = NULL;
+}
+
+static struct history *get_history(image_t *image)
+{
+	if (!image->history)
+		image->history = calloc(1, sizeof(*image->history));
+
+	return image->history;
+}
+
+static int push_snapshot(snapshot_stack_t *stack, image_t *image)
+{
+	if (stack->count == stack->capacity) {
+		size_t capacity = stack->capacity ? 2 * stack->capacity : 8;
+		void *ret = realloc(stack->items, capacity * sizeof(*stack->items));
+
+		if (!ret)
+			return -1;
+
+		stack->items = ret;
+		stack->capacity = capacity;
+	}
+
+	snapshot_t *snapshot = &stack->items[stack->count];
+
+	memset(snapshot, 0, sizeof(*snapshot));
+	snapshot->image.matrix = NULL;
+
+	if (copy_image(&snapshot->image, image) == -1) {
+		reset_image(&snapshot->image);
+		return -1;
+	}
+
+	stack->count++;
+
+	return 0;
+}
+
+static void drop_snapshot(struct history *history, snapshot_t *snapshot)
+{
+	history->bytes -= snapshot->bytes;
+	snapshot->bytes = 0;
+
+	reset_image(&snapshot->image);
+}
+
+static void clear_stack(struct history *history, snapshot_stack_t *stack)
+{
+	for (size_t i = 0; i < stack->count; i++)
+		drop_snapshot(history, &stack->items[i]);
+
+	stack->count = 0;
+}
+
+/*
+ * hands the rows of a state over to the image instead of sharing them, so
+ * that going back or forward can't fail halfway
+ */
+static void restore_snapshot(struct history *history, image_t *image,
+							 snapshot_t *snapshot)
+{
+	struct lazy_queue *pending = image->pending;
+
+	free_matrix(image);
+
+	*image = snapshot->image;
+	image->pending = pending;
+	image->history = history;
+
+	snapshot->image.matrix = NULL;
+	drop_snapshot(history, snapshot);
+}
+
+// the rows of a state that the state after it doesn't share
+static size_t snapshot_cost(image_t *snapshot, image_t *next)
+{
+	size_t bytes = snapshot->height * sizeof(*snapshot->matrix);
+
+	for (size_t i = 0; i < snapshot->height; i++)
+		if (i >= next->height || !next->matrix ||
+			snapshot->matrix[i] != next->matrix[i])
+			bytes += row_size(snapshot);
+
+	return bytes;
+}
+
+/*
+ * drops the oldest states until the history fits its budget, then the undone
+ * states furthest from the current one
+ */
+static void evict_history(struct history *history)
+{
+	size_t limit = atomic_load(&history_limit);
+	size_t dropped = 0;
+
+	while (history->bytes > limit && dropped < history->undo.count)
+		drop_snapshot(history, &history->undo.items[dropped++]);
+
+	if (dropped) {
+		memmove(history->undo.items, history->undo.items + dropped,
+				(history->undo.count - dropped) *
+				sizeof(*history->undo.items));
+		history->undo.count -= dropped;
+	}
+
+	// the bottom of the redo stack is the last state REDO would reach
+	dropped = 0;
+
+	while (history->bytes > limit && dropped < history->redo.count)
+		drop_snapshot(history, &history->redo.items[dropped++]);
+
+	if (dropped) {
+		memmove(history->redo.items, history->redo.items + dropped,
+				(history->redo.count - dropped) *
+				sizeof(*history->redo.items));
+		history->redo.count -= dropped;
+	}
+}
@@ -0,0 +1,20 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "image.h"
+
+void set_history_limit(size_t limit);
+
+bool history_enabled(void);
+
+int record_history(image_t *image);
+
+void commit_history(image_t *image, bool keep);
+
+int undo_image(image_t *image);
+
+int redo_image(image_t *image);
+
+void clear_history(image_t *image);
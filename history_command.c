@@ -0,0 +1,39 @@
+#include <setjmp.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+#include "history_command.h"
+#include "history.h"
+#include "image.h"
+#include "error.h"
+#include "output.h"
+
+#define HISTORY_ARG_COUNT 1
+#define HISTORY_SUCCESS_MSG "History limit set to %d MB\n"
+
+#define BYTES_PER_MB (1024 * 1024)
+
+/*
+ * HISTORY <MB>
+ * keeps the states before the edits of every image for UNDO, as long as the
+ * rows they don't share with the next state fit in MB; 0 (the default)
+ * stops recording
+ */
+void history_command(image_t *image, char **argv, int argc, jmp_buf ex_buf__)
+{
+	if (!image)
+		longjmp(ex_buf__, E_INVALID_FUNC_ARGS);
+
+	if (argc != HISTORY_ARG_COUNT)
+		longjmp(ex_buf__, E_INVALID_COMMAND);
+
+	int limit = atoi(argv[0]);
+
+	// check if argument is a number
+	if ((!limit && argv[0][0] != '0') || limit < 0)
+		longjmp(ex_buf__, E_INVALID_COMMAND);
+
+	set_history_limit((size_t)limit * BYTES_PER_MB);
+
+	out_printf(HISTORY_SUCCESS_MSG, limit);
+}
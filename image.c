@@ -1,14 +1,84 @@
 #include <stdbool.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
 
 #include "image.h"
 #include "utils.h"
+#include "pool.h"
+
+#define STORE_BAND_ROWS 64
+// scratch file the rows copied past the memory limit are carved from
+#define SPILL_STORE_SIZE (64 * 1024 * 1024)
+
+// 0 means that every matrix lives on the heap
+static atomic_size_t memory_limit;
+static atomic_size_t heap_matrix_bytes;
+
+/*
+ * every row starts with a header; rows are shared between images by copies
+ * and only duplicated once written (see make_row_writable())
+ */
+typedef union {
+	struct {
+		atomic_size_t refs;
+		// scratch file the row lives in, NULL for heap rows
+		struct pixel_store_t *store;
+		size_t width;
+		// pixels that fit in the row's block
+		size_t capacity;
+	};
+	max_align_t align;
+} row_header_t;
+
+#define ROW_HEADER_SIZE sizeof(row_header_t)
+
+/*
+ * scratch file mapping that backs a matrix which didn't fit the memory limit,
+ * or the rows written past the limit
+ */
+typedef struct pixel_store_t {
+	void *base;
+	size_t size;
+	// rows still referenced by some image
+	atomic_size_t rows;
+} pixel_store_t;
+
+/*
+ * the store rows are copied to once the heap is over the limit; it holds a
+ * row count of its own while rows are still carved from it
+ */
+static struct {
+	pthread_mutex_t lock;
+	pixel_store_t *store;
+	size_t used;
+} spill = {
+	.lock = PTHREAD_MUTEX_INITIALIZER
+};
+
+static pixel_store_t *create_pixel_store(size_t size);
+static void release_pixel_store(pixel_store_t *store);
+static void free_pixel_store(pixel_store_t *store);
+static void advise_rows(image_t *image, size_t first, size_t count,
+						int advice);
+static pixel_t *alloc_row(size_t width, bool zeroed);
+static pixel_t *alloc_spilled_row(size_t width);
+static size_t row_stride(size_t width);
+static void release_row(pixel_t *row);
+static pixel_t *resize_row(pixel_t *row, size_t new_width);
+static row_header_t *row_header(pixel_t *row);
+static size_t row_length(const image_t *image, size_t width);
 
 // checks if a magic word refers to a binary image
 bool is_binary(MAGIC_WORD magic_word)
 {
-	return (magic_word == P5 || magic_word == P6);
+	return (magic_word == P4 || magic_word == P5 || magic_word == P6 ||
+			magic_word == P7);
 }
 
 // checks if a magic word refers to a color image
@@ -17,7 +87,32 @@ bool is_color(MAGIC_WORD magic_word)
 	return (magic_word == P3 || magic_word == P6);
 }
 
-// allocates memory for a pixel matrix
+// checks if a magic word refers to a bitmap, stored 1 bit per pixel
+bool is_bitmap(MAGIC_WORD magic_word)
+{
+	return (magic_word == P1 || magic_word == P4);
+}
+
+// checks if a magic word refers to a PAM image, stored one plane per channel
+bool is_pam(MAGIC_WORD magic_word)
+{
+	return magic_word == P7;
+}
+
+// bytes of pixel data in every row of the image
+size_t row_size(const image_t *image)
+{
+	if (!image)
+		return 0;
+
+	return row_length(image, image->width) * sizeof(pixel_t);
+}
+
+/*
+ * allocates memory for a pixel matrix; when the heap-backed matrices would
+ * exceed the memory limit, the pixels go to a scratch file mapping instead,
+ * so the kernel can page them out rather than the process getting killed
+ */
 int create_matrix(image_t *image)
 {
 	if (!image || image->height <= 0 || image->width <= 0)
@@ -28,15 +123,50 @@ int create_matrix(image_t *image)
 	if (!image->matrix)
 		return -1;
 
+	size_t length = row_length(image, image->width);
+	size_t stride = row_stride(length);
+	size_t size = image->height * length * sizeof(**image->matrix);
+
+	size_t limit = atomic_load(&memory_limit);
+
+	if (limit && atomic_load(&heap_matrix_bytes) + size > limit) {
+		pixel_store_t *store = create_pixel_store(image->height * stride);
+
+		if (!store) {
+			free(image->matrix);
+			image->matrix = NULL;
+
+			return -1;
+		}
+
+		// the store lives until the last of its rows is released
+		atomic_init(&store->rows, image->height);
+
+		for (size_t i = 0; i < image->height; i++) {
+			row_header_t *header = (row_header_t *)((char *)store->base +
+													i * stride);
+
+			atomic_init(&header->refs, 1);
+			header->store = store;
+			header->width = length;
+			header->capacity = length;
+
+			image->matrix[i] = (pixel_t *)(header + 1);
+		}
+
+		return 0;
+	}
+
 	for (size_t i = 0; i < image->height; i++) {
-		image->matrix[i] = calloc(image->width, sizeof(*image->matrix[i]));
+		image->matrix[i] = alloc_row(length, true);
 
 		if (!image->matrix[i]) {
 			// free previously allocated memory
 			for (size_t j = 0; j < i; j++)
-				free(image->matrix[i]);
+				release_row(image->matrix[j]);
 
 			free(image->matrix);
+			image->matrix = NULL;
 
 			return -1;
 		}
@@ -51,8 +181,9 @@ void free_matrix(image_t *image)
 	if (!image || !image->matrix)
 		return;
 
+	// rows shared with other images stay alive for them
 	for (size_t i = 0; i < image->height; i++)
-		free(image->matrix[i]);
+		release_row(image->matrix[i]);
 
 	free(image->matrix);
 
@@ -71,8 +202,11 @@ void reset_image(image_t *image)
 	image->height     = 0;
 	image->width      = 0;
 	image->max_val    = 0;
+	image->depth      = 0;
 	image->is_loaded  = false;
 
+	image->tuple_type[0] = '\0';
+
 	image->selection.lower_right.x = 0;
 	image->selection.lower_right.y = 0;
 	image->selection.upper_left.x  = 0;
@@ -85,8 +219,32 @@ int resize_matrix(image_t *image, size_t new_width, size_t new_height)
 	if (!image || !new_width || !new_height)
 		return -1;
 
+	size_t length = row_length(image, image->width);
+	size_t new_length = row_length(image, new_width);
+
+	// spilled rows can't grow in place, move to a matrix within the limit
+	if (row_header(image->matrix[0])->store && new_length != length) {
+		image_t res = *image;
+
+		res.width  = new_width;
+		res.height = new_height;
+
+		if (create_matrix(&res) == -1)
+			return -1;
+
+		for (size_t i = 0; i < min(new_height, image->height); i++)
+			memcpy(res.matrix[i], image->matrix[i],
+				   min(new_length, length) * sizeof(**res.matrix));
+
+		free_matrix(image);
+
+		*image = res;
+
+		return 0;
+	}
+
 	for (size_t i = new_height; i < image->height; i++)
-		free(image->matrix[i]);
+		release_row(image->matrix[i]);
 
 	void *ret = realloc(image->matrix, new_height * sizeof(*image->matrix));
 
@@ -96,7 +254,7 @@ int resize_matrix(image_t *image, size_t new_width, size_t new_height)
 	image->matrix = ret;
 
 	for (size_t i = 0; i < min(new_height, image->height); i++) {
-		ret = realloc(image->matrix[i], new_width * sizeof(*image->matrix[i]));
+		ret = resize_row(image->matrix[i], new_length);
 
 		if (!ret)
 			return -1;
@@ -105,7 +263,7 @@ int resize_matrix(image_t *image, size_t new_width, size_t new_height)
 	}
 
 	for (size_t i = image->height; i < new_height; i++) {
-		image->matrix[i] = calloc(new_width, sizeof(*image->matrix[i]));
+		image->matrix[i] = alloc_row(new_length, true);
 
 		if (!image->matrix[i])
 			return -1;
@@ -117,7 +275,10 @@ int resize_matrix(image_t *image, size_t new_width, size_t new_height)
 	return 0;
 }
 
-// copies src image to dest
+/*
+ * copies src image to dest; the rows are shared, so this only costs a
+ * pointer per row until one of the images writes to a row
+ */
 int copy_image(image_t *dest, image_t *src)
 {
 	if (!dest || !src)
@@ -129,19 +290,324 @@ int copy_image(image_t *dest, image_t *src)
 	dest->height     = src->height;
 	dest->width      = src->width;
 	dest->max_val    = src->max_val;
+	dest->depth      = src->depth;
 	dest->is_loaded  = src->is_loaded;
 
+	memcpy(dest->tuple_type, src->tuple_type, sizeof(dest->tuple_type));
+
 	dest->selection.upper_left.x  = src->selection.upper_left.x;
 	dest->selection.upper_left.y  = src->selection.upper_left.y;
 	dest->selection.lower_right.x = src->selection.lower_right.x;
 	dest->selection.lower_right.y = src->selection.lower_right.y;
 
-	if (create_matrix(dest) == -1)
+	if (!src->matrix)
+		return -1;
+
+	dest->matrix = malloc(src->height * sizeof(*dest->matrix));
+
+	if (!dest->matrix)
 		return -1;
 
-	for (size_t i = 0; i < src->height; i++)
-		for (size_t j = 0; j < src->width; j++)
-			dest->matrix[i][j] = src->matrix[i][j];
+	for (size_t i = 0; i < src->height; i++) {
+		atomic_fetch_add(&row_header(src->matrix[i])->refs, 1);
+		dest->matrix[i] = src->matrix[i];
+	}
 
 	return 0;
 }
+
+/*
+ * gives the image its own copy of a row before it gets written, if the row
+ * is shared with another image
+ */
+int make_row_writable(image_t *image, size_t row)
+{
+	if (!image || !image->matrix || row >= image->height)
+		return -1;
+
+	pixel_t *old_row = image->matrix[row];
+
+	// the only reference can't be taken by anyone else meanwhile
+	if (atomic_load(&row_header(old_row)->refs) == 1)
+		return 0;
+
+	size_t length = row_length(image, image->width);
+	pixel_t *new_row = alloc_row(length, false);
+
+	if (!new_row)
+		return -1;
+
+	memcpy(new_row, old_row, length * sizeof(*new_row));
+
+	image->matrix[row] = new_row;
+	release_row(old_row);
+
+	return 0;
+}
+
+// make_row_writable() for a range of rows
+int make_rows_writable(image_t *image, size_t first, size_t count)
+{
+	for (size_t i = first; i < first + count; i++)
+		if (make_row_writable(image, i) == -1)
+			return -1;
+
+	return 0;
+}
+
+// sets the memory budget of heap-backed matrices in bytes, 0 for no limit
+void set_memory_limit(size_t limit)
+{
+	atomic_store(&memory_limit, limit);
+}
+
+/*
+ * hint for code walking a matrix top to bottom: once per band, a spilled
+ * matrix reads the next band ahead and drops the band behind the previous one
+ * from memory (it stays in the scratch file)
+ */
+void advise_row_access(image_t *image, size_t row)
+{
+	if (!image || !image->matrix || row % STORE_BAND_ROWS ||
+		row >= image->height || !row_header(image->matrix[row])->store)
+		return;
+
+	advise_rows(image, row + STORE_BAND_ROWS, STORE_BAND_ROWS, MADV_WILLNEED);
+
+	if (row >= 2 * STORE_BAND_ROWS)
+		advise_rows(image, row - 2 * STORE_BAND_ROWS, STORE_BAND_ROWS,
+					MADV_DONTNEED);
+}
+
+/*
+ * advises the part of the scratch file between two rows; rows that were
+ * copied on write or come from other images' stores are skipped
+ */
+static void advise_rows(image_t *image, size_t first, size_t count,
+						int advice)
+{
+	if (first >= image->height)
+		return;
+
+	count = min(count, image->height - first);
+
+	pixel_store_t *store = row_header(image->matrix[first])->store;
+
+	if (!store || row_header(image->matrix[first + count - 1])->store != store)
+		return;
+
+	uintptr_t page_size = sysconf(_SC_PAGESIZE);
+	uintptr_t start = (uintptr_t)row_header(image->matrix[first]);
+	uintptr_t end = (uintptr_t)(image->matrix[first + count - 1] +
+								row_length(image, image->width));
+
+	if (start >= end)
+		return;
+
+	start &= ~(page_size - 1);
+	start = start < (uintptr_t)store->base ? (uintptr_t)store->base : start;
+
+	madvise((void *)start, end - start, advice);
+}
+
+/*
+ * a row owned by the caller, from the pool; past the memory limit it goes to
+ * a scratch file instead, like the matrices create_matrix() spills
+ */
+static pixel_t *alloc_row(size_t width, bool zeroed)
+{
+	size_t limit = atomic_load(&memory_limit);
+
+	if (limit &&
+		atomic_load(&heap_matrix_bytes) + width * sizeof(pixel_t) > limit)
+		return alloc_spilled_row(width);
+
+	size_t size = ROW_HEADER_SIZE + width * sizeof(pixel_t);
+	row_header_t *header = zeroed ? pool_calloc(size) : pool_alloc(size);
+
+	if (!header)
+		return NULL;
+
+	atomic_init(&header->refs, 1);
+	header->store = NULL;
+	header->width = width;
+	header->capacity = width;
+
+	atomic_fetch_add(&heap_matrix_bytes, width * sizeof(pixel_t));
+
+	return (pixel_t *)(header + 1);
+}
+
+// a zeroed row of the spill store, which is replaced once it's full
+static pixel_t *alloc_spilled_row(size_t width)
+{
+	size_t stride = row_stride(width);
+
+	pthread_mutex_lock(&spill.lock);
+
+	if (!spill.store || spill.used + stride > spill.store->size) {
+		pixel_store_t *store = create_pixel_store(stride > SPILL_STORE_SIZE ?
+												  stride : SPILL_STORE_SIZE);
+
+		if (!store) {
+			pthread_mutex_unlock(&spill.lock);
+			return NULL;
+		}
+
+		atomic_init(&store->rows, 1);
+
+		if (spill.store)
+			release_pixel_store(spill.store);
+
+		spill.store = store;
+		spill.used = 0;
+	}
+
+	// the slots are never reused, so they are still zero from ftruncate()
+	row_header_t *header = (row_header_t *)((char *)spill.store->base +
+											spill.used);
+
+	spill.used += stride;
+	atomic_fetch_add(&spill.store->rows, 1);
+
+	atomic_init(&header->refs, 1);
+	header->store = spill.store;
+	header->width = width;
+	header->capacity = width;
+
+	pthread_mutex_unlock(&spill.lock);
+
+	return (pixel_t *)(header + 1);
+}
+
+// bytes a row takes in a store, every header in it has to stay aligned
+static size_t row_stride(size_t width)
+{
+	size_t stride = ROW_HEADER_SIZE + width * sizeof(pixel_t);
+
+	return (stride + ROW_HEADER_SIZE - 1) / ROW_HEADER_SIZE * ROW_HEADER_SIZE;
+}
+
+// drops a reference to a row, the last one frees it
+static void release_row(pixel_t *row)
+{
+	row_header_t *header = row_header(row);
+
+	if (atomic_fetch_sub(&header->refs, 1) != 1)
+		return;
+
+	if (header->store) {
+		release_pixel_store(header->store);
+		return;
+	}
+
+	atomic_fetch_sub(&heap_matrix_bytes, header->capacity * sizeof(pixel_t));
+	pool_free(header, ROW_HEADER_SIZE + header->capacity * sizeof(pixel_t));
+}
+
+// returns a row of the new width, keeping the pixels that still fit
+static pixel_t *resize_row(pixel_t *row, size_t new_width)
+{
+	row_header_t *header = row_header(row);
+	size_t width = header->width;
+
+	if (width == new_width)
+		return row;
+
+	// a private heap row keeps its block while the new width fits in it
+	if (!header->store && atomic_load(&header->refs) == 1 &&
+		new_width <= header->capacity) {
+		if (new_width > width)
+			memset(row + width, 0, (new_width - width) * sizeof(*row));
+
+		header->width = new_width;
+
+		return row;
+	}
+
+	pixel_t *new_row = alloc_row(new_width, true);
+
+	if (!new_row)
+		return NULL;
+
+	memcpy(new_row, row, min(width, new_width) * sizeof(*row));
+	release_row(row);
+
+	return new_row;
+}
+
+static row_header_t *row_header(pixel_t *row)
+{
+	return (row_header_t *)row - 1;
+}
+
+/*
+ * pixel_t slots a row of the given width takes; bitmap rows are words of 64
+ * pixels and PAM rows a plane of doubles per channel, rounded up to whole
+ * slots
+ */
+static size_t row_length(const image_t *image, size_t width)
+{
+	size_t bytes;
+
+	if (is_bitmap(image->magic_word))
+		bytes = bitmap_words(width) * sizeof(uint64_t);
+	else if (is_pam(image->magic_word))
+		bytes = image->depth * width * sizeof(double);
+	else
+		return width;
+
+	return (bytes + sizeof(pixel_t) - 1) / sizeof(pixel_t);
+}
+
+// maps a zeroed scratch file of the given size
+static pixel_store_t *create_pixel_store(size_t size)
+{
+	const char *dir = getenv("TMPDIR");
+	char path[4096];
+
+	snprintf(path, sizeof(path), "%s/image_editor.XXXXXX", dir ? dir : "/tmp");
+
+	int fd = mkstemp(path);
+
+	if (fd == -1)
+		return NULL;
+
+	// the file is only reachable through the mapping from now on
+	unlink(path);
+
+	pixel_store_t *store = malloc(sizeof(*store));
+
+	if (!store || ftruncate(fd, size) == -1) {
+		free(store);
+		close(fd);
+
+		return NULL;
+	}
+
+	store->size = size;
+	store->base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+	close(fd);
+
+	if (store->base == MAP_FAILED) {
+		free(store);
+
+		return NULL;
+	}
+
+	return store;
+}
+
+// the last row of a store unmaps it
+static void release_pixel_store(pixel_store_t *store)
+{
+	if (atomic_fetch_sub(&store->rows, 1) == 1)
+		free_pixel_store(store);
+}
+
+static void free_pixel_store(pixel_store_t *store)
+{
+	munmap(store->base, store->size);
+	free(store);
+}
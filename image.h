@@ -2,17 +2,29 @@
 
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <string.h>
 
 #define MAX_MAGIC_WORD_LENGTH 2
 #define MAX_PIXEL_VAL 255
+#define MAX_WIDE_PIXEL_VAL 65535
 #define MIN_PIXEL_VAL 0
 
+// pixels packed in every word of a bitmap row
+#define BITMAP_WORD_BITS 64
+
+// PAM (P7) images
+#define MAX_PAM_DEPTH 64
+#define MAX_TUPLE_TYPE_LENGTH 63
+
 typedef enum {
+	P1,
 	P2,
 	P3,
+	P4,
 	P5,
 	P6,
+	P7,
 	INVALID_MAGIC_WORD
 } MAGIC_WORD;
 
@@ -26,10 +38,13 @@ static inline MAGIC_WORD str_to_magic_word(const char *str)
 		MAGIC_WORD val;
 		const char *str;
 	} conversion[] = {
+		{P1, "P1"},
 		{P2, "P2"},
 		{P3, "P3"},
+		{P4, "P4"},
 		{P5, "P5"},
-		{P6, "P6"}
+		{P6, "P6"},
+		{P7, "P7"}
 	};
 
 	// bypass check-style warning
@@ -50,10 +65,13 @@ static inline const char *magic_word_to_str(MAGIC_WORD magic_word)
 		MAGIC_WORD val;
 		const char *str;
 	} conversion[] = {
+		{P1, "P1"},
 		{P2, "P2"},
 		{P3, "P3"},
+		{P4, "P4"},
 		{P5, "P5"},
-		{P6, "P6"}
+		{P6, "P6"},
+		{P7, "P7"}
 	};
 
 	// bypass check-style warning
@@ -96,16 +114,60 @@ typedef struct {
 	MAGIC_WORD magic_word;
 	size_t width;
 	size_t height;
-	unsigned char max_val;
+	unsigned short max_val;
+	// samples per pixel of a PAM image and what they hold, e.g. RGB_ALPHA
+	size_t depth;
+	char tuple_type[MAX_TUPLE_TYPE_LENGTH + 1];
+	// rows are reference counted, see make_row_writable() before writing
 	pixel_t **matrix;
 	selection_t selection;
 	bool is_loaded;
+	// deferred operations, owned by lazy.c and left alone by copy/reset
+	struct lazy_queue *pending;
+	// UNDO/REDO states, owned by history.c and left alone by copy/reset
+	struct history *history;
 } image_t;
 
+// highest value a sample can take, 16-bit once the max value is over 255
+static inline unsigned int pixel_limit(unsigned int max_val)
+{
+	return max_val > MAX_PIXEL_VAL ? MAX_WIDE_PIXEL_VAL : MAX_PIXEL_VAL;
+}
+
+// words of a bitmap row
+static inline size_t bitmap_words(size_t width)
+{
+	return (width + BITMAP_WORD_BITS - 1) / BITMAP_WORD_BITS;
+}
+
+/*
+ * the row of a bitmap image; pixel j is bit 63 - j % 64 of word j / 64, so
+ * the words read like the bytes of a P4 row, and 1 is black
+ */
+static inline uint64_t *bitmap_row(image_t *image, size_t row)
+{
+	return (uint64_t *)image->matrix[row];
+}
+
+/*
+ * a plane of a row of a PAM image; rows are planar, the samples of every
+ * channel are next to each other (plane c holds channel c of the whole row)
+ */
+static inline double *pam_plane(image_t *image, size_t row, size_t plane)
+{
+	return (double *)image->matrix[row] + plane * image->width;
+}
+
 bool is_binary(MAGIC_WORD magic_word);
 
 bool is_color(MAGIC_WORD magic_word);
 
+bool is_bitmap(MAGIC_WORD magic_word);
+
+bool is_pam(MAGIC_WORD magic_word);
+
+size_t row_size(const image_t *image);
+
 int create_matrix(image_t *image);
 
 void free_matrix(image_t *image);
@@ -115,3 +177,11 @@ void reset_image(image_t *image);
 int resize_matrix(image_t *image, size_t new_width, size_t new_height);
 
 int copy_image(image_t *dest, image_t *src);
+
+int make_row_writable(image_t *image, size_t row);
+
+int make_rows_writable(image_t *image, size_t first, size_t count);
+
+void set_memory_limit(size_t limit);
+
+void advise_row_access(image_t *image, size_t row);
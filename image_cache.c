@@ -0,0 +1,213 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "image_cache.h"
+#include "image.h"
+
+// a decoded file, valid as long as the file wasn't replaced or modified
+typedef struct cache_entry_t {
+	char *path;
+	dev_t dev;
+	ino_t ino;
+	off_t size;
+	struct timespec mtime;
+	image_t image;
+	size_t bytes;
+	struct cache_entry_t *prev;
+	struct cache_entry_t *next;
+} cache_entry_t;
+
+// least recently used entries at the tail
+static struct {
+	pthread_mutex_t lock;
+	cache_entry_t *head;
+	cache_entry_t *tail;
+	cache_stats_t stats;
+} cache = {
+	.lock = PTHREAD_MUTEX_INITIALIZER
+};
+
+static cache_entry_t *find_entry(const char *path);
+static bool entry_matches(cache_entry_t *entry, const struct stat *st);
+static void unlink_entry(cache_entry_t *entry);
+static void push_front(cache_entry_t *entry);
+static void drop_entry(cache_entry_t *entry);
+static void evict_to(size_t limit);
+
+// sets the memory budget of the cache in bytes, 0 disables it
+void set_cache_limit(size_t limit)
+{
+	pthread_mutex_lock(&cache.lock);
+
+	cache.stats.limit = limit;
+	evict_to(limit);
+
+	pthread_mutex_unlock(&cache.lock);
+}
+
+/*
+ * copies the cached decode of a file into the image; returns -1 on a miss,
+ * dropping the entry if the file changed since it was decoded
+ */
+int cache_lookup(const char *path, const struct stat *st, image_t *image)
+{
+	int ret = -1;
+
+	pthread_mutex_lock(&cache.lock);
+
+	if (!cache.stats.limit) {
+		pthread_mutex_unlock(&cache.lock);
+		return -1;
+	}
+
+	cache_entry_t *entry = find_entry(path);
+
+	if (entry && !entry_matches(entry, st)) {
+		drop_entry(entry);
+		entry = NULL;
+	}
+
+	if (entry && copy_image(image, &entry->image) == 0) {
+		unlink_entry(entry);
+		push_front(entry);
+		ret = 0;
+	}
+
+	if (ret)
+		cache.stats.misses++;
+	else
+		cache.stats.hits++;
+
+	pthread_mutex_unlock(&cache.lock);
+
+	return ret;
+}
+
+// keeps a copy of a freshly decoded file, if it fits the budget
+void cache_store(const char *path, const struct stat *st, image_t *image)
+{
+	size_t bytes = row_size(image) * image->height;
+
+	pthread_mutex_lock(&cache.lock);
+
+	if (bytes > cache.stats.limit) {
+		pthread_mutex_unlock(&cache.lock);
+		return;
+	}
+
+	cache_entry_t *entry = find_entry(path);
+
+	if (entry)
+		drop_entry(entry);
+
+	evict_to(cache.stats.limit - bytes);
+
+	entry = calloc(1, sizeof(*entry));
+
+	if (!entry || !(entry->path = strdup(path))) {
+		free(entry);
+		pthread_mutex_unlock(&cache.lock);
+		return;
+	}
+
+	entry->image.matrix = NULL;
+	entry->image.pending = NULL;
+	entry->image.history = NULL;
+
+	if (copy_image(&entry->image, image) == -1) {
+		reset_image(&entry->image);
+		free(entry->path);
+		free(entry);
+		pthread_mutex_unlock(&cache.lock);
+		return;
+	}
+
+	entry->dev = st->st_dev;
+	entry->ino = st->st_ino;
+	entry->size = st->st_size;
+	entry->mtime = st->st_mtim;
+	entry->bytes = bytes;
+
+	push_front(entry);
+
+	cache.stats.entries++;
+	cache.stats.bytes += bytes;
+
+	pthread_mutex_unlock(&cache.lock);
+}
+
+void get_cache_stats(cache_stats_t *stats)
+{
+	pthread_mutex_lock(&cache.lock);
+	*stats = cache.stats;
+	pthread_mutex_unlock(&cache.lock);
+}
+
+static cache_entry_t *find_entry(const char *path)
+{
+	for (cache_entry_t *it = cache.head; it; it = it->next)
+		if (!strcmp(it->path, path))
+			return it;
+
+	return NULL;
+}
+
+static bool entry_matches(cache_entry_t *entry, const struct stat *st)
+{
+	return entry->dev == st->st_dev && entry->ino == st->st_ino &&
+		   entry->size == st->st_size &&
+		   entry->mtime.tv_sec == st->st_mtim.tv_sec &&
+		   entry->mtime.tv_nsec == st->st_mtim.tv_nsec;
+}
+
+static void unlink_entry(cache_entry_t *entry)
+{
+	if (entry->prev)
+		entry->prev->next = entry->next;
+	else
+		cache.head = entry->next;
+
+	if (entry->next)
+		entry->next->prev = entry->prev;
+	else
+		cache.tail = entry->prev;
+
+	entry->prev = NULL;
+	entry->next = NULL;
+}
+
+static void push_front(cache_entry_t *entry)
+{
+	entry->next = cache.head;
+
+	if (cache.head)
+		cache.head->prev = entry;
+	else
+		cache.tail = entry;
+
+	cache.head = entry;
+}
+
+static void drop_entry(cache_entry_t *entry)
+{
+	unlink_entry(entry);
+
+	cache.stats.entries--;
+	cache.stats.bytes -= entry->bytes;
+
+	reset_image(&entry->image);
+	free(entry->path);
+	free(entry);
+}
+
+// drops the least recently used entries until the cache fits the limit
+static void evict_to(size_t limit)
+{
+	while (cache.tail && cache.stats.bytes > limit) {
+		drop_entry(cache.tail);
+		cache.stats.evictions++;
+	}
+}
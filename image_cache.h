@@ -0,0 +1,23 @@
+#pragma once
+
+#include <stddef.h>
+#include <sys/stat.h>
+
+#include "image.h"
+
+typedef struct {
+	size_t hits;
+	size_t misses;
+	size_t evictions;
+	size_t entries;
+	size_t bytes;
+	size_t limit;
+} cache_stats_t;
+
+void set_cache_limit(size_t limit);
+
+int cache_lookup(const char *path, const struct stat *st, image_t *image);
+
+void cache_store(const char *path, const struct stat *st, image_t *image);
+
+void get_cache_stats(cache_stats_t *stats);
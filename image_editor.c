@@ -1,13 +1,66 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <stdbool.h>
+#include <string.h>
 
 #include "image.h"
 #include "command.h"
+#include "save_command.h"
+#include "script.h"
+#include "batch.h"
+#include "frames.h"
+#include "server.h"
+#include "workspace.h"
+#include "stats_command.h"
+#include "trace.h"
 
-int main(void)
+#define USAGE_MSG \
+	"Usage: %s [--stats json] [--trace <file.json>] [--script <file> | " \
+	"--batch <script> <glob> --out <dir> | " \
+	"--frames <script> [<input> <output>] | --serve <socket>]\n"
+
+static int run_script(const char *path);
+static void print_stats_at_exit(void);
+
+int main(int argc, char *argv[])
 {
-	image_t loaded_image;
-	loaded_image.is_loaded = false;
+	const char *name = argv[0];
+
+	// --stats json and --trace come first and work with every mode
+	while (argc >= 3) {
+		if (!strcmp(argv[1], "--stats") && !strcmp(argv[2], "json")) {
+			atexit(print_stats_at_exit);
+		} else if (!strcmp(argv[1], "--trace")) {
+			if (start_trace(argv[2]) == -1) {
+				perror(argv[2]);
+				return 1;
+			}
+		} else {
+			break;
+		}
+
+		argv += 2;
+		argc -= 2;
+	}
+
+	if (argc == 3 && !strcmp(argv[1], "--script"))
+		return run_script(argv[2]);
+
+	if (argc == 6 && !strcmp(argv[1], "--batch") && !strcmp(argv[4], "--out"))
+		return run_batch(argv[2], argv[3], argv[5]);
+
+	// stdin to stdout unless both files are given, "-" works for either
+	if ((argc == 3 || argc == 5) && !strcmp(argv[1], "--frames"))
+		return run_frames(argv[2], argc == 5 ? argv[3] : "-",
+						  argc == 5 ? argv[4] : "-");
+
+	if (argc == 3 && !strcmp(argv[1], "--serve"))
+		return run_server(argv[2]);
+
+	if (argc != 1) {
+		fprintf(stderr, USAGE_MSG, name);
+		return 1;
+	}
 
 	char *command = NULL;
 
@@ -16,11 +69,40 @@ int main(void)
 		// save pointer to free after strtok modifications
 		char *og_command = command;
 
-		run_command(command, &loaded_image);
+		run_command(command, current_image());
 
 		free(og_command);
 		command = NULL;
 	}
 
-	return 0;
+	// input ended without EXIT
+	run_queued_commands();
+
+	return wait_pending_saves() == -1 ? 1 : 0;
+}
+
+// parses the whole script up front, optimizes it and runs it
+static int run_script(const char *path)
+{
+	plan_t plan;
+
+	if (parse_script(path, &plan) == -1) {
+		perror(path);
+		return 1;
+	}
+
+	optimize_plan(&plan);
+	run_plan(&plan);
+	free_plan(&plan);
+
+	// script ended without EXIT
+	run_queued_commands();
+
+	return wait_pending_saves() == -1 ? 1 : 0;
+}
+
+// EXIT ends the process from inside the command loop, hence atexit()
+static void print_stats_at_exit(void)
+{
+	print_stats(stderr);
 }
@@ -0,0 +1,365 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+
+#include "lazy.h"
+#include "image.h"
+#include "utils.h"
+#include "apply_command.h"
+#include "equalize_command.h"
+#include "rotate_command.h"
+#include "crop_command.h"
+#include "bitmap.h"
+#include "trace.h"
+
+#define MAX_ROTATE_ANGLE 360
+
+/*
+ * while operations are pending, the image's size and selection describe the
+ * result of all of them (so SELECT and the checks of the next commands work
+ * as usual), while the matrix still has the size saved here
+ */
+struct lazy_queue {
+	image_op_t *ops;
+	size_t count;
+	size_t capacity;
+	size_t width;
+	size_t height;
+};
+
+static atomic_bool lazy_mode;
+
+static int execute_image_op(image_t *image, image_op_t op);
+static void update_shape(image_t *image, image_op_t op);
+static void fold_rotations(struct lazy_queue *queue);
+static int push_crops_down(struct lazy_queue *queue);
+static int insert_op(struct lazy_queue *queue, size_t idx, image_op_t op);
+static selection_t grow_selection(selection_t selection, size_t width,
+								  size_t height);
+static selection_t relative_selection(selection_t selection,
+									  selection_t frame);
+static void free_queue(image_t *image);
+
+void set_lazy_mode(bool lazy)
+{
+	atomic_store(&lazy_mode, lazy);
+}
+
+/*
+ * runs a pixel operation right away or, in lazy mode, only records it until
+ * its result is observed
+ */
+int submit_image_op(image_t *image, image_op_t op)
+{
+	if (!image)
+		return -1;
+
+	op.whole_image = whole_matrix_is_selected(image);
+	op.width  = image->width;
+	op.height = image->height;
+
+	if (!atomic_load(&lazy_mode))
+		return execute_image_op(image, op);
+
+	struct lazy_queue *queue = image->pending;
+
+	if (!queue) {
+		queue = calloc(1, sizeof(*queue));
+
+		if (!queue)
+			return -1;
+
+		queue->width  = image->width;
+		queue->height = image->height;
+		image->pending = queue;
+	}
+
+	if (insert_op(queue, queue->count, op) == -1)
+		return -1;
+
+	update_shape(image, op);
+
+	return 0;
+}
+
+// runs every pending operation of the image, after optimizing them
+int flush_image_ops(image_t *image)
+{
+	if (!image || !image->pending)
+		return 0;
+
+	struct lazy_queue *queue = image->pending;
+	selection_t selection = image->selection;
+	int ret = 0;
+
+	image->width  = queue->width;
+	image->height = queue->height;
+
+	fold_rotations(queue);
+
+	// pixels discarded by a crop still raise the max value in APPLY
+	if (image->max_val == pixel_limit(image->max_val) &&
+		push_crops_down(queue) == -1)
+		ret = -1;
+
+	for (size_t i = 0; i < queue->count && !ret; i++) {
+		image->selection = queue->ops[i].selection;
+		ret = execute_image_op(image, queue->ops[i]);
+	}
+
+	image->selection = selection;
+
+	free_queue(image);
+
+	return ret;
+}
+
+/*
+ * drops the pending operations of an image that is about to be reset, their
+ * result could never be observed
+ */
+void discard_image_ops(image_t *image)
+{
+	if (!image || !image->pending)
+		return;
+
+	image->width  = image->pending->width;
+	image->height = image->pending->height;
+
+	free_queue(image);
+}
+
+static int execute_image_op(image_t *image, image_op_t op)
+{
+	static const char *const names[] = {
+		[OP_APPLY]    = "apply",
+		[OP_EQUALIZE] = "equalize",
+		[OP_ROTATE]   = "rotate",
+		[OP_CROP]     = "crop",
+		[OP_ERODE]    = "erode",
+		[OP_DILATE]   = "dilate"
+	};
+
+	trace_span_t span;
+	int ret = -1;
+
+	if (op.type > OP_DILATE)
+		return -1;
+
+	trace_begin(&span, "kernel", names[op.type], -1);
+
+	switch (op.type) {
+	case OP_APPLY:
+		ret = apply_filter(image, op.param);
+		break;
+	case OP_EQUALIZE:
+		ret = equalize_image(image);
+		break;
+	case OP_ROTATE:
+		ret = rotate_image(image, op.param);
+		break;
+	case OP_CROP:
+		ret = crop_image(image);
+		break;
+	case OP_ERODE:
+	case OP_DILATE:
+		ret = morph_bitmap(image, op.type == OP_DILATE);
+		break;
+	}
+
+	trace_end(&span);
+
+	return ret;
+}
+
+// gives the image the size and selection it will have after the operation
+static void update_shape(image_t *image, image_op_t op)
+{
+	size_t width  = image->width;
+	size_t height = image->height;
+
+	switch (op.type) {
+	case OP_ROTATE:
+		// only whole image rotations by an odd multiple of 90 change the size
+		if (!op.whole_image || !(op.param / 90 % 2))
+			return;
+
+		image->width  = height;
+		image->height = width;
+		break;
+	case OP_CROP:
+		image->width  = op.selection.lower_right.x - op.selection.upper_left.x;
+		image->height = op.selection.lower_right.y - op.selection.upper_left.y;
+		break;
+	default:
+		return;
+	}
+
+	image->selection.upper_left.x  = 0;
+	image->selection.upper_left.y  = 0;
+	image->selection.lower_right.x = image->width;
+	image->selection.lower_right.y = image->height;
+}
+
+/*
+ * two rotations in a row of the whole image, or of the same square
+ * selection, become one; a full turn disappears completely
+ */
+static void fold_rotations(struct lazy_queue *queue)
+{
+	size_t count = 0;
+
+	for (size_t i = 0; i < queue->count; i++) {
+		image_op_t *op = &queue->ops[i];
+		image_op_t *last = count ? &queue->ops[count - 1] : NULL;
+
+		if (op->type == OP_ROTATE && !(op->param % MAX_ROTATE_ANGLE))
+			continue;
+
+		if (last && last->type == OP_ROTATE && op->type == OP_ROTATE &&
+			((last->whole_image && op->whole_image) ||
+			 (!last->whole_image && !op->whole_image &&
+			  !memcmp(&last->selection, &op->selection,
+					  sizeof(op->selection))))) {
+			last->param = (last->param + op->param) % MAX_ROTATE_ANGLE;
+
+			if (!last->param)
+				count--;
+
+			continue;
+		}
+
+		queue->ops[count++] = *op;
+	}
+
+	queue->count = count;
+}
+
+/*
+ * APPLY followed by CROP becomes CROP to the crop area plus a one pixel
+ * halo, APPLY, and CROP of the halo, so that the kernel only runs on pixels
+ * that are kept; repeated, the crop moves in front of whole APPLY chains
+ *
+ * pixels discarded by the crop still raise the max value in APPLY, so this
+ * is only exact when the max value can't grow anymore
+ */
+static int push_crops_down(struct lazy_queue *queue)
+{
+	for (size_t i = 1; i < queue->count; i++) {
+		image_op_t *apply = &queue->ops[i - 1];
+		image_op_t *crop = &queue->ops[i];
+
+		if (apply->type != OP_APPLY || crop->type != OP_CROP)
+			continue;
+
+		size_t width = apply->width;
+		size_t height = apply->height;
+
+		selection_t frame = grow_selection(crop->selection, width, height);
+
+		// nothing to gain if the halo covers the whole image
+		if (!frame.upper_left.x && !frame.upper_left.y &&
+			frame.lower_right.x == width && frame.lower_right.y == height)
+			continue;
+
+		image_op_t early_crop = {
+			.type = OP_CROP,
+			.selection = frame,
+			.whole_image = false,
+			.width = width,
+			.height = height
+		};
+
+		apply->selection = relative_selection(apply->selection, frame);
+		apply->width  = frame.lower_right.x - frame.upper_left.x;
+		apply->height = frame.lower_right.y - frame.upper_left.y;
+		apply->whole_image = false;
+
+		crop->selection = relative_selection(crop->selection, frame);
+		crop->width  = apply->width;
+		crop->height = apply->height;
+		crop->whole_image = false;
+
+		if (insert_op(queue, i - 1, early_crop) == -1)
+			return -1;
+
+		// look at the new crop against whatever came before the APPLY
+		i = i > 2 ? i - 2 : 0;
+	}
+
+	return 0;
+}
+
+static int insert_op(struct lazy_queue *queue, size_t idx, image_op_t op)
+{
+	if (queue->count == queue->capacity) {
+		size_t capacity = queue->capacity ? 2 * queue->capacity : 8;
+		void *ret = realloc(queue->ops, capacity * sizeof(*queue->ops));
+
+		if (!ret)
+			return -1;
+
+		queue->ops = ret;
+		queue->capacity = capacity;
+	}
+
+	memmove(queue->ops + idx + 1, queue->ops + idx,
+			(queue->count - idx) * sizeof(*queue->ops));
+
+	queue->ops[idx] = op;
+	queue->count++;
+
+	return 0;
+}
+
+// adds a one pixel border around a selection, within the image
+static selection_t grow_selection(selection_t selection, size_t width,
+								  size_t height)
+{
+	if (selection.upper_left.x)
+		selection.upper_left.x--;
+
+	if (selection.upper_left.y)
+		selection.upper_left.y--;
+
+	selection.lower_right.x = min(selection.lower_right.x + 1, width);
+	selection.lower_right.y = min(selection.lower_right.y + 1, height);
+
+	return selection;
+}
+
+// the part of a selection inside a frame, in the frame's coordinates
+static selection_t relative_selection(selection_t selection, selection_t frame)
+{
+	selection_t res;
+
+	res.upper_left.x = selection.upper_left.x > frame.upper_left.x ?
+					   selection.upper_left.x - frame.upper_left.x : 0;
+	res.upper_left.y = selection.upper_left.y > frame.upper_left.y ?
+					   selection.upper_left.y - frame.upper_left.y : 0;
+	res.lower_right.x = min(selection.lower_right.x, frame.lower_right.x);
+	res.lower_right.y = min(selection.lower_right.y, frame.lower_right.y);
+
+	res.lower_right.x = res.lower_right.x > frame.upper_left.x ?
+						res.lower_right.x - frame.upper_left.x : 0;
+	res.lower_right.y = res.lower_right.y > frame.upper_left.y ?
+						res.lower_right.y - frame.upper_left.y : 0;
+
+	// empty intersection
+	if (res.lower_right.x < res.upper_left.x)
+		res.lower_right.x = res.upper_left.x;
+
+	if (res.lower_right.y < res.upper_left.y)
+		res.lower_right.y = res.upper_left.y;
+
+	return res;
+}
+
+static void free_queue(image_t *image)
+{
+	free(image->pending->ops);
+	free(image->pending);
+
+	image->pending = NULL;
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+#include <stdbool.h>
+
+#include "image.h"
+
+typedef enum {
+	OP_APPLY,
+	OP_EQUALIZE,
+	OP_ROTATE,
+	OP_CROP,
+	OP_ERODE,
+	OP_DILATE
+} IMAGE_OP_TYPE;
+
+// a pixel operation together with the selection it was issued on
+typedef struct {
+	IMAGE_OP_TYPE type;
+	int param;
+	selection_t selection;
+	bool whole_image;
+	// size of the image the operation runs on
+	size_t width;
+	size_t height;
+} image_op_t;
+
+void set_lazy_mode(bool lazy);
+
+int submit_image_op(image_t *image, image_op_t op);
+
+int flush_image_ops(image_t *image);
+
+void discard_image_ops(image_t *image);
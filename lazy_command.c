@@ -0,0 +1,34 @@
+#include <setjmp.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "lazy_command.h"
+#include "lazy.h"
+#include "image.h"
+#include "error.h"
+#include "output.h"
+
+#define LAZY_ARG_COUNT 1
+#define LAZY_SUCCESS_MSG "Lazy mode %s\n"
+
+/*
+ * LAZY ON|OFF
+ * with lazy mode on, APPLY, EQUALIZE, ROTATE, CROP, ERODE and DILATE are
+ * only recorded and run, optimized, once something reads the pixels
+ */
+void lazy_command(image_t *image, char **argv, int argc, jmp_buf ex_buf__)
+{
+	if (!image)
+		longjmp(ex_buf__, E_INVALID_FUNC_ARGS);
+
+	if (argc != LAZY_ARG_COUNT)
+		longjmp(ex_buf__, E_INVALID_COMMAND);
+
+	if (strcmp(argv[0], "ON") && strcmp(argv[0], "OFF"))
+		longjmp(ex_buf__, E_INVALID_COMMAND);
+
+	set_lazy_mode(!strcmp(argv[0], "ON"));
+
+	out_printf(LAZY_SUCCESS_MSG, !strcmp(argv[0], "ON") ? "on" : "off");
+}
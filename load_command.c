@@ -2,25 +2,63 @@
 #include <setjmp.h>
 #include <stdio.h>
 #include <stdbool.h>
+#include <ctype.h>
+#include <limits.h>
+#include <sys/stat.h>
 
 #include "load_command.h"
+#include "async_io.h"
+#include "save_command.h"
+#include "crop_command.h"
+#include "image_cache.h"
 #include "image.h"
 #include "error.h"
 #include "utils.h"
+#include "pnm.h"
+#include "bitmap.h"
+#include "tiled.h"
+#include "output.h"
+#include "pool.h"
+#include "trace.h"
 
 #define LOAD_ARG_COUNT 1
+// LOAD <file> REGION x1 y1 x2 y2
+#define LOAD_REGION_ARG_COUNT 6
 #define LOAD_SUCCESS_MSG "Loaded %s\n"
 
-static int read_image(FILE *fp, image_t *image, char *filename);
+// raster bytes read with a single batch of requests
+#define LOAD_BAND_SIZE (8 * 1024 * 1024)
+#define MAX_ASCII_TOKEN_LENGTH 64
+#define MAX_PAM_KEY_LENGTH 15
+
+// buffered tokenizer for the text raster of P1/P2/P3 images
+typedef struct {
+	int fd;
+	off_t offset;
+	off_t file_size;
+	char *buffer;
+	size_t len;
+	size_t pos;
+} text_reader_t;
+
+static int load_region(FILE *fp, const char *filename, struct stat *st,
+					   image_t *image, selection_t region);
+static bool region_fits(image_t *image, selection_t region);
+static int read_image(FILE *fp, image_t *image);
 static int read_magic_word(FILE *fp, image_t *image);
 static int read_size(FILE *fp, image_t *image);
 static int read_max_val(FILE *fp, image_t *image);
-static int read_ascii_matrix(FILE *fp, image_t *image);
-static int read_grayscale_ascii_pixel(FILE *fp, pixel_t *pixel);
-static int read_color_ascii_pixel(FILE *fp, pixel_t *pixel);
-static int read_binary_matrix(FILE *fp, image_t *image);
-static int read_color_binary_pixel(FILE *fp, pixel_t *pixel);
-static int read_grayscale_binary_pixel(FILE *fp, pixel_t *pixel);
+static int read_pam_header(FILE *fp, image_t *image);
+static int read_pam_field(FILE *fp, long *value, long max);
+static int read_tuple_type(FILE *fp, image_t *image);
+static int check_raster_size(FILE *fp, image_t *image);
+static int read_ascii_matrix(int fd, off_t offset, image_t *image);
+static int read_grayscale_ascii_pixel(text_reader_t *reader, pixel_t *pixel);
+static int read_color_ascii_pixel(text_reader_t *reader, pixel_t *pixel);
+static int read_ascii_sample(text_reader_t *reader, double *sample);
+static int read_ascii_bit(text_reader_t *reader, bool *bit);
+static int fill_text_reader(text_reader_t *reader);
+static int read_binary_matrix(int fd, off_t offset, image_t *image);
 static void ignore_comments(FILE *fp);
 
 void load_command(image_t *image, char **argv, int argc, jmp_buf ex_buf__)
@@ -33,16 +71,73 @@ void load_command(image_t *image, char **argv, int argc, jmp_buf ex_buf__)
 		reset_image(image);
 
 	// check command arguments
-	if (argc != LOAD_ARG_COUNT)
+	if (argc != LOAD_ARG_COUNT && (argc != LOAD_REGION_ARG_COUNT ||
+								   strcmp(argv[1], "REGION")))
 		longjmp(ex_buf__, E_INVALID_COMMAND);
 
-	FILE *fp = fopen(argv[0], "r");
+	// the region is checked like the coordinates of SELECT
+	int coord[4] = {0};
+
+	for (int i = 0; i < 4 && argc == LOAD_REGION_ARG_COUNT; i++) {
+		coord[i] = atoi(argv[i + 2]);
+
+		if (!coord[i] && argv[i + 2][0] != '0')
+			longjmp(ex_buf__, E_INVALID_COMMAND);
+
+		if (coord[i] < 0)
+			longjmp(ex_buf__, E_INVALID_COORD_SET);
+	}
+
+	if (argc == LOAD_REGION_ARG_COUNT &&
+		(coord[0] == coord[2] || coord[1] == coord[3]))
+		longjmp(ex_buf__, E_INVALID_COORD_SET);
+
+	if (coord[0] > coord[2])
+		swap_int(&coord[0], &coord[2]);
+
+	if (coord[1] > coord[3])
+		swap_int(&coord[1], &coord[3]);
+
+	selection_t region = {
+		.upper_left = {coord[0], coord[1]},
+		.lower_right = {coord[2], coord[3]}
+	};
+
+	// the file might still be written by a SAVE ... ASYNC
+	if (wait_pending_save(argv[0]) == -1)
+		longjmp(ex_buf__, E_FUNC_FAILED);
+
+	FILE *fp = fopen(argv[0], "rb");
 
 	if (!fp)
 		longjmp(ex_buf__, E_LOAD_FAILED);
 
-	if (read_image(fp, image, argv[0]) == -1)
-		longjmp(ex_buf__, E_LOAD_FAILED);
+	// an unchanged file that was loaded before is copied from the cache
+	struct stat st;
+	bool has_stat = fstat(fileno(fp), &st) == 0;
+
+	if (argc == LOAD_REGION_ARG_COUNT) {
+		int status = load_region(fp, argv[0], has_stat ? &st : NULL, image,
+								 region);
+
+		if (status) {
+			reset_image(image);
+			fclose(fp);
+
+			longjmp(ex_buf__, status);
+		}
+	} else if (!has_stat || cache_lookup(argv[0], &st, image) == -1) {
+		if (read_image(fp, image) == -1) {
+			// don't keep a half-read matrix around
+			reset_image(image);
+			fclose(fp);
+
+			longjmp(ex_buf__, E_LOAD_FAILED);
+		}
+
+		if (has_stat)
+			cache_store(argv[0], &st, image);
+	}
 
 	image->is_loaded = true;
 
@@ -55,46 +150,125 @@ void load_command(image_t *image, char **argv, int argc, jmp_buf ex_buf__)
 	fclose(fp);
 
 	// print success message
-	printf(LOAD_SUCCESS_MSG, argv[0]);
+	out_printf(LOAD_SUCCESS_MSG, argv[0]);
+}
+
+/*
+ * loads a region of a file: of a tiled file only the tiles it touches are
+ * read, any other file is read whole (or copied from the cache) and cropped;
+ * returns the error the LOAD ends with, 0 for none
+ */
+static int load_region(FILE *fp, const char *filename, struct stat *st,
+					   image_t *image, selection_t region)
+{
+	int fd = fileno(fp);
+
+	if (is_tiled_file(fd)) {
+		if (read_tiled_header(fd, image) == -1)
+			return E_LOAD_FAILED;
+
+		if (!region_fits(image, region))
+			return E_INVALID_COORD_SET;
+
+		return read_tiled_region(fd, image, region) == -1 ? E_LOAD_FAILED : 0;
+	}
+
+	if (!st || cache_lookup(filename, st, image) == -1) {
+		if (read_image(fp, image) == -1)
+			return E_LOAD_FAILED;
+
+		if (st)
+			cache_store(filename, st, image);
+	}
+
+	if (!region_fits(image, region))
+		return E_INVALID_COORD_SET;
+
+	image->selection = region;
+
+	return crop_image(image) == -1 ? E_LOAD_FAILED : 0;
 }
 
-static int read_image(FILE *fp, image_t *image, char *filename)
+static bool region_fits(image_t *image, selection_t region)
+{
+	return region.lower_right.x <= image->width &&
+		   region.lower_right.y <= image->height;
+}
+
+static int read_image(FILE *fp, image_t *image)
 {
 	// check arguments
 	if (!fp || !image)
 		return -1;
 
-	if (read_magic_word(fp, image) == -1)
-		return -1;
+	// a tiled file is read as a single region that covers all of it
+	if (is_tiled_file(fileno(fp))) {
+		if (read_tiled_header(fileno(fp), image) == -1)
+			return -1;
 
-	if (read_size(fp, image) == -1)
-		return -1;
+		selection_t whole_image = {
+			.upper_left = {0, 0},
+			.lower_right = {image->width, image->height}
+		};
+
+		return read_tiled_region(fileno(fp), image, whole_image);
+	}
+
+	trace_span_t span;
 
-	if (read_max_val(fp, image) == -1)
+	trace_begin(&span, "phase", "header parse", -1);
+
+	int ret = read_header(fp, image);
+
+	if (!ret)
+		ignore_comments(fp);
+
+	trace_end(&span);
+
+	if (ret == -1 || create_matrix(image) == -1)
 		return -1;
 
-	ignore_comments(fp);
+	// the raster is read in large blocks, bypassing stdio
+	off_t pos = ftell(fp);
 
-	if (create_matrix(image) == -1)
+	if (pos == -1)
 		return -1;
 
-	// reopen file as binary if necessary
-	if (is_binary(image->magic_word)) {
-		long pos = ftell(fp);
+	trace_begin(&span, "phase", "raster decode", -1);
 
-		fp = freopen(filename, "rb", fp);
+	if (is_binary(image->magic_word))
+		ret = read_binary_matrix(fileno(fp), pos + 1, image);
+	else
+		ret = read_ascii_matrix(fileno(fp), pos, image);
 
-		if (!fp)
-			return -1;
+	trace_end(&span);
+
+	return ret;
+}
+
+// reads the magic word, size and max value of an image
+int read_header(FILE *fp, image_t *image)
+{
+	if (read_magic_word(fp, image) == -1)
+		return -1;
 
-		fseek(fp, pos + 1, SEEK_SET);
+	// PAM headers are a list of named fields instead
+	if (is_pam(image->magic_word)) {
+		if (read_pam_header(fp, image) == -1)
+			return -1;
+	} else {
+		if (read_size(fp, image) == -1)
+			return -1;
 
-		if (read_binary_matrix(fp, image) == -1)
+		// bitmaps have no max value
+		if (is_bitmap(image->magic_word))
+			image->max_val = 1;
+		else if (read_max_val(fp, image) == -1)
 			return -1;
+	}
 
-	} else if (read_ascii_matrix(fp, image) == -1) {
+	if (check_raster_size(fp, image) == -1)
 		return -1;
-	}
 
 	return 0;
 }
@@ -107,10 +281,12 @@ static int read_magic_word(FILE *fp, image_t *image)
 
 	ignore_comments(fp);
 
-	char magic_word_str[MAX_MAGIC_WORD_LENGTH + 1];
+	char magic_word_str[MAX_MAGIC_WORD_LENGTH + 1] = "";
 
 	// reads MAX_MAGIC_WORD_LENGTH characters
-	fscanf(fp, "%" STR_VALUE(MAX_MAGIC_WORD_LENGTH) "s", magic_word_str);
+	if (fscanf(fp, "%" STR_VALUE(MAX_MAGIC_WORD_LENGTH) "s",
+			   magic_word_str) != 1)
+		return -1;
 
 	image->magic_word = str_to_magic_word(magic_word_str);
 
@@ -130,12 +306,12 @@ static int read_size(FILE *fp, image_t *image)
 
 	int buffer;
 
-	if (fscanf(fp, "%d", &buffer) == EOF || buffer <= 0)
+	if (fscanf(fp, "%d", &buffer) != 1 || buffer <= 0)
 		return -1;
 
 	image->width = buffer;
 
-	if (fscanf(fp, "%d", &buffer) == EOF || buffer <= 0)
+	if (fscanf(fp, "%d", &buffer) != 1 || buffer <= 0)
 		return -1;
 
 	image->height = buffer;
@@ -153,8 +329,8 @@ static int read_max_val(FILE *fp, image_t *image)
 
 	int buffer;
 
-	if (fscanf(fp, "%d", &buffer) == EOF || buffer < MIN_PIXEL_VAL ||
-		buffer > MAX_PIXEL_VAL)
+	if (fscanf(fp, "%d", &buffer) != 1 || buffer < MIN_PIXEL_VAL ||
+		buffer > MAX_WIDE_PIXEL_VAL)
 		return -1;
 
 	image->max_val = buffer;
@@ -162,91 +338,331 @@ static int read_max_val(FILE *fp, image_t *image)
 	return 0;
 }
 
-static int read_ascii_matrix(FILE *fp, image_t *image)
+/*
+ * reads the WIDTH, HEIGHT, DEPTH, MAXVAL and TUPLTYPE lines of a P7 header,
+ * in any order, up to ENDHDR; the file is left on the newline after it
+ */
+static int read_pam_header(FILE *fp, image_t *image)
 {
-	// check arguments
 	if (!fp || !image)
 		return -1;
 
-	for (size_t i = 0; i < image->height; i++)
-		for (size_t j = 0; j < image->width; j++)
-			if ((is_color(image->magic_word) &&
-				 read_color_ascii_pixel(fp, &image->matrix[i][j]) == -1) ||
-				(!is_color(image->magic_word) &&
-				 read_grayscale_ascii_pixel(fp, &image->matrix[i][j]) == -1))
-				return -1;
+	char key[MAX_PAM_KEY_LENGTH + 1];
+	long width = 0, height = 0, depth = 0, max_val = 0;
+
+	image->tuple_type[0] = '\0';
+
+	while (1) {
+		if (fscanf(fp, " %" STR_VALUE(MAX_PAM_KEY_LENGTH) "s", key) != 1)
+			return -1;
+
+		int ret = 0;
+
+		if (key[0] == '#')
+			ret = fscanf(fp, "%*[^\n]") == EOF ? -1 : 0;
+		else if (!strcmp(key, "WIDTH"))
+			ret = read_pam_field(fp, &width, INT_MAX);
+		else if (!strcmp(key, "HEIGHT"))
+			ret = read_pam_field(fp, &height, INT_MAX);
+		else if (!strcmp(key, "DEPTH"))
+			ret = read_pam_field(fp, &depth, MAX_PAM_DEPTH);
+		else if (!strcmp(key, "MAXVAL"))
+			ret = read_pam_field(fp, &max_val, MAX_WIDE_PIXEL_VAL);
+		else if (!strcmp(key, "TUPLTYPE"))
+			ret = read_tuple_type(fp, image);
+		else if (!strcmp(key, "ENDHDR"))
+			break;
+		else
+			ret = -1;
+
+		if (ret == -1)
+			return -1;
+	}
+
+	// every field but the tuple type is mandatory
+	if (!width || !height || !depth || !max_val || fgetc(fp) != '\n')
+		return -1;
+
+	ungetc('\n', fp);
+
+	image->width   = width;
+	image->height  = height;
+	image->depth   = depth;
+	image->max_val = max_val;
 
 	return 0;
 }
 
-static int read_grayscale_ascii_pixel(FILE *fp, pixel_t *pixel)
+// a positive number of at most max, given only once
+static int read_pam_field(FILE *fp, long *value, long max)
 {
-	if (!fp || !pixel)
-		return -1;
+	long buffer;
 
-	if (fscanf(fp, "%lf", &pixel->grayscale.value) == EOF)
+	if (*value || fscanf(fp, "%ld", &buffer) != 1 || buffer <= 0 ||
+		buffer > max)
 		return -1;
 
+	*value = buffer;
+
 	return 0;
 }
 
-static int read_color_ascii_pixel(FILE *fp, pixel_t *pixel)
+// the rest of the line; the values of several TUPLTYPE lines are joined
+static int read_tuple_type(FILE *fp, image_t *image)
 {
-	if (!fp || !pixel)
+	char line[MAX_TUPLE_TYPE_LENGTH + 1] = "";
+
+	if (fscanf(fp, "%*[ \t]") == EOF ||
+		fscanf(fp, "%" STR_VALUE(MAX_TUPLE_TYPE_LENGTH) "[^\n]", line) == EOF)
+		return -1;
+
+	// trailing whitespace isn't part of the value
+	size_t len = strlen(line);
+
+	while (len && isspace((unsigned char)line[len - 1]))
+		line[--len] = '\0';
+
+	size_t used = strlen(image->tuple_type);
+
+	if (!len)
+		return 0;
+
+	if (used + !!used + len > MAX_TUPLE_TYPE_LENGTH || fgetc(fp) != '\n')
 		return -1;
 
-	if (fscanf(fp, "%lf%lf%lf", &pixel->color.red, &pixel->color.green,
-			   &pixel->color.blue) == EOF)
+	if (used)
+		image->tuple_type[used++] = ' ';
+
+	memcpy(image->tuple_type + used, line, len + 1);
+
+	return 0;
+}
+
+/*
+ * every sample takes at least a byte of the file, so a header that asks for
+ * more than what is left is rejected before its matrix gets allocated
+ */
+static int check_raster_size(FILE *fp, image_t *image)
+{
+	struct stat st;
+	off_t pos = ftell(fp);
+
+	// pipes and devices can't be measured, their reads fail later instead
+	if (pos == -1 || fstat(fileno(fp), &st) == -1 || !S_ISREG(st.st_mode))
+		return 0;
+
+	size_t bytes = image->width * image->height *
+				   channel_count(image->magic_word);
+
+	if (is_binary(image->magic_word))
+		bytes = image->height * encoded_row_size(image);
+
+	if (pos > st.st_size || bytes > (size_t)(st.st_size - pos))
 		return -1;
 
-	return 1;
+	return 0;
 }
 
-static int read_binary_matrix(FILE *fp, image_t *image)
+static int read_ascii_matrix(int fd, off_t offset, image_t *image)
 {
 	// check arguments
-	if (!fp || !image)
+	if (fd < 0 || !image)
+		return -1;
+
+	struct stat st;
+
+	if (fstat(fd, &st) == -1)
 		return -1;
 
-	for (size_t i = 0; i < image->height; i++)
-		for (size_t j = 0; j < image->width; j++)
+	text_reader_t reader = {
+		.fd = fd,
+		.offset = offset,
+		.file_size = st.st_size,
+		.buffer = pool_alloc(LOAD_BAND_SIZE + 1),
+		.len = 0,
+		.pos = 0
+	};
+
+	if (!reader.buffer)
+		return -1;
+
+	int ret = 0;
+
+	for (size_t i = 0; i < image->height && !ret; i++) {
+		advise_row_access(image, i);
+
+		for (size_t j = 0; j < image->width && !ret &&
+			 is_bitmap(image->magic_word); j++) {
+			bool bit;
+
+			if (read_ascii_bit(&reader, &bit) == -1)
+				ret = -1;
+			else
+				set_bit(bitmap_row(image, i), j, bit);
+		}
+
+		for (size_t j = 0; j < image->width && !ret &&
+			 !is_bitmap(image->magic_word); j++)
 			if ((is_color(image->magic_word) &&
-				 read_color_binary_pixel(fp, &image->matrix[i][j]) == -1) ||
+				 read_color_ascii_pixel(&reader, &image->matrix[i][j]) == -1) ||
 				(!is_color(image->magic_word) &&
-				 read_grayscale_binary_pixel(fp, &image->matrix[i][j]) == -1))
+				 read_grayscale_ascii_pixel(&reader,
+											&image->matrix[i][j]) == -1))
+				ret = -1;
+	}
+
+	pool_free(reader.buffer, LOAD_BAND_SIZE + 1);
+
+	return ret;
+}
+
+static int read_grayscale_ascii_pixel(text_reader_t *reader, pixel_t *pixel)
+{
+	if (!reader || !pixel)
+		return -1;
+
+	return read_ascii_sample(reader, &pixel->grayscale.value);
+}
+
+static int read_color_ascii_pixel(text_reader_t *reader, pixel_t *pixel)
+{
+	if (!reader || !pixel)
+		return -1;
+
+	if (read_ascii_sample(reader, &pixel->color.red) == -1 ||
+		read_ascii_sample(reader, &pixel->color.green) == -1 ||
+		read_ascii_sample(reader, &pixel->color.blue) == -1)
+		return -1;
+
+	return 0;
+}
+
+// parses the next whitespace separated number, like fscanf("%lf")
+static int read_ascii_sample(text_reader_t *reader, double *sample)
+{
+	size_t end;
+
+	while (1) {
+		while (reader->pos < reader->len &&
+			   isspace((unsigned char)reader->buffer[reader->pos]))
+			reader->pos++;
+
+		end = reader->pos;
+
+		while (end < reader->len && !isspace((unsigned char)reader->buffer[end]))
+			end++;
+
+		// the token is complete unless it touches the end of the buffer
+		if (end < reader->len || reader->offset == reader->file_size) {
+			if (end == reader->pos)
 				return -1;
 
+			break;
+		}
+
+		if (fill_text_reader(reader) == -1)
+			return -1;
+	}
+
+	char saved = reader->buffer[end];
+	char *parsed;
+
+	reader->buffer[end] = '\0';
+	*sample = strtod(reader->buffer + reader->pos, &parsed);
+	reader->buffer[end] = saved;
+
+	if (parsed == reader->buffer + reader->pos)
+		return -1;
+
+	reader->pos = parsed - reader->buffer;
+
 	return 0;
 }
 
-static int read_color_binary_pixel(FILE *fp, pixel_t *pixel)
+// the next pixel of a P1 raster, a single digit that needs no whitespace
+static int read_ascii_bit(text_reader_t *reader, bool *bit)
 {
-	if (!fp || !pixel)
+	while (1) {
+		while (reader->pos < reader->len &&
+			   isspace((unsigned char)reader->buffer[reader->pos]))
+			reader->pos++;
+
+		if (reader->pos < reader->len)
+			break;
+
+		if (reader->offset == reader->file_size ||
+			fill_text_reader(reader) == -1)
+			return -1;
+	}
+
+	char digit = reader->buffer[reader->pos++];
+
+	if (digit != '0' && digit != '1')
+		return -1;
+
+	*bit = digit == '1';
+
+	return 0;
+}
+
+// keeps the unparsed tail of the buffer and appends the next block of text
+static int fill_text_reader(text_reader_t *reader)
+{
+	size_t left = reader->len - reader->pos;
+
+	if (left > MAX_ASCII_TOKEN_LENGTH)
 		return -1;
 
-	unsigned char buffer[3];
+	memmove(reader->buffer, reader->buffer + reader->pos, left);
+
+	size_t size = min(LOAD_BAND_SIZE - left,
+					  reader->file_size - reader->offset);
 
-	if (fread(buffer, sizeof(unsigned char), 3, fp) != 3)
+	if (async_read(reader->fd, reader->buffer + left, size,
+				   reader->offset) == -1)
 		return -1;
 
-	pixel->color.red   = buffer[0];
-	pixel->color.green = buffer[1];
-	pixel->color.blue  = buffer[2];
+	reader->offset += size;
+	reader->len = left + size;
+	reader->pos = 0;
 
 	return 0;
 }
 
-static int read_grayscale_binary_pixel(FILE *fp, pixel_t *pixel)
+static int read_binary_matrix(int fd, off_t offset, image_t *image)
 {
-	if (!fp || !pixel)
+	// check arguments
+	if (fd < 0 || !image)
 		return -1;
 
-	unsigned char buffer;
+	size_t row_size = encoded_row_size(image);
+	size_t band_rows = LOAD_BAND_SIZE / row_size;
+
+	if (!band_rows)
+		band_rows = 1;
+
+	unsigned char *buffer = pool_alloc(band_rows * row_size);
 
-	if (fread(&buffer, sizeof(buffer), 1, fp) != 1)
+	if (!buffer)
 		return -1;
 
-	pixel->grayscale.value = buffer;
+	for (size_t i = 0; i < image->height; i += band_rows) {
+		size_t rows = min(band_rows, image->height - i);
+
+		if (async_read(fd, buffer, rows * row_size, offset) == -1) {
+			pool_free(buffer, band_rows * row_size);
+			return -1;
+		}
+
+		offset += rows * row_size;
+
+		for (size_t r = 0; r < rows; r++) {
+			advise_row_access(image, i + r);
+			decode_image_row(buffer + r * row_size, image, i + r);
+		}
+	}
+
+	pool_free(buffer, band_rows * row_size);
 
 	return 0;
 }
@@ -259,13 +675,15 @@ static void ignore_comments(FILE *fp)
 
 	char *buffer = NULL;
 	size_t bufsize = 0;
+	int c;
 
 	// read all lines starting with #
-	while (fgetc(fp) == '#')
+	while ((c = fgetc(fp)) == '#')
 		getline(&buffer, &bufsize, fp);
 
-	// "undo" last fgetc()
-	fseek(fp, -1, SEEK_CUR);
+	// "undo" last fgetc(), without seeking so that pipes work too
+	if (c != EOF)
+		ungetc(c, fp);
 
 	free(buffer);
 }
@@ -1,7 +1,10 @@
 #pragma once
 
 #include <setjmp.h>
+#include <stdio.h>
 
 #include "image.h"
 
 void load_command(image_t *image, char **argv, int argc, jmp_buf ex_buf__);
+
+int read_header(FILE *fp, image_t *image);
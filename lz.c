@@ -0,0 +1,215 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "lz.h"
+
+/*
+ * byte oriented LZ77 in the spirit of LZ4: the data is a list of sequences,
+ * each a token byte, literals copied as they are and a match that repeats
+ * bytes written before. The high nibble of the token counts the literals and
+ * the low one the match bytes past LZ_MIN_MATCH; 15 means that more bytes
+ * follow, added up until one isn't 255. The match is a 2 byte little-endian
+ * offset back from the end of the output, and the last sequence has none
+ */
+
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 65535
+#define LZ_HASH_BITS 12
+#define LZ_NIBBLE_MAX 15
+// incompressible data is skipped faster the longer no match was found
+#define LZ_SKIP_SHIFT 6
+
+static int emit_sequence(unsigned char *dest, size_t capacity, size_t *len,
+						 const unsigned char *literals, size_t literal_count,
+						 size_t offset, size_t match);
+static void put_length(unsigned char *dest, size_t *len, size_t length);
+static int get_length(const unsigned char *src, size_t size, size_t *pos,
+					  size_t *length);
+static uint32_t read_word(const unsigned char *p);
+static size_t hash_word(uint32_t word);
+
+/*
+ * compresses size bytes into at most capacity bytes, finding matches with a
+ * single entry hash table of the last position of every 4 byte prefix;
+ * returns the compressed size, or 0 if it doesn't fit
+ */
+size_t lz_compress(const unsigned char *src, size_t size, unsigned char *dest,
+				   size_t capacity)
+{
+	// positions plus one, 0 for none
+	size_t table[1 << LZ_HASH_BITS];
+	size_t anchor = 0, pos = 0, len = 0;
+
+	memset(table, 0, sizeof(table));
+
+	while (pos + LZ_MIN_MATCH <= size) {
+		uint32_t word = read_word(src + pos);
+		size_t h = hash_word(word);
+		size_t candidate = table[h];
+
+		table[h] = pos + 1;
+
+		if (!candidate || pos - (candidate - 1) > LZ_MAX_OFFSET ||
+			read_word(src + candidate - 1) != word) {
+			pos += 1 + ((pos - anchor) >> LZ_SKIP_SHIFT);
+			continue;
+		}
+
+		candidate--;
+
+		size_t match = LZ_MIN_MATCH;
+
+		while (pos + match < size && src[candidate + match] == src[pos + match])
+			match++;
+
+		if (emit_sequence(dest, capacity, &len, src + anchor, pos - anchor,
+						  pos - candidate, match) == -1)
+			return 0;
+
+		pos += match;
+		anchor = pos;
+	}
+
+	// whatever is left goes out as literals
+	if (emit_sequence(dest, capacity, &len, src + anchor, size - anchor,
+					  0, 0) == -1)
+		return 0;
+
+	return len;
+}
+
+/*
+ * decompresses into exactly dest_size bytes; anything that would read or
+ * write out of bounds, or doesn't fill the output, is rejected
+ */
+int lz_decompress(const unsigned char *src, size_t size, unsigned char *dest,
+				  size_t dest_size)
+{
+	size_t in = 0, out = 0;
+
+	while (in < size) {
+		unsigned char token = src[in++];
+		size_t literals = token >> 4;
+
+		if (get_length(src, size, &in, &literals) == -1 ||
+			literals > size - in || literals > dest_size - out)
+			return -1;
+
+		memcpy(dest + out, src + in, literals);
+		in += literals;
+		out += literals;
+
+		// the last sequence has no match
+		if (in == size)
+			break;
+
+		if (size - in < 2)
+			return -1;
+
+		size_t offset = src[in] | (size_t)src[in + 1] << 8;
+		size_t match = token & LZ_NIBBLE_MAX;
+
+		in += 2;
+
+		if (get_length(src, size, &in, &match) == -1)
+			return -1;
+
+		match += LZ_MIN_MATCH;
+
+		if (!offset || offset > out || match > dest_size - out)
+			return -1;
+
+		// an overlapping match repeats the bytes it just wrote
+		if (offset >= match) {
+			memcpy(dest + out, dest + out - offset, match);
+		} else {
+			for (size_t k = 0; k < match; k++)
+				dest[out + k] = dest[out - offset + k];
+		}
+
+		out += match;
+	}
+
+	return out == dest_size ? 0 : -1;
+}
+
+// appends a sequence, a match of 0 bytes ends the data
+static int emit_sequence(unsigned char *dest, size_t capacity, size_t *len,
+						 const unsigned char *literals, size_t literal_count,
+						 size_t offset, size_t match)
+{
+	size_t worst = 1 + literal_count / 255 + 1 + literal_count +
+				   (match ? 2 + match / 255 + 1 : 0);
+
+	if (*len + worst > capacity)
+		return -1;
+
+	size_t literal_nibble = literal_count < LZ_NIBBLE_MAX ?
+							literal_count : LZ_NIBBLE_MAX;
+	size_t match_nibble = 0;
+
+	if (match)
+		match_nibble = match - LZ_MIN_MATCH < LZ_NIBBLE_MAX ?
+					   match - LZ_MIN_MATCH : LZ_NIBBLE_MAX;
+
+	dest[(*len)++] = literal_nibble << 4 | match_nibble;
+	put_length(dest, len, literal_count);
+
+	memcpy(dest + *len, literals, literal_count);
+	*len += literal_count;
+
+	if (!match)
+		return 0;
+
+	dest[(*len)++] = offset & 0xff;
+	dest[(*len)++] = offset >> 8;
+	put_length(dest, len, match - LZ_MIN_MATCH);
+
+	return 0;
+}
+
+// the bytes of a length that doesn't fit in its nibble
+static void put_length(unsigned char *dest, size_t *len, size_t length)
+{
+	if (length < LZ_NIBBLE_MAX)
+		return;
+
+	for (length -= LZ_NIBBLE_MAX; length >= 255; length -= 255)
+		dest[(*len)++] = 255;
+
+	dest[(*len)++] = length;
+}
+
+static int get_length(const unsigned char *src, size_t size, size_t *pos,
+					  size_t *length)
+{
+	if (*length != LZ_NIBBLE_MAX)
+		return 0;
+
+	unsigned char byte;
+
+	do {
+		if (*pos == size)
+			return -1;
+
+		byte = src[(*pos)++];
+		*length += byte;
+	} while (byte == 255);
+
+	return 0;
+}
+
+static uint32_t read_word(const unsigned char *p)
+{
+	uint32_t word;
+
+	memcpy(&word, p, sizeof(word));
+
+	return word;
+}
+
+// Fibonacci hashing of the 4 bytes, the top bits are the best mixed
+static size_t hash_word(uint32_t word)
+{
+	return (word * 2654435761U) >> (32 - LZ_HASH_BITS);
+}
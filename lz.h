@@ -0,0 +1,12 @@
+#pragma once
+
+#include <stddef.h>
+
+// most bytes a single byte of compressed data can stand for
+#define LZ_MAX_RATIO 255
+
+size_t lz_compress(const unsigned char *src, size_t size, unsigned char *dest,
+				   size_t capacity);
+
+int lz_decompress(const unsigned char *src, size_t size, unsigned char *dest,
+				  size_t dest_size);
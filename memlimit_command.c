@@ -0,0 +1,37 @@
+#include <setjmp.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+#include "memlimit_command.h"
+#include "image.h"
+#include "error.h"
+#include "output.h"
+
+#define MEMLIMIT_ARG_COUNT 1
+#define MEMLIMIT_SUCCESS_MSG "Memory limit set to %d MB\n"
+
+#define BYTES_PER_MB (1024 * 1024)
+
+/*
+ * MEMLIMIT <MB>
+ * caps the memory used by pixel matrices; matrices allocated past the limit
+ * are backed by a scratch file, 0 removes the limit
+ */
+void memlimit_command(image_t *image, char **argv, int argc, jmp_buf ex_buf__)
+{
+	if (!image)
+		longjmp(ex_buf__, E_INVALID_FUNC_ARGS);
+
+	if (argc != MEMLIMIT_ARG_COUNT)
+		longjmp(ex_buf__, E_INVALID_COMMAND);
+
+	int limit = atoi(argv[0]);
+
+	// check if argument is a number
+	if ((!limit && argv[0][0] != '0') || limit < 0)
+		longjmp(ex_buf__, E_INVALID_COMMAND);
+
+	set_memory_limit((size_t)limit * BYTES_PER_MB);
+
+	out_printf(MEMLIMIT_SUCCESS_MSG, limit);
+}
@@ -0,0 +1,7 @@
+#pragma once
+
+#include <setjmp.h>
+
+#include "image.h"
+
+void memlimit_command(image_t *image, char **argv, int argc, jmp_buf ex_buf__);
@@ -0,0 +1,94 @@
+#include <stdbool.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/resource.h>
+
+#include "metrics.h"
+#include "command.h"
+#include "pool.h"
+
+// totals per command type, commands queued with ON finish concurrently
+static struct {
+	pthread_mutex_t lock;
+	command_metrics_t commands[INVALID_COMMAND_TYPE];
+} totals = {
+	.lock = PTHREAD_MUTEX_INITIALIZER
+};
+
+static double elapsed(const struct timespec *start, const struct timespec *end);
+static size_t pool_allocs(void);
+
+void start_metrics(metrics_mark_t *mark)
+{
+	clock_gettime(CLOCK_MONOTONIC, &mark->wall);
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &mark->cpu);
+	mark->allocs = pool_allocs();
+}
+
+/*
+ * adds a finished command to the totals of its type; CPU time and allocations
+ * are the whole process', so that the worker threads of a command count too
+ */
+void record_metrics(COMMAND_TYPE type, const metrics_mark_t *mark,
+					size_t bytes, bool failed)
+{
+	if (type >= INVALID_COMMAND_TYPE)
+		return;
+
+	struct timespec wall, cpu;
+
+	clock_gettime(CLOCK_MONOTONIC, &wall);
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu);
+	size_t allocs = pool_allocs();
+	long rss = peak_rss();
+
+	pthread_mutex_lock(&totals.lock);
+
+	command_metrics_t *command = &totals.commands[type];
+
+	command->count++;
+	command->failed += failed;
+	command->wall_time += elapsed(&mark->wall, &wall);
+	command->cpu_time += elapsed(&mark->cpu, &cpu);
+	command->bytes += bytes;
+	command->allocs += allocs - mark->allocs;
+
+	if (rss > command->max_rss)
+		command->max_rss = rss;
+
+	pthread_mutex_unlock(&totals.lock);
+}
+
+void get_command_metrics(COMMAND_TYPE type, command_metrics_t *metrics)
+{
+	pthread_mutex_lock(&totals.lock);
+	*metrics = totals.commands[type];
+	pthread_mutex_unlock(&totals.lock);
+}
+
+// the peak resident set size of the process so far, in KB
+long peak_rss(void)
+{
+	struct rusage usage;
+
+	if (getrusage(RUSAGE_SELF, &usage) == -1)
+		return 0;
+
+	return usage.ru_maxrss;
+}
+
+static double elapsed(const struct timespec *start, const struct timespec *end)
+{
+	return (double)(end->tv_sec - start->tv_sec) +
+		   (double)(end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+// rows and buffers handed out so far, whether reused or new
+static size_t pool_allocs(void)
+{
+	pool_stats_t pool;
+
+	get_pool_stats(&pool);
+
+	return pool.hits + pool.misses;
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <time.h>
+
+#include "command.h"
+
+typedef struct {
+	size_t count;
+	size_t failed;
+	double wall_time;
+	double cpu_time;
+	size_t bytes;
+	size_t allocs;
+	long max_rss;
+} command_metrics_t;
+
+// the counters when a command started
+typedef struct {
+	struct timespec wall;
+	struct timespec cpu;
+	size_t allocs;
+} metrics_mark_t;
+
+void start_metrics(metrics_mark_t *mark);
+
+void record_metrics(COMMAND_TYPE type, const metrics_mark_t *mark,
+					size_t bytes, bool failed);
+
+void get_command_metrics(COMMAND_TYPE type, command_metrics_t *metrics);
+
+long peak_rss(void);
@@ -0,0 +1,59 @@
+#include <setjmp.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "on_command.h"
+#include "command.h"
+#include "workspace.h"
+#include "image.h"
+#include "error.h"
+
+#define ON_MIN_ARG_COUNT 2
+
+static bool runs_on_image(COMMAND_TYPE type, int argc);
+
+/*
+ * ON <name> <command> [args...]
+ * queues a command for the named image; queued commands run, concurrently
+ * across images, before the next command that isn't an ON (or at SYNC)
+ */
+void on_command(image_t *image, char **argv, int argc, jmp_buf ex_buf__)
+{
+	if (!image)
+		longjmp(ex_buf__, E_INVALID_FUNC_ARGS);
+
+	if (argc < ON_MIN_ARG_COUNT)
+		longjmp(ex_buf__, E_INVALID_COMMAND);
+
+	COMMAND_TYPE type = str_to_command_type(argv[1]);
+
+	if (!runs_on_image(type, argc - 2))
+		longjmp(ex_buf__, E_INVALID_COMMAND);
+
+	if (queue_image_command(argv[0], type, argv + 2, argc - 2) == -1)
+		longjmp(ex_buf__, E_FUNC_FAILED);
+}
+
+// commands that only touch their own image can run next to each other
+static bool runs_on_image(COMMAND_TYPE type, int argc)
+{
+	switch (type) {
+	case LOAD:
+		// LOAD ... AS would switch images
+		return argc == 1;
+	case SELECT:
+	case HISTOGRAM:
+	case EQUALIZE:
+	case ROTATE:
+	case CROP:
+	case APPLY:
+	case ERODE:
+	case DILATE:
+	case SAVE:
+	case TILE:
+		return true;
+	default:
+		return false;
+	}
+}
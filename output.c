@@ -0,0 +1,30 @@
+#include <stdio.h>
+#include <stdarg.h>
+
+#include "output.h"
+
+// where the messages of the commands run by this thread go (NULL is stdout)
+static _Thread_local FILE *output;
+
+FILE *output_stream(void)
+{
+	return output ? output : stdout;
+}
+
+// redirects the messages of this thread, NULL restores stdout
+void set_output_stream(FILE *stream)
+{
+	output = stream;
+}
+
+// printf() to the output stream of the calling thread
+int out_printf(const char *format, ...)
+{
+	va_list args;
+
+	va_start(args, format);
+	int ret = vfprintf(output_stream(), format, args);
+	va_end(args);
+
+	return ret;
+}
@@ -0,0 +1,9 @@
+#pragma once
+
+#include <stdio.h>
+
+FILE *output_stream(void);
+
+void set_output_stream(FILE *stream);
+
+int out_printf(const char *format, ...);
@@ -0,0 +1,332 @@
+#include <math.h>
+#include <string.h>
+
+#include "pnm.h"
+#include "image.h"
+#include "bitmap.h"
+
+// "65535 " is the longest ascii sample
+#define MAX_ASCII_SAMPLE_SIZE 6
+
+static void decode_wide_binary_row(const unsigned char *buffer, pixel_t *row,
+								   size_t width, MAGIC_WORD magic_word);
+static void encode_wide_binary_row(const pixel_t *row, unsigned char *buffer,
+								   size_t width, MAGIC_WORD magic_word);
+static void encode_wide_sample(double value, unsigned char *buffer);
+static void decode_bitmap_row(const unsigned char *buffer, uint64_t *row,
+							  size_t width);
+static void encode_bitmap_row(const uint64_t *row, unsigned char *buffer,
+							  size_t width);
+static size_t encode_ascii_sample(unsigned int sample, char *buffer);
+
+// returns the number of samples stored for every pixel
+size_t channel_count(MAGIC_WORD magic_word)
+{
+	return is_color(magic_word) ? 3 : 1;
+}
+
+// samples of images with a max value over 255 take two bytes, big-endian
+size_t sample_size(unsigned int max_val)
+{
+	return max_val > MAX_PIXEL_VAL ? 2 : 1;
+}
+
+// bytes of a row of P4/P5/P6 samples, P4 rows hold 8 pixels in every byte
+size_t binary_row_size(size_t width, MAGIC_WORD magic_word,
+					   unsigned int max_val)
+{
+	if (is_bitmap(magic_word))
+		return (width + 7) / 8;
+
+	return width * channel_count(magic_word) * sample_size(max_val);
+}
+
+// converts a row of raw P5/P6 samples into pixels
+void decode_binary_row(const unsigned char *buffer, pixel_t *row, size_t width,
+					   MAGIC_WORD magic_word, unsigned int max_val)
+{
+	if (is_bitmap(magic_word)) {
+		decode_bitmap_row(buffer, (uint64_t *)row, width);
+		return;
+	}
+
+	if (sample_size(max_val) == 2) {
+		decode_wide_binary_row(buffer, row, width, magic_word);
+		return;
+	}
+
+	if (is_color(magic_word)) {
+		for (size_t j = 0; j < width; j++) {
+			row[j].color.red   = buffer[3 * j];
+			row[j].color.green = buffer[3 * j + 1];
+			row[j].color.blue  = buffer[3 * j + 2];
+		}
+	} else {
+		for (size_t j = 0; j < width; j++)
+			row[j].grayscale.value = buffer[j];
+	}
+}
+
+// converts a row of pixels into raw P5/P6 samples
+void encode_binary_row(const pixel_t *row, unsigned char *buffer, size_t width,
+					   MAGIC_WORD magic_word, unsigned int max_val)
+{
+	if (is_bitmap(magic_word)) {
+		encode_bitmap_row((const uint64_t *)row, buffer, width);
+		return;
+	}
+
+	if (sample_size(max_val) == 2) {
+		encode_wide_binary_row(row, buffer, width, magic_word);
+		return;
+	}
+
+	if (is_color(magic_word)) {
+		for (size_t j = 0; j < width; j++) {
+			buffer[3 * j]     = (unsigned char)round(row[j].color.red);
+			buffer[3 * j + 1] = (unsigned char)round(row[j].color.green);
+			buffer[3 * j + 2] = (unsigned char)round(row[j].color.blue);
+		}
+	} else {
+		for (size_t j = 0; j < width; j++)
+			buffer[j] = (unsigned char)round(row[j].grayscale.value);
+	}
+}
+
+// 16-bit samples, most significant byte first
+static void decode_wide_binary_row(const unsigned char *buffer, pixel_t *row,
+								   size_t width, MAGIC_WORD magic_word)
+{
+	if (is_color(magic_word)) {
+		for (size_t j = 0; j < width; j++, buffer += 6) {
+			row[j].color.red   = buffer[0] << 8 | buffer[1];
+			row[j].color.green = buffer[2] << 8 | buffer[3];
+			row[j].color.blue  = buffer[4] << 8 | buffer[5];
+		}
+	} else {
+		for (size_t j = 0; j < width; j++, buffer += 2)
+			row[j].grayscale.value = buffer[0] << 8 | buffer[1];
+	}
+}
+
+static void encode_wide_binary_row(const pixel_t *row, unsigned char *buffer,
+								   size_t width, MAGIC_WORD magic_word)
+{
+	if (is_color(magic_word)) {
+		for (size_t j = 0; j < width; j++, buffer += 6) {
+			encode_wide_sample(row[j].color.red, buffer);
+			encode_wide_sample(row[j].color.green, buffer + 2);
+			encode_wide_sample(row[j].color.blue, buffer + 4);
+		}
+	} else {
+		for (size_t j = 0; j < width; j++, buffer += 2)
+			encode_wide_sample(row[j].grayscale.value, buffer);
+	}
+}
+
+static void encode_wide_sample(double value, unsigned char *buffer)
+{
+	unsigned short sample = (unsigned short)round(value);
+
+	buffer[0] = sample >> 8;
+	buffer[1] = sample & 0xff;
+}
+
+// P4 bytes are packed into words, the first pixel in the highest bit of both
+static void decode_bitmap_row(const unsigned char *buffer, uint64_t *row,
+							  size_t width)
+{
+	size_t bytes = (width + 7) / 8;
+
+	for (size_t k = 0; k < bitmap_words(width); k++) {
+		uint64_t word = 0;
+
+		for (size_t b = 0; b < sizeof(word); b++) {
+			size_t idx = k * sizeof(word) + b;
+
+			word = word << 8 | (idx < bytes ? buffer[idx] : 0);
+		}
+
+		row[k] = word;
+	}
+
+	// the padding bits of the last byte can be anything
+	row[bitmap_words(width) - 1] &= last_word_mask(width);
+}
+
+static void encode_bitmap_row(const uint64_t *row, unsigned char *buffer,
+							  size_t width)
+{
+	size_t bytes = (width + 7) / 8;
+
+	for (size_t idx = 0; idx < bytes; idx++)
+		buffer[idx] = row[idx / sizeof(*row)] >>
+					  (8 * (sizeof(*row) - 1 - idx % sizeof(*row)));
+}
+
+// bytes of a row of the binary raster of an image, as stored in the file
+size_t encoded_row_size(const image_t *image)
+{
+	if (is_pam(image->magic_word))
+		return pam_row_size(image->width, image->depth, image->max_val);
+
+	return binary_row_size(image->width, image->magic_word, image->max_val);
+}
+
+// converts a row of the binary raster of an image into a row of its matrix
+void decode_image_row(const unsigned char *buffer, image_t *image, size_t row)
+{
+	if (is_pam(image->magic_word))
+		decode_pam_row(buffer, pam_plane(image, row, 0), image->width,
+					   image->depth, image->max_val);
+	else
+		decode_binary_row(buffer, image->matrix[row], image->width,
+						  image->magic_word, image->max_val);
+}
+
+// converts a row of the matrix of an image into its binary raster
+void encode_image_row(image_t *image, size_t row, unsigned char *buffer)
+{
+	if (is_pam(image->magic_word))
+		encode_pam_row(pam_plane(image, row, 0), image->width, buffer,
+					   image->width, image->depth, image->max_val);
+	else
+		encode_binary_row(image->matrix[row], buffer, image->width,
+						  image->magic_word, image->max_val);
+}
+
+// bytes of a row of P7 samples, the channels of every pixel one after another
+size_t pam_row_size(size_t width, size_t depth, unsigned int max_val)
+{
+	return width * depth * sample_size(max_val);
+}
+
+// splits a row of interleaved P7 samples into the planes of a row
+void decode_pam_row(const unsigned char *buffer, double *row, size_t width,
+					size_t depth, unsigned int max_val)
+{
+	size_t size = sample_size(max_val);
+
+	for (size_t c = 0; c < depth; c++) {
+		const unsigned char *sample = buffer + c * size;
+		double *plane = row + c * width;
+
+		for (size_t j = 0; j < width; j++, sample += depth * size)
+			plane[j] = size == 2 ? sample[0] << 8 | sample[1] : sample[0];
+	}
+}
+
+/*
+ * interleaves the planes of a row back into P7 samples; plane c starts at
+ * row + c * stride, so that a part of a wider row can be written
+ */
+void encode_pam_row(const double *row, size_t stride, unsigned char *buffer,
+					size_t width, size_t depth, unsigned int max_val)
+{
+	size_t size = sample_size(max_val);
+
+	for (size_t c = 0; c < depth; c++) {
+		unsigned char *sample = buffer + c * size;
+		const double *plane = row + c * stride;
+
+		for (size_t j = 0; j < width; j++, sample += depth * size) {
+			if (size == 2)
+				encode_wide_sample(plane[j], sample);
+			else
+				sample[0] = (unsigned char)round(plane[j]);
+		}
+	}
+}
+
+// channels of a PAM image that hold color, the alpha channel comes last
+size_t pam_color_planes(const image_t *image)
+{
+	size_t len = strlen(image->tuple_type);
+	size_t suffix = strlen("_ALPHA");
+
+	if (len > suffix && !strcmp(image->tuple_type + len - suffix, "_ALPHA") &&
+		image->depth > 1)
+		return image->depth - 1;
+
+	return image->depth;
+}
+
+// whether the tuple type says the color channel is a gray level
+bool pam_is_grayscale(const image_t *image)
+{
+	return !strncmp(image->tuple_type, "GRAYSCALE", strlen("GRAYSCALE")) ||
+		   !strncmp(image->tuple_type, "BLACKANDWHITE",
+					strlen("BLACKANDWHITE"));
+}
+
+// upper bound of the bytes encode_ascii_row() writes
+size_t max_ascii_row_size(size_t width, MAGIC_WORD magic_word)
+{
+	return width * channel_count(magic_word) * MAX_ASCII_SAMPLE_SIZE + 1;
+}
+
+/*
+ * converts a row of pixels into P1/P2/P3 text, every sample followed by a space
+ * and the row by a newline; returns the number of bytes written
+ */
+size_t encode_ascii_row(const pixel_t *row, char *buffer, size_t width,
+						MAGIC_WORD magic_word, unsigned int max_val)
+{
+	size_t len = 0;
+
+	// P1 pixels are single digits
+	for (size_t j = 0; j < width && is_bitmap(magic_word); j++) {
+		buffer[len++] = '0' + get_bit((const uint64_t *)row, j);
+		buffer[len++] = ' ';
+	}
+
+	for (size_t j = 0; j < width && !is_bitmap(magic_word); j++) {
+		if (is_color(magic_word)) {
+			len += encode_ascii_sample(to_sample(row[j].color.red, max_val),
+									   buffer + len);
+			len += encode_ascii_sample(to_sample(row[j].color.green, max_val),
+									   buffer + len);
+			len += encode_ascii_sample(to_sample(row[j].color.blue, max_val),
+									   buffer + len);
+		} else {
+			len += encode_ascii_sample(to_sample(row[j].grayscale.value,
+												 max_val), buffer + len);
+		}
+	}
+
+	buffer[len++] = '\n';
+
+	return len;
+}
+
+// rounds a value to a sample of the width the max value asks for
+unsigned int to_sample(double value, unsigned int max_val)
+{
+	if (sample_size(max_val) == 2)
+		return (unsigned short)round(value);
+
+	return (unsigned char)round(value);
+}
+
+// same output as printf("%u ", sample)
+static size_t encode_ascii_sample(unsigned int sample, char *buffer)
+{
+	size_t len = 0;
+
+	if (sample >= 10000)
+		buffer[len++] = '0' + sample / 10000;
+
+	if (sample >= 1000)
+		buffer[len++] = '0' + sample / 1000 % 10;
+
+	if (sample >= 100)
+		buffer[len++] = '0' + sample / 100 % 10;
+
+	if (sample >= 10)
+		buffer[len++] = '0' + sample / 10 % 10;
+
+	buffer[len++] = '0' + sample % 10;
+	buffer[len++] = ' ';
+
+	return len;
+}
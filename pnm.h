@@ -0,0 +1,44 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "image.h"
+
+size_t channel_count(MAGIC_WORD magic_word);
+
+size_t sample_size(unsigned int max_val);
+
+unsigned int to_sample(double value, unsigned int max_val);
+
+size_t binary_row_size(size_t width, MAGIC_WORD magic_word,
+					   unsigned int max_val);
+
+void decode_binary_row(const unsigned char *buffer, pixel_t *row, size_t width,
+					   MAGIC_WORD magic_word, unsigned int max_val);
+
+void encode_binary_row(const pixel_t *row, unsigned char *buffer, size_t width,
+					   MAGIC_WORD magic_word, unsigned int max_val);
+
+size_t encoded_row_size(const image_t *image);
+
+void decode_image_row(const unsigned char *buffer, image_t *image, size_t row);
+
+void encode_image_row(image_t *image, size_t row, unsigned char *buffer);
+
+size_t pam_row_size(size_t width, size_t depth, unsigned int max_val);
+
+void decode_pam_row(const unsigned char *buffer, double *row, size_t width,
+					size_t depth, unsigned int max_val);
+
+void encode_pam_row(const double *row, size_t stride, unsigned char *buffer,
+					size_t width, size_t depth, unsigned int max_val);
+
+size_t pam_color_planes(const image_t *image);
+
+bool pam_is_grayscale(const image_t *image);
+
+size_t max_ascii_row_size(size_t width, MAGIC_WORD magic_word);
+
+size_t encode_ascii_row(const pixel_t *row, char *buffer, size_t width,
+						MAGIC_WORD magic_word, unsigned int max_val);
@@ -0,0 +1,205 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "pool.h"
+
+// number of different block sizes kept at once
+#define POOL_CLASS_COUNT 64
+// blocks this large are mapped on their own and may use huge pages
+#define POOL_MAP_THRESHOLD (2 * 1024 * 1024)
+#define DEFAULT_POOL_LIMIT (64 * 1024 * 1024)
+
+/*
+ * free blocks of one size, linked through their first bytes; images come in
+ * a few shapes, so rows and band buffers keep coming back in the same sizes
+ */
+typedef struct {
+	size_t size;
+	void *free_list;
+	size_t count;
+} pool_class_t;
+
+static struct {
+	pthread_mutex_t lock;
+	pool_class_t classes[POOL_CLASS_COUNT];
+	pool_stats_t stats;
+} pool = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.stats = {
+		.limit = DEFAULT_POOL_LIMIT
+	}
+};
+
+static pool_class_t *find_class(size_t size, bool create);
+static void *os_alloc(size_t size, bool hugepages);
+static void os_free(void *block, size_t size);
+static void trim_pool(size_t limit);
+
+/*
+ * sets how many bytes of free blocks are kept for reuse (0 disables the pool)
+ * and whether mapped blocks ask for transparent huge pages
+ */
+void set_pool_limit(size_t limit, bool hugepages)
+{
+	pthread_mutex_lock(&pool.lock);
+
+	pool.stats.limit = limit;
+	pool.stats.hugepages = hugepages;
+	trim_pool(limit);
+
+	pthread_mutex_unlock(&pool.lock);
+}
+
+// a block of at least the given size, with undefined contents
+void *pool_alloc(size_t size)
+{
+	if (size < sizeof(void *))
+		size = sizeof(void *);
+
+	pthread_mutex_lock(&pool.lock);
+
+	pool_class_t *class = find_class(size, false);
+	bool hugepages = pool.stats.hugepages;
+
+	if (class && class->free_list) {
+		void *block = class->free_list;
+
+		class->free_list = *(void **)block;
+		class->count--;
+
+		pool.stats.hits++;
+		pool.stats.cached_blocks--;
+		pool.stats.cached_bytes -= size;
+
+		pthread_mutex_unlock(&pool.lock);
+
+		return block;
+	}
+
+	pool.stats.misses++;
+
+	pthread_mutex_unlock(&pool.lock);
+
+	return os_alloc(size, hugepages);
+}
+
+// pool_alloc(), zeroed
+void *pool_calloc(size_t size)
+{
+	void *block = pool_alloc(size);
+
+	if (block)
+		memset(block, 0, size);
+
+	return block;
+}
+
+// gives a block back, size has to be the one it was allocated with
+void pool_free(void *block, size_t size)
+{
+	if (!block)
+		return;
+
+	if (size < sizeof(void *))
+		size = sizeof(void *);
+
+	pthread_mutex_lock(&pool.lock);
+
+	pool_class_t *class = NULL;
+
+	if (pool.stats.cached_bytes + size <= pool.stats.limit)
+		class = find_class(size, true);
+
+	if (!class) {
+		pthread_mutex_unlock(&pool.lock);
+		os_free(block, size);
+		return;
+	}
+
+	*(void **)block = class->free_list;
+	class->free_list = block;
+	class->count++;
+
+	pool.stats.cached_blocks++;
+	pool.stats.cached_bytes += size;
+
+	pthread_mutex_unlock(&pool.lock);
+}
+
+void get_pool_stats(pool_stats_t *stats)
+{
+	pthread_mutex_lock(&pool.lock);
+	*stats = pool.stats;
+	pthread_mutex_unlock(&pool.lock);
+}
+
+// the class of a size; a class without free blocks can change its size
+static pool_class_t *find_class(size_t size, bool create)
+{
+	pool_class_t *unused = NULL;
+
+	for (size_t i = 0; i < POOL_CLASS_COUNT; i++) {
+		if (pool.classes[i].size == size)
+			return &pool.classes[i];
+
+		if (!pool.classes[i].count && !unused)
+			unused = &pool.classes[i];
+	}
+
+	if (!create || !unused)
+		return NULL;
+
+	unused->size = size;
+
+	return unused;
+}
+
+static void *os_alloc(size_t size, bool hugepages)
+{
+	if (size < POOL_MAP_THRESHOLD)
+		return malloc(size);
+
+	void *block = mmap(NULL, size, PROT_READ | PROT_WRITE,
+					   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+	if (block == MAP_FAILED)
+		return NULL;
+
+#ifdef MADV_HUGEPAGE
+	if (hugepages)
+		madvise(block, size, MADV_HUGEPAGE);
+#endif
+
+	return block;
+}
+
+static void os_free(void *block, size_t size)
+{
+	if (size < POOL_MAP_THRESHOLD)
+		free(block);
+	else
+		munmap(block, size);
+}
+
+// frees cached blocks until the pool fits the limit
+static void trim_pool(size_t limit)
+{
+	for (size_t i = 0; i < POOL_CLASS_COUNT; i++) {
+		pool_class_t *class = &pool.classes[i];
+
+		while (class->free_list && pool.stats.cached_bytes > limit) {
+			void *block = class->free_list;
+
+			class->free_list = *(void **)block;
+			class->count--;
+
+			pool.stats.cached_blocks--;
+			pool.stats.cached_bytes -= class->size;
+
+			os_free(block, class->size);
+		}
+	}
+}
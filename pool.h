@@ -0,0 +1,23 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef struct {
+	size_t hits;
+	size_t misses;
+	size_t cached_blocks;
+	size_t cached_bytes;
+	size_t limit;
+	bool hugepages;
+} pool_stats_t;
+
+void set_pool_limit(size_t limit, bool hugepages);
+
+void *pool_alloc(size_t size);
+
+void *pool_calloc(size_t size);
+
+void pool_free(void *block, size_t size);
+
+void get_pool_stats(pool_stats_t *stats);
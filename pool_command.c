@@ -0,0 +1,46 @@
+#include <setjmp.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pool_command.h"
+#include "pool.h"
+#include "image.h"
+#include "error.h"
+#include "output.h"
+
+#define POOL_MIN_ARG_COUNT 1
+#define POOL_MAX_ARG_COUNT 2
+#define POOL_SUCCESS_MSG "Pool limit set to %d MB\n"
+
+#define BYTES_PER_MB (1024 * 1024)
+
+/*
+ * POOL <MB> [HUGEPAGES]
+ * keeps up to MB of freed rows and buffers for reuse; with HUGEPAGES, the
+ * large blocks asked from the system are backed by transparent huge pages
+ */
+void pool_command(image_t *image, char **argv, int argc, jmp_buf ex_buf__)
+{
+	if (!image)
+		longjmp(ex_buf__, E_INVALID_FUNC_ARGS);
+
+	if (argc < POOL_MIN_ARG_COUNT || argc > POOL_MAX_ARG_COUNT)
+		longjmp(ex_buf__, E_INVALID_COMMAND);
+
+	int limit = atoi(argv[0]);
+
+	// check if argument is a number
+	if ((!limit && argv[0][0] != '0') || limit < 0)
+		longjmp(ex_buf__, E_INVALID_COMMAND);
+
+	bool hugepages = argc == POOL_MAX_ARG_COUNT;
+
+	if (hugepages && strcmp(argv[1], "HUGEPAGES"))
+		longjmp(ex_buf__, E_INVALID_COMMAND);
+
+	set_pool_limit((size_t)limit * BYTES_PER_MB, hugepages);
+
+	out_printf(POOL_SUCCESS_MSG, limit);
+}
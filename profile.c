@@ -0,0 +1,226 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "profile.h"
+#include "command.h"
+
+#if defined(__linux__) && __has_include(<linux/perf_event.h>)
+#define USE_PERF_EVENTS
+#endif
+
+#ifdef USE_PERF_EVENTS
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+#define REPORT_SIZE 512
+
+enum {
+	CYCLES,
+	INSTRUCTIONS,
+	LLC_MISSES,
+	BRANCH_MISSES,
+	DTLB_MISSES
+};
+
+static atomic_bool profile_mode;
+
+static int open_counter(int event);
+static bool read_counter(int fd, uint64_t *value);
+static void append(char *report, size_t *len, const char *format, ...);
+
+/*
+ * with profile mode on, every command reports its hardware counters on
+ * stderr; without them (no kernel support, not allowed in a container, ...)
+ * only the time is reported
+ */
+void set_profile_mode(bool on)
+{
+	if (on && !atomic_load(&profile_mode)) {
+		int fd = open_counter(CYCLES);
+
+		if (fd == -1)
+			fprintf(stderr, "profile: hardware counters unavailable (%s)\n",
+					strerror(errno));
+		else
+			close(fd);
+	}
+
+	atomic_store(&profile_mode, on);
+}
+
+void start_profile(profile_mark_t *mark)
+{
+	mark->active = atomic_load(&profile_mode);
+
+	if (!mark->active)
+		return;
+
+	for (int i = 0; i < PROFILE_EVENT_COUNT; i++)
+		mark->fds[i] = open_counter(i);
+
+	clock_gettime(CLOCK_MONOTONIC, &mark->start);
+}
+
+// prints what the command cost, per pixel of the image it ran on
+void finish_profile(COMMAND_TYPE type, profile_mark_t *mark, size_t pixels)
+{
+	if (!mark->active)
+		return;
+
+	struct timespec end;
+	uint64_t values[PROFILE_EVENT_COUNT];
+	bool valid[PROFILE_EVENT_COUNT];
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	for (int i = 0; i < PROFILE_EVENT_COUNT; i++) {
+		valid[i] = read_counter(mark->fds[i], &values[i]);
+
+		if (mark->fds[i] != -1)
+			close(mark->fds[i]);
+	}
+
+	static const char *const names[] = {
+		[CYCLES]        = "cycles",
+		[INSTRUCTIONS]  = "instructions",
+		[LLC_MISSES]    = "LLC misses",
+		[BRANCH_MISSES] = "branch misses",
+		[DTLB_MISSES]   = "dTLB misses"
+	};
+
+	char report[REPORT_SIZE];
+	size_t len = 0;
+
+	append(report, &len, "profile %s: %.3f ms", command_type_to_str(type),
+		   (double)(end.tv_sec - mark->start.tv_sec) * 1e3 +
+		   (double)(end.tv_nsec - mark->start.tv_nsec) / 1e6);
+
+	for (int i = 0; i < PROFILE_EVENT_COUNT; i++) {
+		if (!valid[i]) {
+			append(report, &len, ", %s n/a", names[i]);
+			continue;
+		}
+
+		append(report, &len, ", %llu %s", (unsigned long long)values[i],
+			   names[i]);
+
+		if (i == INSTRUCTIONS && valid[CYCLES] && values[CYCLES])
+			append(report, &len, " (%.2f IPC)",
+				   (double)values[INSTRUCTIONS] / values[CYCLES]);
+		else if (i >= LLC_MISSES && pixels)
+			append(report, &len, " (%.4f/pixel)",
+				   (double)values[i] / pixels);
+	}
+
+	fprintf(stderr, "%s\n", report);
+}
+
+#ifdef USE_PERF_EVENTS
+/*
+ * counts the calling thread and the threads it starts afterwards, which
+ * covers the workers of run_parallel(); the kernel adds the counts of a
+ * worker to the parent's counter when the worker exits
+ */
+static int open_counter(int event)
+{
+	struct perf_event_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.inherit = 1;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED |
+					   PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+	switch (event) {
+	case CYCLES:
+		attr.type = PERF_TYPE_HARDWARE;
+		attr.config = PERF_COUNT_HW_CPU_CYCLES;
+		break;
+	case INSTRUCTIONS:
+		attr.type = PERF_TYPE_HARDWARE;
+		attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+		break;
+	case LLC_MISSES:
+		attr.type = PERF_TYPE_HW_CACHE;
+		attr.config = PERF_COUNT_HW_CACHE_LL |
+					  PERF_COUNT_HW_CACHE_OP_READ << 8 |
+					  PERF_COUNT_HW_CACHE_RESULT_MISS << 16;
+		break;
+	case BRANCH_MISSES:
+		attr.type = PERF_TYPE_HARDWARE;
+		attr.config = PERF_COUNT_HW_BRANCH_MISSES;
+		break;
+	case DTLB_MISSES:
+		attr.type = PERF_TYPE_HW_CACHE;
+		attr.config = PERF_COUNT_HW_CACHE_DTLB |
+					  PERF_COUNT_HW_CACHE_OP_READ << 8 |
+					  PERF_COUNT_HW_CACHE_RESULT_MISS << 16;
+		break;
+	default:
+		errno = EINVAL;
+		return -1;
+	}
+
+	long fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+
+	return fd < 0 ? -1 : (int)fd;
+}
+
+// scales the count up when the counter had to share the hardware
+static bool read_counter(int fd, uint64_t *value)
+{
+	// value, time enabled, time running
+	uint64_t data[3];
+
+	if (fd == -1 || read(fd, data, sizeof(data)) != sizeof(data) || !data[2])
+		return false;
+
+	*value = data[2] < data[1] ?
+			 (uint64_t)((double)data[0] * data[1] / data[2]) : data[0];
+
+	return true;
+}
+#else
+static int open_counter(int event)
+{
+	// bypass unused parameter warning
+	if (!event)
+		event++;
+
+	errno = ENOSYS;
+	return -1;
+}
+
+static bool read_counter(int fd, uint64_t *value)
+{
+	// bypass unused parameter warning
+	if (!value)
+		fd++;
+
+	return false;
+}
+#endif
+
+static void append(char *report, size_t *len, const char *format, ...)
+{
+	va_list args;
+
+	if (*len >= REPORT_SIZE)
+		return;
+
+	va_start(args, format);
+	int ret = vsnprintf(report + *len, REPORT_SIZE - *len, format, args);
+	va_end(args);
+
+	if (ret > 0)
+		*len += ret;
+}
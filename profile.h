@@ -0,0 +1,22 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <time.h>
+
+#include "command.h"
+
+#define PROFILE_EVENT_COUNT 5
+
+// the counters opened for one command, a closed counter is -1
+typedef struct {
+	bool active;
+	int fds[PROFILE_EVENT_COUNT];
+	struct timespec start;
+} profile_mark_t;
+
+void set_profile_mode(bool on);
+
+void start_profile(profile_mark_t *mark);
+
+void finish_profile(COMMAND_TYPE type, profile_mark_t *mark, size_t pixels);
@@ -0,0 +1,34 @@
+#include <setjmp.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "profile_command.h"
+#include "profile.h"
+#include "image.h"
+#include "error.h"
+#include "output.h"
+
+#define PROFILE_ARG_COUNT 1
+#define PROFILE_SUCCESS_MSG "Profiling %s\n"
+
+/*
+ * PROFILE ON|OFF
+ * with profiling on, every command prints its time and hardware counters
+ * (cycles, instructions, LLC, branch and dTLB misses) on stderr
+ */
+void profile_command(image_t *image, char **argv, int argc, jmp_buf ex_buf__)
+{
+	if (!image)
+		longjmp(ex_buf__, E_INVALID_FUNC_ARGS);
+
+	if (argc != PROFILE_ARG_COUNT)
+		longjmp(ex_buf__, E_INVALID_COMMAND);
+
+	if (strcmp(argv[0], "ON") && strcmp(argv[0], "OFF"))
+		longjmp(ex_buf__, E_INVALID_COMMAND);
+
+	set_profile_mode(!strcmp(argv[0], "ON"));
+
+	out_printf(PROFILE_SUCCESS_MSG, !strcmp(argv[0], "ON") ? "on" : "off");
+}
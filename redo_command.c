@@ -0,0 +1,37 @@
+#include <setjmp.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+#include "redo_command.h"
+#include "history.h"
+#include "image.h"
+#include "error.h"
+#include "output.h"
+
+#define REDO_ARG_COUNT 0
+#define REDO_SUCCESS_MSG "Redone\n"
+
+/*
+ * REDO
+ * goes forward to the state the last UNDO left
+ */
+void redo_command(image_t *image, char **argv, int argc, jmp_buf ex_buf__)
+{
+	if (!image)
+		longjmp(ex_buf__, E_INVALID_FUNC_ARGS);
+
+	if (argc != REDO_ARG_COUNT)
+		longjmp(ex_buf__, E_INVALID_COMMAND);
+
+	if (!image->is_loaded)
+		longjmp(ex_buf__, E_NO_IMAGE_LOADED);
+
+	// bypass unused parameter warning
+	if (!argv)
+		argc++;
+
+	if (redo_image(image) == -1)
+		longjmp(ex_buf__, E_NOTHING_TO_REDO);
+
+	out_printf(REDO_SUCCESS_MSG);
+}
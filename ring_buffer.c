@@ -0,0 +1,72 @@
+#include <stdlib.h>
+#include <sched.h>
+
+#include "ring_buffer.h"
+
+// capacity must be a power of two so that indices can be masked
+int ring_init(ring_buffer_t *ring, size_t capacity)
+{
+	if (!ring || !capacity || (capacity & (capacity - 1)))
+		return -1;
+
+	ring->slots = calloc(capacity, sizeof(*ring->slots));
+
+	if (!ring->slots)
+		return -1;
+
+	ring->capacity = capacity;
+	atomic_init(&ring->head, 0);
+	atomic_init(&ring->tail, 0);
+
+	return 0;
+}
+
+void ring_destroy(ring_buffer_t *ring)
+{
+	if (!ring)
+		return;
+
+	free(ring->slots);
+	ring->slots = NULL;
+}
+
+/*
+ * producer side: waits while the ring is full, which is what throttles a
+ * fast stage down to the speed of the stage after it; returns false if the
+ * pipeline got aborted meanwhile
+ */
+bool ring_push(ring_buffer_t *ring, void *item, atomic_bool *abort)
+{
+	size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+
+	while (head - atomic_load_explicit(&ring->tail, memory_order_acquire) ==
+		   ring->capacity) {
+		if (abort && atomic_load(abort))
+			return false;
+
+		sched_yield();
+	}
+
+	ring->slots[head & (ring->capacity - 1)] = item;
+	atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+
+	return true;
+}
+
+// consumer side: waits while the ring is empty
+bool ring_pop(ring_buffer_t *ring, void **item, atomic_bool *abort)
+{
+	size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+
+	while (atomic_load_explicit(&ring->head, memory_order_acquire) == tail) {
+		if (abort && atomic_load(abort))
+			return false;
+
+		sched_yield();
+	}
+
+	*item = ring->slots[tail & (ring->capacity - 1)];
+	atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+
+	return true;
+}
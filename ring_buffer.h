@@ -0,0 +1,23 @@
+#pragma once
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#define CACHE_LINE_SIZE 64
+
+// lock-free queue for exactly one producer thread and one consumer thread
+typedef struct {
+	void **slots;
+	size_t capacity;
+	_Alignas(CACHE_LINE_SIZE) atomic_size_t head;
+	_Alignas(CACHE_LINE_SIZE) atomic_size_t tail;
+} ring_buffer_t;
+
+int ring_init(ring_buffer_t *ring, size_t capacity);
+
+void ring_destroy(ring_buffer_t *ring);
+
+bool ring_push(ring_buffer_t *ring, void *item, atomic_bool *abort);
+
+bool ring_pop(ring_buffer_t *ring, void **item, atomic_bool *abort);
@@ -3,9 +3,12 @@
 #include <stdio.h>
 
 #include "image.h"
+#include "bitmap.h"
 #include "rotate_command.h"
 #include "error.h"
 #include "utils.h"
+#include "lazy.h"
+#include "output.h"
 
 #define ROTATE_ARG_COUNT 1
 #define ROTATE_SUCCESS_MSG "Rotated %d\n"
@@ -13,8 +16,15 @@
 #define MAX_ROTATE_ANGLE 360
 #define MIN_ROTATE_ANGLE (-360)
 
+// side of the blocks the matrix is transposed in
+#define TRANSPOSE_BLOCK 64
+
 static int transpose_matrix(image_t *image);
 static int transpose_selection(image_t *image);
+static int transpose_bitmap(image_t *image);
+static int transpose_bitmap_selection(image_t *image);
+static int rotate_planes(image_t *image);
+static int rotate_plane_selection(image_t *image);
 
 void rotate_command(image_t *image, char **argv, int argc, jmp_buf ex_buf__)
 {
@@ -41,21 +51,52 @@ void rotate_command(image_t *image, char **argv, int argc, jmp_buf ex_buf__)
 	if (!whole_matrix_is_selected(image) && !selection_is_square(image))
 		longjmp(ex_buf__, E_SELECTION_NOT_SQUARE);
 
-	int rotation_count = temp / 90;
+	image_op_t op = {
+		.type = OP_ROTATE,
+		.param = temp,
+		.selection = image->selection
+	};
+
+	if (submit_image_op(image, op) == -1)
+		longjmp(ex_buf__, E_FUNC_FAILED);
+
+	out_printf(ROTATE_SUCCESS_MSG, temp);
+}
+
+// rotates the whole image or its square selection clockwise
+int rotate_image(image_t *image, int angle)
+{
+	if (!image)
+		return -1;
+
+	int rotation_count = angle / 90;
 
 	if (rotation_count < 0)
 		rotation_count += 4;
 
-	for (int i = 0; i < rotation_count; i++) {
-		if (whole_matrix_is_selected(image) && transpose_matrix(image) == -1)
-			longjmp(ex_buf__, E_FUNC_FAILED);
+	bool bitmap = is_bitmap(image->magic_word);
+
+	for (int i = 0; i < rotation_count && is_pam(image->magic_word); i++) {
+		if (whole_matrix_is_selected(image) && rotate_planes(image) == -1)
+			return -1;
 
 		if (!whole_matrix_is_selected(image) &&
-			transpose_selection(image) == -1)
-			longjmp(ex_buf__, E_FUNC_FAILED);
+			rotate_plane_selection(image) == -1)
+			return -1;
 	}
 
-	printf(ROTATE_SUCCESS_MSG, temp);
+	for (int i = 0; i < rotation_count && !is_pam(image->magic_word); i++) {
+		if (whole_matrix_is_selected(image) &&
+			(bitmap ? transpose_bitmap(image) : transpose_matrix(image)) == -1)
+			return -1;
+
+		if (!whole_matrix_is_selected(image) &&
+			(bitmap ? transpose_bitmap_selection(image) :
+					  transpose_selection(image)) == -1)
+			return -1;
+	}
+
+	return 0;
 }
 
 static int transpose_selection(image_t *image)
@@ -66,6 +107,9 @@ static int transpose_selection(image_t *image)
 	size_t size = image->selection.lower_right.x -
 				  image->selection.upper_left.x;
 
+	if (make_rows_writable(image, image->selection.upper_left.y, size) == -1)
+		return -1;
+
 	for (size_t i = 0; i < size; i++)
 		for (size_t j = i + 1; j < size; j++)
 			swap_pixel_t(&image->matrix[i + image->selection.upper_left.y]
@@ -102,9 +146,20 @@ static int transpose_matrix(image_t *image)
 	if (create_matrix(&res) == -1)
 		return -1;
 
-	for (size_t i = 0; i < res.height; i++)
-		for (size_t j = 0; j < res.width; j++)
-			res.matrix[i][j] = image->matrix[j][i];
+	/*
+	 * go block by block, so that reading the source column-wise only touches
+	 * a few rows at a time instead of the whole matrix for every pixel
+	 */
+	for (size_t bi = 0; bi < res.height; bi += TRANSPOSE_BLOCK) {
+		for (size_t bj = 0; bj < res.width; bj += TRANSPOSE_BLOCK) {
+			advise_row_access(image, bj);
+
+			for (size_t i = bi; i < min(bi + TRANSPOSE_BLOCK, res.height); i++)
+				for (size_t j = bj; j < min(bj + TRANSPOSE_BLOCK, res.width);
+					 j++)
+					res.matrix[i][j] = image->matrix[j][i];
+		}
+	}
 
 	for (size_t i = 0; i < res.height; i++)
 		for (size_t j = 0; j < res.width / 2; j++)
@@ -117,3 +172,178 @@ static int transpose_matrix(image_t *image)
 
 	return 0;
 }
+
+/*
+ * a quarter turn of a bitmap: 64x64 blocks of pixels are transposed inside
+ * their words and land in the block on the other side of the diagonal, then
+ * every row is mirrored, as in transpose_matrix()
+ */
+static int transpose_bitmap(image_t *image)
+{
+	image_t res;
+
+	res.height = image->width;
+	res.width  = image->height;
+	res.is_loaded = image->is_loaded;
+	res.magic_word = image->magic_word;
+	res.max_val = image->max_val;
+	res.selection.upper_left.x = 0;
+	res.selection.upper_left.y = 0;
+	res.selection.lower_right.x = res.width;
+	res.selection.lower_right.y = res.height;
+
+	if (create_matrix(&res) == -1)
+		return -1;
+
+	uint64_t block[BIT_BLOCK_SIZE];
+	uint64_t *mirrored = malloc(bitmap_words(res.width) * sizeof(*mirrored));
+
+	if (!mirrored) {
+		reset_image(&res);
+		return -1;
+	}
+
+	for (size_t bi = 0; bi < image->height; bi += BIT_BLOCK_SIZE) {
+		advise_row_access(image, bi);
+
+		for (size_t w = 0; w < bitmap_words(image->width); w++) {
+			// rows past the end are white, so the new padding stays clear
+			for (size_t k = 0; k < BIT_BLOCK_SIZE; k++)
+				block[k] = bi + k < image->height ?
+						   bitmap_row(image, bi + k)[w] : 0;
+
+			transpose_bit_block(block);
+
+			for (size_t k = 0; k < BIT_BLOCK_SIZE; k++)
+				if (w * BIT_BLOCK_SIZE + k < res.height)
+					bitmap_row(&res, w * BIT_BLOCK_SIZE + k)
+						[bi / BIT_BLOCK_SIZE] = block[k];
+		}
+	}
+
+	for (size_t i = 0; i < res.height; i++) {
+		advise_row_access(&res, i);
+		mirror_bits(mirrored, bitmap_row(&res, i), res.width);
+		memcpy(bitmap_row(&res, i), mirrored,
+			   bitmap_words(res.width) * sizeof(*mirrored));
+	}
+
+	free(mirrored);
+
+	if (copy_image(image, &res) == -1)
+		return -1;
+
+	reset_image(&res);
+
+	return 0;
+}
+
+// a quarter turn of a square selection of a bitmap, through a copy of it
+static int transpose_bitmap_selection(image_t *image)
+{
+	size_t size = image->selection.lower_right.x -
+				  image->selection.upper_left.x;
+	size_t words = bitmap_words(size);
+	uint64_t *square = malloc(size * words * sizeof(*square));
+
+	if (!square)
+		return -1;
+
+	if (make_rows_writable(image, image->selection.upper_left.y, size) == -1) {
+		free(square);
+		return -1;
+	}
+
+	for (size_t i = 0; i < size; i++)
+		copy_bits(square + i * words,
+				  bitmap_row(image, i + image->selection.upper_left.y),
+				  image->selection.upper_left.x, size);
+
+	// clockwise, the new row i is the old column i read bottom to top
+	for (size_t i = 0; i < size; i++)
+		for (size_t j = 0; j < size; j++)
+			set_bit(bitmap_row(image, i + image->selection.upper_left.y),
+					j + image->selection.upper_left.x,
+					get_bit(square + (size - 1 - j) * words, i));
+
+	free(square);
+
+	return 0;
+}
+
+/*
+ * a quarter turn of a PAM image, one plane at a time: the new row i is the
+ * old column i read bottom to top, gathered block by block
+ */
+static int rotate_planes(image_t *image)
+{
+	image_t res;
+
+	res.height = image->width;
+	res.width  = image->height;
+	res.is_loaded = image->is_loaded;
+	res.magic_word = image->magic_word;
+	res.max_val = image->max_val;
+	res.depth = image->depth;
+	res.selection.upper_left.x = 0;
+	res.selection.upper_left.y = 0;
+	res.selection.lower_right.x = res.width;
+	res.selection.lower_right.y = res.height;
+
+	memcpy(res.tuple_type, image->tuple_type, sizeof(res.tuple_type));
+
+	if (create_matrix(&res) == -1)
+		return -1;
+
+	for (size_t bi = 0; bi < res.height; bi += TRANSPOSE_BLOCK) {
+		for (size_t bj = 0; bj < res.width; bj += TRANSPOSE_BLOCK) {
+			for (size_t c = 0; c < image->depth; c++)
+				for (size_t i = bi; i < min(bi + TRANSPOSE_BLOCK, res.height);
+					 i++)
+					for (size_t j = bj; j < min(bj + TRANSPOSE_BLOCK,
+												res.width); j++)
+						pam_plane(&res, i, c)[j] =
+						pam_plane(image, image->height - 1 - j, c)[i];
+		}
+	}
+
+	if (copy_image(image, &res) == -1)
+		return -1;
+
+	reset_image(&res);
+
+	return 0;
+}
+
+// a quarter turn of a square selection of a PAM image, through a copy of it
+static int rotate_plane_selection(image_t *image)
+{
+	size_t size = image->selection.lower_right.x -
+				  image->selection.upper_left.x;
+	size_t x = image->selection.upper_left.x;
+	size_t y = image->selection.upper_left.y;
+	double *square = malloc(size * size * sizeof(*square));
+
+	if (!square)
+		return -1;
+
+	if (make_rows_writable(image, y, size) == -1) {
+		free(square);
+		return -1;
+	}
+
+	for (size_t c = 0; c < image->depth; c++) {
+		for (size_t i = 0; i < size; i++)
+			memcpy(square + i * size, pam_plane(image, y + i, c) + x,
+				   size * sizeof(*square));
+
+		for (size_t i = 0; i < size; i++)
+			for (size_t j = 0; j < size; j++)
+				pam_plane(image, y + i, c)[x + j] =
+				square[(size - 1 - j) * size + i];
+	}
+
+	free(square);
+
+	return 0;
+}
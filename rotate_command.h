@@ -5,3 +5,5 @@
 #include "image.h"
 
 void rotate_command(image_t *image, char **argv, int argc, jmp_buf ex_buf__);
+
+int rotate_image(image_t *image, int angle);
@@ -1,23 +1,71 @@
 #include <string.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <limits.h>
 #include <stdbool.h>
-#include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
 
 #include "save_command.h"
+#include "async_io.h"
 #include "error.h"
 #include "image.h"
+#include "utils.h"
+#include "pnm.h"
+#include "bitmap.h"
+#include "tiled.h"
+#include "output.h"
+#include "pool.h"
+#include "trace.h"
 
 #define SAVE_MIN_ARG_COUNT 1
-#define SAVE_MAX_ARG_COUNT 2
+#define SAVE_MAX_ARG_COUNT 3
 
 #define SAVE_SUCCESS_MSG "Saved %s\n"
 
-static void save_ascii_matrix(FILE *fp, image_t *image);
-static void save_color_ascii_pixel(FILE *fp, pixel_t pixel);
-static void save_grayscale_ascii_pixel(FILE *fp, pixel_t pixel);
-static void save_binary_matrix(FILE *fp, image_t *image);
-static void save_color_binary_pixel(FILE *fp, pixel_t pixel);
-static void save_grayscale_binary_pixel(FILE *fp, pixel_t pixel);
+#define MAX_HEADER_LENGTH (128 + MAX_TUPLE_TYPE_LENGTH)
+// raster bytes written with a single batch of requests
+#define SAVE_BAND_SIZE (8 * 1024 * 1024)
+
+// a SAVE ... ASYNC still being written by a background thread
+typedef struct pending_save_t {
+	char *filename;
+	// what waits compare, every name of the file gives the same path
+	char *path;
+	image_t snapshot;
+	bool ascii;
+	bool tiled;
+	// kept until something waits for the file, to report it there
+	atomic_bool failed;
+	atomic_bool done;
+	pthread_t thread;
+	struct pending_save_t *next;
+} pending_save_t;
+
+static pending_save_t *pending_saves;
+static pthread_mutex_t pending_saves_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// file the SAVEs of this thread append to instead, -1 for none
+static _Thread_local int save_sink = -1;
+
+static int save_async(const char *filename, image_t *image, bool ascii,
+					  bool tiled);
+static void *pending_save_main(void *arg);
+static char *canonical_path(const char *filename);
+static int wait_matching_saves(const char *filename, bool only_done);
+static int save_to_sink(image_t *image, bool ascii);
+static int write_image(int fd, off_t offset, image_t *image,
+					   selection_t region, bool ascii);
+static int save_ascii_matrix(int fd, off_t offset, image_t *image,
+							 selection_t region);
+static int save_binary_matrix(int fd, off_t offset, image_t *image,
+							  selection_t region);
+static int format_pam_header(char *header, size_t size, image_t *image,
+							 selection_t region);
+static const pixel_t *region_row(image_t *image, size_t row,
+								 selection_t region, uint64_t *scratch);
 
 void save_command(image_t *image, char **argv, int argc, jmp_buf ex_buf__)
 {
@@ -27,115 +75,466 @@ void save_command(image_t *image, char **argv, int argc, jmp_buf ex_buf__)
 	if (argc < SAVE_MIN_ARG_COUNT || argc > SAVE_MAX_ARG_COUNT)
 		longjmp(ex_buf__, E_INVALID_COMMAND);
 
-	if (argc == 2 && strcmp(argv[1], "ascii"))
+	bool async = !strcmp(argv[argc - 1], "ASYNC") && argc > 1;
+	bool has_format = argc - async == 2;
+	bool ascii = has_format && !strcmp(argv[1], "ascii");
+	bool tiled = has_format && !strcmp(argv[1], "TILED");
+
+	if ((has_format && !ascii && !tiled) || argc - async > 2)
 		longjmp(ex_buf__, E_INVALID_COMMAND);
 
 	if (!image->is_loaded)
 		longjmp(ex_buf__, E_NO_IMAGE_LOADED);
 
-	FILE *fp = fopen(argv[0], "w");
+	/*
+	 * the file name doesn't matter then, and there is nothing to wait for;
+	 * frames stay PNM, a TILED one is written in binary
+	 */
+	if (save_sink != -1) {
+		if (save_to_sink(image, ascii) == -1)
+			longjmp(ex_buf__, E_FUNC_FAILED);
 
-	if (!fp)
+		out_printf(SAVE_SUCCESS_MSG, argv[0]);
+		return;
+	}
+
+	// an earlier background save of the same file must land first
+	if (wait_pending_save(argv[0]) == -1)
 		longjmp(ex_buf__, E_FUNC_FAILED);
 
-	if (is_color(image->magic_word)) {
-		if (argc == 2)
-			fprintf(fp, "%s\n", magic_word_to_str(P3));
-		else
-			fprintf(fp, "%s\n", magic_word_to_str(P6));
+	if (async) {
+		if (save_async(argv[0], image, ascii, tiled) == -1)
+			longjmp(ex_buf__, E_FUNC_FAILED);
+	} else if (tiled) {
+		if (save_tiled_image(argv[0], image) == -1)
+			longjmp(ex_buf__, E_FUNC_FAILED);
 	} else {
-		if (argc == 2)
-			fprintf(fp, "%s\n", magic_word_to_str(P2));
-		else
-			fprintf(fp, "%s\n", magic_word_to_str(P5));
+		selection_t whole_image = {
+			.upper_left = {0, 0},
+			.lower_right = {image->width, image->height}
+		};
+
+		if (save_image(argv[0], image, whole_image, ascii) == -1)
+			longjmp(ex_buf__, E_FUNC_FAILED);
 	}
 
-	fprintf(fp, "%zu %zu\n", image->width, image->height);
-	fprintf(fp, "%hhu\n", image->max_val);
+	out_printf(SAVE_SUCCESS_MSG, argv[0]);
+}
 
-	if (argc == 1) {
-		fp = freopen(argv[0], "ab", fp);
+/*
+ * makes the SAVEs run by this thread append the image to the given file
+ * instead of writing their own (see --frames), -1 restores that
+ */
+void set_save_sink(int fd)
+{
+	save_sink = fd;
+}
 
-		if (!fp)
-			longjmp(ex_buf__, E_FUNC_FAILED);
+/*
+ * blocks until every background save of the given file is written; returns
+ * -1 if one of them failed
+ */
+int wait_pending_save(const char *filename)
+{
+	return wait_matching_saves(filename, false);
+}
 
-		save_binary_matrix(fp, image);
-	} else {
-		save_ascii_matrix(fp, image);
-	}
+// blocks until every background save is written, -1 if one failed
+int wait_pending_saves(void)
+{
+	return wait_matching_saves(NULL, false);
+}
+
+/*
+ * takes a snapshot of the image and encodes it on a background thread, so
+ * that the next commands can edit the image meanwhile
+ */
+static int save_async(const char *filename, image_t *image, bool ascii,
+					  bool tiled)
+{
+	// join the threads that are already done
+	wait_matching_saves(NULL, true);
+
+	pending_save_t *save = calloc(1, sizeof(*save));
+
+	if (!save)
+		return -1;
+
+	save->filename = strdup(filename);
+	save->path = canonical_path(filename);
+	save->ascii = ascii;
+	save->tiled = tiled;
+	save->snapshot.matrix = NULL;
+	atomic_init(&save->failed, false);
+	atomic_init(&save->done, false);
+
+	if (!save->filename || !save->path ||
+		copy_image(&save->snapshot, image) == -1)
+		goto fail;
+
+	if (pthread_create(&save->thread, NULL, pending_save_main, save))
+		goto fail;
+
+	pthread_mutex_lock(&pending_saves_lock);
+	save->next = pending_saves;
+	pending_saves = save;
+	pthread_mutex_unlock(&pending_saves_lock);
+
+	return 0;
 
-	fclose(fp);
+fail:
+	reset_image(&save->snapshot);
+	free(save->filename);
+	free(save->path);
+	free(save);
 
-	printf(SAVE_SUCCESS_MSG, argv[0]);
+	return -1;
 }
 
-static void save_ascii_matrix(FILE *fp, image_t *image)
+static void *pending_save_main(void *arg)
 {
-	if (!fp || !image)
-		return;
+	pending_save_t *save = arg;
 
-	for (size_t i = 0; i < image->height; i++) {
-		for (size_t j = 0; j < image->width; j++)
-			if (is_color(image->magic_word))
-				save_color_ascii_pixel(fp, image->matrix[i][j]);
-			else
-				save_grayscale_ascii_pixel(fp, image->matrix[i][j]);
+	selection_t whole_image = {
+		.upper_left = {0, 0},
+		.lower_right = {save->snapshot.width, save->snapshot.height}
+	};
+
+	int ret;
+
+	if (save->tiled)
+		ret = save_tiled_image(save->filename, &save->snapshot);
+	else
+		ret = save_image(save->filename, &save->snapshot, whole_image,
+						 save->ascii);
+	reset_image(&save->snapshot);
+
+	atomic_store(&save->failed, ret == -1);
+
+	atomic_store(&save->done, true);
+
+	return NULL;
+}
+
+/*
+ * joins the background saves of the given file (or of any file for NULL) and
+ * returns -1 if one of them failed; with only_done set, the saves that are
+ * still running are left alone, and so are the failed ones, whose error is
+ * up to the next wait for their file
+ */
+static int wait_matching_saves(const char *filename, bool only_done)
+{
+	pending_save_t *matching = NULL;
+	char *path = NULL;
+	int ret = 0;
+
+	// without a path to compare, every save might be the file
+	if (filename)
+		path = canonical_path(filename);
+
+	pthread_mutex_lock(&pending_saves_lock);
+
+	for (pending_save_t **it = &pending_saves; *it;) {
+		pending_save_t *save = *it;
+
+		if ((path && strcmp(save->path, path)) ||
+			(only_done && (!atomic_load(&save->done) ||
+						   atomic_load(&save->failed)))) {
+			it = &save->next;
+			continue;
+		}
 
-		fprintf(fp, "\n");
+		*it = save->next;
+		save->next = matching;
+		matching = save;
 	}
+
+	pthread_mutex_unlock(&pending_saves_lock);
+
+	free(path);
+
+	while (matching) {
+		pending_save_t *save = matching;
+
+		matching = save->next;
+
+		pthread_join(save->thread, NULL);
+
+		if (atomic_load(&save->failed))
+			ret = -1;
+
+		free(save->filename);
+		free(save->path);
+		free(save);
+	}
+
+	return ret;
 }
 
-static void save_color_ascii_pixel(FILE *fp, pixel_t pixel)
+/*
+ * the absolute path of a file, through symbolic links and . and ..; a file
+ * that doesn't exist yet gets the path of its directory and its name, which
+ * is what realpath() gives once it's created
+ */
+static char *canonical_path(const char *filename)
 {
-	if (!fp)
-		return;
+	char *path = realpath(filename, NULL);
+
+	if (path)
+		return path;
+
+	const char *slash = strrchr(filename, '/');
+	const char *name = slash ? slash + 1 : filename;
+	char dir[PATH_MAX];
+
+	if (!slash)
+		strcpy(dir, ".");
+	else if (slash == filename)
+		strcpy(dir, "/");
+	else
+		snprintf(dir, sizeof(dir), "%.*s", (int)(slash - filename), filename);
+
+	char *dir_path = realpath(dir, NULL);
 
-	fprintf(fp, "%hhu %hhu %hhu ", (unsigned char)round(pixel.color.red),
-			(unsigned char)round(pixel.color.green),
-			(unsigned char)round(pixel.color.blue));
+	// the directory is missing too, nothing can have written the file
+	if (!dir_path)
+		return strdup(filename);
+
+	size_t len = strlen(dir_path) + strlen(name) + 2;
+
+	path = malloc(len);
+
+	if (path)
+		snprintf(path, len, "%s%s%s", dir_path,
+				 strcmp(dir_path, "/") ? "/" : "", name);
+
+	free(dir_path);
+
+	return path;
 }
 
-static void save_grayscale_ascii_pixel(FILE *fp, pixel_t pixel)
+// writes the given region of an image to a file, in binary or ascii format
+int save_image(const char *filename, image_t *image, selection_t region,
+			   bool ascii)
 {
-	if (!fp)
-		return;
+	if (!filename || !image)
+		return -1;
+
+	int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
 
-	fprintf(fp, "%hhu ", (unsigned char)round(pixel.grayscale.value));
+	if (fd == -1)
+		return -1;
+
+	int ret = write_image(fd, 0, image, region, ascii);
+
+	if (close(fd) == -1)
+		ret = -1;
+
+	return ret;
 }
 
-static void save_binary_matrix(FILE *fp, image_t *image)
+// the whole image, after what the sink already holds
+static int save_to_sink(image_t *image, bool ascii)
 {
-	if (!fp || !image)
-		return;
+	off_t end = lseek(save_sink, 0, SEEK_END);
+
+	if (end == -1)
+		return -1;
+
+	selection_t whole_image = {
+		.upper_left = {0, 0},
+		.lower_right = {image->width, image->height}
+	};
+
+	return write_image(save_sink, end, image, whole_image, ascii);
+}
+
+// encodes the header and the region of the image at the given offset
+static int write_image(int fd, off_t offset, image_t *image,
+					   selection_t region, bool ascii)
+{
+	MAGIC_WORD magic_word;
+
+	if (is_bitmap(image->magic_word))
+		magic_word = ascii ? P1 : P4;
+	else if (is_color(image->magic_word))
+		magic_word = ascii ? P3 : P6;
+	else
+		magic_word = ascii ? P2 : P5;
+
+	char header[MAX_HEADER_LENGTH];
+	int len;
+
+	// there is no plain PAM format, P7 images are always written in binary
+	if (is_pam(image->magic_word)) {
+		ascii = false;
+		len = format_pam_header(header, sizeof(header), image, region);
+	} else {
+		len = snprintf(header, sizeof(header), "%s\n%zu %zu\n",
+					   magic_word_to_str(magic_word),
+					   region.lower_right.x - region.upper_left.x,
+					   region.lower_right.y - region.upper_left.y);
+
+		// bitmaps have no max value
+		if (!is_bitmap(image->magic_word))
+			len += snprintf(header + len, sizeof(header) - len, "%hu\n",
+							image->max_val);
+	}
+
+	int ret = async_write(fd, header, len, offset);
+	trace_span_t span;
+
+	trace_begin(&span, "phase", "encode", -1);
+
+	if (!ret && ascii)
+		ret = save_ascii_matrix(fd, offset + len, image, region);
+	else if (!ret)
+		ret = save_binary_matrix(fd, offset + len, image, region);
+
+	trace_end(&span);
+
+	return ret;
+}
+
+// encodes bands of rows into text and writes them at the given offset
+static int save_ascii_matrix(int fd, off_t offset, image_t *image,
+							 selection_t region)
+{
+	if (fd < 0 || !image)
+		return -1;
+
+	size_t width = region.lower_right.x - region.upper_left.x;
+	size_t max_row_size = max_ascii_row_size(width, image->magic_word);
+	size_t buffer_size = SAVE_BAND_SIZE + max_row_size;
 
-	for (size_t i = 0; i < image->height; i++)
-		for (size_t j = 0; j < image->width; j++)
-			if (is_color(image->magic_word))
-				save_color_binary_pixel(fp, image->matrix[i][j]);
+	char *buffer = pool_alloc(buffer_size);
+	uint64_t *scratch = malloc(bitmap_words(width) * sizeof(*scratch));
+
+	if (!buffer || !scratch) {
+		pool_free(buffer, buffer_size);
+		free(scratch);
+		return -1;
+	}
+
+	size_t len = 0;
+
+	for (size_t i = region.upper_left.y; i < region.lower_right.y; i++) {
+		advise_row_access(image, i);
+
+		len += encode_ascii_row(region_row(image, i, region, scratch),
+								buffer + len, width, image->magic_word,
+								image->max_val);
+
+		// flush once the next row might not fit
+		if (len + max_row_size > buffer_size ||
+			i + 1 == region.lower_right.y) {
+			if (async_write(fd, buffer, len, offset) == -1) {
+				pool_free(buffer, buffer_size);
+				free(scratch);
+				return -1;
+			}
+
+			offset += len;
+			len = 0;
+		}
+	}
+
+	pool_free(buffer, buffer_size);
+	free(scratch);
+
+	return 0;
+}
+
+static int save_binary_matrix(int fd, off_t offset, image_t *image,
+							  selection_t region)
+{
+	if (fd < 0 || !image)
+		return -1;
+
+	size_t width = region.lower_right.x - region.upper_left.x;
+	size_t row_size = binary_row_size(width, image->magic_word, image->max_val);
+
+	if (is_pam(image->magic_word))
+		row_size = pam_row_size(width, image->depth, image->max_val);
+
+	size_t band_rows = SAVE_BAND_SIZE / row_size;
+
+	if (!band_rows)
+		band_rows = 1;
+
+	unsigned char *buffer = pool_alloc(band_rows * row_size);
+	uint64_t *scratch = malloc(bitmap_words(width) * sizeof(*scratch));
+
+	if (!buffer || !scratch) {
+		pool_free(buffer, band_rows * row_size);
+		free(scratch);
+		return -1;
+	}
+
+	for (size_t i = region.upper_left.y; i < region.lower_right.y;
+		 i += band_rows) {
+		size_t rows = min(band_rows, region.lower_right.y - i);
+
+		for (size_t r = 0; r < rows; r++) {
+			advise_row_access(image, i + r);
+
+			// the planes of the region are as far apart as in the image
+			if (is_pam(image->magic_word))
+				encode_pam_row(pam_plane(image, i + r, 0) + region.upper_left.x,
+							   image->width, buffer + r * row_size, width,
+							   image->depth, image->max_val);
 			else
-				save_grayscale_binary_pixel(fp, image->matrix[i][j]);
+				encode_binary_row(region_row(image, i + r, region, scratch),
+								  buffer + r * row_size, width,
+								  image->magic_word, image->max_val);
+		}
+
+		if (async_write(fd, buffer, rows * row_size, offset) == -1) {
+			pool_free(buffer, band_rows * row_size);
+			free(scratch);
+			return -1;
+		}
+
+		offset += rows * row_size;
+	}
+
+	pool_free(buffer, band_rows * row_size);
+	free(scratch);
+
+	return 0;
 }
 
-static void save_color_binary_pixel(FILE *fp, pixel_t pixel)
+// the named fields of a P7 header, the tuple type only if the image has one
+static int format_pam_header(char *header, size_t size, image_t *image,
+							 selection_t region)
 {
-	if (!fp)
-		return;
+	int len = snprintf(header, size, "P7\nWIDTH %zu\nHEIGHT %zu\nDEPTH %zu\n"
+					   "MAXVAL %hu\n",
+					   region.lower_right.x - region.upper_left.x,
+					   region.lower_right.y - region.upper_left.y,
+					   image->depth, image->max_val);
 
-	unsigned char temp[3];
+	if (image->tuple_type[0])
+		len += snprintf(header + len, size - len, "TUPLTYPE %s\n",
+						image->tuple_type);
 
-	temp[0] = (unsigned char)round(pixel.color.red);
-	temp[1] = (unsigned char)round(pixel.color.green);
-	temp[2] = (unsigned char)round(pixel.color.blue);
+	len += snprintf(header + len, size - len, "ENDHDR\n");
 
-	fwrite(temp, sizeof(unsigned char), 3, fp);
+	return len;
 }
 
-static void save_grayscale_binary_pixel(FILE *fp, pixel_t pixel)
+/*
+ * the part of a row inside the region; bitmap pixels don't start on a word
+ * boundary, so they are shifted into the scratch row first
+ */
+static const pixel_t *region_row(image_t *image, size_t row,
+								 selection_t region, uint64_t *scratch)
 {
-	if (!fp)
-		return;
+	if (!is_bitmap(image->magic_word))
+		return image->matrix[row] + region.upper_left.x;
 
-	unsigned char temp = (unsigned char)round(pixel.grayscale.value);
+	copy_bits(scratch, bitmap_row(image, row), region.upper_left.x,
+			  region.lower_right.x - region.upper_left.x);
 
-	fwrite(&temp, sizeof(unsigned char), 1, fp);
+	return (const pixel_t *)scratch;
 }
@@ -1,7 +1,17 @@
 #pragma once
 
 #include <setjmp.h>
+#include <stdbool.h>
 
 #include "image.h"
 
 void save_command(image_t *image, char **argv, int argc, jmp_buf ex_buf__);
+
+int save_image(const char *filename, image_t *image, selection_t region,
+			   bool ascii);
+
+void set_save_sink(int fd);
+
+int wait_pending_save(const char *filename);
+
+int wait_pending_saves(void);
@@ -0,0 +1,330 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "script.h"
+#include "command.h"
+#include "workspace.h"
+#include "image.h"
+
+#define MAX_ROTATE_ANGLE 360
+#define MIN_ROTATE_ANGLE (-360)
+
+static int read_script(const char *path, plan_t *plan, size_t *size);
+static bool parse_angle(operation_t *op, int *angle);
+static char *angle_to_str(int angle);
+static bool is_select_all(operation_t *op);
+static bool is_valid_save(operation_t *op);
+static bool uses_history(plan_t *plan);
+static bool keeps_image(operation_t *op);
+static void fold_rotations(plan_t *plan);
+static void drop_dead_selections(plan_t *plan);
+static void drop_dead_saves(plan_t *plan);
+// commands that only edit the current image, or change settings
+static bool keeps_image(operation_t *op)
+{
+	switch (op->type) {
+	case SELECT:
+	case HISTOGRAM:
+	case EQUALIZE:
+	case ROTATE:
+	case CROP:
+	case APPLY:
+	case ERODE:
+	case DILATE:
+	case SAVE:
+	case MEMLIMIT:
+	case LAZY:
+	case CACHE:
+	case POOL:
+	case PROFILE:
+	case STATS:
+		return true;
+	default:
+		return false;
+	}
+}
+
+static void compact_plan(plan_t *plan);
+
+/*
+ * reads a script and splits it into operations, one per line; all arguments
+ * share a single array pointing into the script's text
+ */
+int parse_script(const char *path, plan_t *plan)
+{
+	size_t size;
+
+	memset(plan, 0, sizeof(*plan));
+
+	if (read_script(path, plan, &size) == -1)
+		return -1;
+
+	// upper bounds: a token or a line needs at least one character
+	size_t line_count = 1;
+	size_t token_count = 0;
+
+	for (size_t i = 0; i < size; i++) {
+		if (plan->text[i] == '\n')
+			line_count++;
+		else if (plan->text[i] != ' ' && (!i || plan->text[i - 1] == ' ' ||
+										  plan->text[i - 1] == '\n'))
+			token_count++;
+	}
+
+	plan->ops = calloc(line_count, sizeof(*plan->ops));
+	plan->args = calloc(token_count + 1, sizeof(*plan->args));
+
+	if (!plan->ops || !plan->args) {
+		free_plan(plan);
+		return -1;
+	}
+
+	size_t used_args = 0;
+	char *line_saveptr = NULL;
+	char *line = plan->text;
+
+	// split by hand, strtok() would skip empty lines
+	while (line && (line < plan->text + size || !plan->count)) {
+		char *next = strchr(line, '\n');
+
+		if (next)
+			*next++ = '\0';
+		else if (!*line)
+			break;
+
+		operation_t *op = &plan->ops[plan->count++];
+		char *token = strtok_r(line, " ", &line_saveptr);
+
+		op->type = str_to_command_type(token);
+		op->argv = plan->args + used_args;
+
+		while ((token = strtok_r(NULL, " ", &line_saveptr)) != NULL) {
+			plan->args[used_args++] = token;
+			op->argc++;
+		}
+
+		if (!op->argc)
+			op->argv = NULL;
+
+		line = next;
+	}
+
+	return 0;
+}
+
+/*
+ * peephole pass over the plan; it keeps the final state of the image and of
+ * the saved files, not the messages of the commands it drops
+ */
+void optimize_plan(plan_t *plan)
+{
+	// UNDO and REDO go back to the states in between, every edit counts
+	bool history = uses_history(plan);
+
+	if (!history) {
+		fold_rotations(plan);
+		compact_plan(plan);
+	}
+
+	drop_dead_selections(plan);
+	compact_plan(plan);
+
+	if (!history) {
+		drop_dead_saves(plan);
+		compact_plan(plan);
+	}
+}
+
+void run_plan(plan_t *plan)
+{
+	// USE and LOAD ... AS switch images between operations
+	for (size_t i = 0; i < plan->count; i++)
+		run_parsed_command(plan->ops[i].type, plan->ops[i].argv,
+						   plan->ops[i].argc, current_image());
+}
+
+void free_plan(plan_t *plan)
+{
+	free(plan->text);
+	free(plan->args);
+	free(plan->ops);
+
+	memset(plan, 0, sizeof(*plan));
+}
+
+static int read_script(const char *path, plan_t *plan, size_t *size)
+{
+	FILE *fp = fopen(path, "rb");
+
+	if (!fp)
+		return -1;
+
+	if (fseek(fp, 0, SEEK_END) == -1) {
+		fclose(fp);
+		return -1;
+	}
+
+	long len = ftell(fp);
+
+	rewind(fp);
+
+	plan->text = len >= 0 ? malloc(len + 1) : NULL;
+
+	if (!plan->text || fread(plan->text, 1, len, fp) != (size_t)len) {
+		free(plan->text);
+		plan->text = NULL;
+		fclose(fp);
+		return -1;
+	}
+
+	fclose(fp);
+
+	plan->text[len] = '\0';
+	*size = len;
+
+	return 0;
+}
+
+// accepts exactly the angles rotate_command() accepts
+static bool parse_angle(operation_t *op, int *angle)
+{
+	if (op->type != ROTATE || op->argc != 1)
+		return false;
+
+	*angle = atoi(op->argv[0]);
+
+	if (!*angle && op->argv[0][0] != '0')
+		return false;
+
+	return *angle % 90 == 0 && *angle <= MAX_ROTATE_ANGLE &&
+		   *angle >= MIN_ROTATE_ANGLE;
+}
+
+// the argument of a folded rotation, angle is a nonzero multiple of 90
+static char *angle_to_str(int angle)
+{
+	static char angles[][5] = {
+		"-270", "-180", "-90", "", "90", "180", "270"
+	};
+
+	return angles[angle / 90 + 3];
+}
+
+static bool is_select_all(operation_t *op)
+{
+	return op->type == SELECT && op->argc == 1 && !strcmp(op->argv[0], "ALL");
+}
+
+// accepts exactly the arguments save_command() accepts
+static bool is_valid_save(operation_t *op)
+{
+	if (op->type != SAVE || op->argc < 1 || op->argc > 3)
+		return false;
+
+	bool async = op->argc > 1 && !strcmp(op->argv[op->argc - 1], "ASYNC");
+	bool has_format = op->argc - async == 2;
+
+	return (!has_format || !strcmp(op->argv[1], "ascii") ||
+			!strcmp(op->argv[1], "TILED")) && op->argc - async <= 2;
+}
+
+static bool uses_history(plan_t *plan)
+{
+	for (size_t i = 0; i < plan->count; i++)
+		if (plan->ops[i].type == HISTORY || plan->ops[i].type == UNDO ||
+			plan->ops[i].type == REDO)
+			return true;
+
+	return false;
+}
+
+/*
+ * ROTATE a; ROTATE b -> ROTATE a+b, both go through the same checks and
+ * a full turn disappears completely; the sum lands in the second operation,
+ * so longer runs keep folding
+ */
+static void fold_rotations(plan_t *plan)
+{
+	for (size_t i = 0; i + 1 < plan->count; i++) {
+		int first, second;
+
+		if (!parse_angle(&plan->ops[i], &first) ||
+			!parse_angle(&plan->ops[i + 1], &second))
+			continue;
+
+		int angle = (first + second) % MAX_ROTATE_ANGLE;
+
+		plan->ops[i].removed = true;
+
+		if (!angle) {
+			plan->ops[++i].removed = true;
+			continue;
+		}
+
+		plan->ops[i + 1].argv[0] = angle_to_str(angle);
+	}
+}
+
+// SELECT followed by SELECT ALL, by the same SELECT or by a LOAD is dead
+static void drop_dead_selections(plan_t *plan)
+{
+	for (size_t i = 0; i + 1 < plan->count; i++) {
+		operation_t *op = &plan->ops[i];
+		operation_t *next = &plan->ops[i + 1];
+
+		if (op->type != SELECT)
+			continue;
+
+		bool same = op->argc == next->argc && next->type == SELECT;
+
+		for (int j = 0; same && j < op->argc; j++)
+			same = !strcmp(op->argv[j], next->argv[j]);
+
+		// LOAD ... AS leaves the selected image alone
+		if (same || is_select_all(next) ||
+			(next->type == LOAD && next->argc == 1))
+			op->removed = true;
+	}
+}
+
+/*
+ * a SAVE whose file gets saved again before anything could read it is dead;
+ * the later SAVE must be sure to write it, so nothing in between may switch
+ * or unload the image, or read files
+ */
+static void drop_dead_saves(plan_t *plan)
+{
+	for (size_t i = 0; i < plan->count; i++) {
+		if (plan->ops[i].removed || !is_valid_save(&plan->ops[i]))
+			continue;
+
+		for (size_t j = i + 1; j < plan->count; j++) {
+			operation_t *op = &plan->ops[j];
+
+			if (op->removed)
+				continue;
+
+			if (is_valid_save(op) &&
+				!strcmp(op->argv[0], plan->ops[i].argv[0])) {
+				plan->ops[i].removed = true;
+				break;
+			}
+
+			if (!keeps_image(op))
+				break;
+		}
+	}
+}
+
+static void compact_plan(plan_t *plan)
+{
+	size_t count = 0;
+
+	for (size_t i = 0; i < plan->count; i++)
+		if (!plan->ops[i].removed)
+			plan->ops[count++] = plan->ops[i];
+
+	plan->count = count;
+}
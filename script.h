@@ -0,0 +1,28 @@
+#pragma once
+
+#include "command.h"
+#include "image.h"
+
+// a single pre-split command of a script
+typedef struct {
+	COMMAND_TYPE type;
+	int argc;
+	char **argv;
+	bool removed;
+} operation_t;
+
+// a whole script, parsed up front; arguments point into the script's text
+typedef struct {
+	char *text;
+	char **args;
+	operation_t *ops;
+	size_t count;
+} plan_t;
+
+int parse_script(const char *path, plan_t *plan);
+
+void optimize_plan(plan_t *plan);
+
+void run_plan(plan_t *plan);
+
+void free_plan(plan_t *plan);
@@ -6,6 +6,7 @@
 #include "image.h"
 #include "error.h"
 #include "utils.h"
+#include "output.h"
 
 #define SELECT_MIN_ARG_COUNT 1
 #define SELECT_MAX_ARG_COUNT 4
@@ -30,7 +31,7 @@ void select_command(image_t *image, char **argv, int argc, jmp_buf ex_buf__)
 
 	if (argc == SELECT_MIN_ARG_COUNT) {
 		select_all(image);
-		printf(SELECT_ALL_SUCCESS_MSG);
+		out_printf(SELECT_ALL_SUCCESS_MSG);
 
 		return;
 	}
@@ -62,7 +63,7 @@ void select_command(image_t *image, char **argv, int argc, jmp_buf ex_buf__)
 
 	select_zone(image, coord);
 
-	printf(SELECT_SUCCESS_MSG, coord[0], coord[1], coord[2], coord[3]);
+	out_printf(SELECT_SUCCESS_MSG, coord[0], coord[1], coord[2], coord[3]);
 }
 
 static void select_zone(image_t *image, int coord[4])
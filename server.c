@@ -0,0 +1,366 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <signal.h>
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "server.h"
+#include "command.h"
+#include "output.h"
+#include "workspace.h"
+#include "worker_pool.h"
+#include "utils.h"
+
+#define SERVE_MSG "Serving on %s\n"
+#define IDLE_MSG "Idle for too long, closing the session\n"
+
+// connections accepted but not picked up by a worker yet
+#define MAX_PENDING_CLIENTS 64
+#define LISTEN_BACKLOG 64
+
+#define SESSION_BUFFER_SIZE 4096
+
+// how long accept() waits after running out of descriptors or memory
+#define MIN_ACCEPT_BACKOFF_MS 10
+#define MAX_ACCEPT_BACKOFF_MS 1000
+
+// a session idle for this long gives its worker to a waiting client
+#define SESSION_IDLE_TIMEOUT_MS (30 * 1000)
+
+/*
+ * bounded queue of client sockets between the accepting thread and the
+ * workers; accept() waits while it is full
+ */
+typedef struct {
+	pthread_mutex_t lock;
+	pthread_cond_t not_empty;
+	pthread_cond_t not_full;
+	int fds[MAX_PENDING_CLIENTS];
+	size_t head;
+	size_t count;
+} client_queue_t;
+
+// the requests of a client, read in blocks and handed out a line at a time
+typedef struct {
+	int fd;
+	char *data;
+	size_t len;
+	size_t capacity;
+	// length of the request handed out last, dropped on the next call
+	size_t consumed;
+} session_t;
+
+static client_queue_t clients = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.not_empty = PTHREAD_COND_INITIALIZER,
+	.not_full = PTHREAD_COND_INITIALIZER
+};
+
+static int open_socket(const char *socket_path);
+static int accept_client(int listen_fd);
+static void push_client(int fd);
+static int pop_client(void);
+static bool clients_waiting(void);
+static void *server_worker(void *arg);
+static void serve_client(int fd);
+static char *next_request(session_t *session);
+static bool wait_for_request(int fd);
+
+/*
+ * keeps the images in memory and runs the commands of many clients at once,
+ * one session per connection on a fixed number of workers; sessions share
+ * the images, each with its own current image, and take turns on each image.
+ * Once every worker has a session, new clients wait for one to end, and
+ * sessions that stay idle meanwhile are closed
+ */
+int run_server(const char *socket_path)
+{
+	int listen_fd = open_socket(socket_path);
+
+	if (listen_fd == -1) {
+		perror(socket_path);
+		return 1;
+	}
+
+	// a client hanging up must not kill the server
+	signal(SIGPIPE, SIG_IGN);
+
+	size_t count = worker_count();
+	size_t started = 0;
+
+	for (; started < count; started++) {
+		pthread_t thread;
+
+		if (pthread_create(&thread, NULL, server_worker, NULL))
+			break;
+
+		pthread_detach(thread);
+	}
+
+	if (!started) {
+		close(listen_fd);
+		return 1;
+	}
+
+	printf(SERVE_MSG, socket_path);
+	fflush(stdout);
+
+	int fd;
+
+	while ((fd = accept_client(listen_fd)) != -1)
+		push_client(fd);
+
+	perror(socket_path);
+	close(listen_fd);
+
+	return 1;
+}
+
+/*
+ * accepts the next client; running out of descriptors or memory is waited
+ * out with a growing delay, other errors are returned
+ */
+static int accept_client(int listen_fd)
+{
+	unsigned int backoff = 0;
+
+	while (1) {
+		int fd = accept(listen_fd, NULL, NULL);
+
+		if (fd != -1)
+			return fd;
+
+		// the client hung up before it was accepted
+		if (errno == EINTR || errno == ECONNABORTED)
+			continue;
+
+		if (errno != EMFILE && errno != ENFILE && errno != ENOBUFS &&
+			errno != ENOMEM)
+			return -1;
+
+		backoff = backoff ? min(2 * backoff, MAX_ACCEPT_BACKOFF_MS) :
+				  MIN_ACCEPT_BACKOFF_MS;
+		usleep(backoff * 1000);
+	}
+}
+
+static int open_socket(const char *socket_path)
+{
+	struct sockaddr_un addr;
+
+	if (strlen(socket_path) >= sizeof(addr.sun_path))
+		return -1;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, socket_path);
+
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+	if (fd == -1)
+		return -1;
+
+	// a socket left behind by an earlier server
+	unlink(socket_path);
+
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+		listen(fd, LISTEN_BACKLOG) == -1) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+static void push_client(int fd)
+{
+	pthread_mutex_lock(&clients.lock);
+
+	while (clients.count == MAX_PENDING_CLIENTS)
+		pthread_cond_wait(&clients.not_full, &clients.lock);
+
+	clients.fds[(clients.head + clients.count++) % MAX_PENDING_CLIENTS] = fd;
+
+	pthread_cond_signal(&clients.not_empty);
+	pthread_mutex_unlock(&clients.lock);
+}
+
+static int pop_client(void)
+{
+	pthread_mutex_lock(&clients.lock);
+
+	while (!clients.count)
+		pthread_cond_wait(&clients.not_empty, &clients.lock);
+
+	int fd = clients.fds[clients.head];
+
+	clients.head = (clients.head + 1) % MAX_PENDING_CLIENTS;
+	clients.count--;
+
+	pthread_cond_signal(&clients.not_full);
+	pthread_mutex_unlock(&clients.lock);
+
+	return fd;
+}
+
+static bool clients_waiting(void)
+{
+	pthread_mutex_lock(&clients.lock);
+
+	bool waiting = clients.count != 0;
+
+	pthread_mutex_unlock(&clients.lock);
+
+	return waiting;
+}
+
+static void *server_worker(void *arg)
+{
+	if (arg)
+		return NULL;
+
+	while (1)
+		serve_client(pop_client());
+
+	return NULL;
+}
+
+/*
+ * runs the commands of a client, line by line, until it hangs up, sends EXIT
+ * or stays idle while other clients wait; the replies are flushed after
+ * every command
+ */
+static void serve_client(int fd)
+{
+	int out_fd = dup(fd);
+	FILE *out = out_fd == -1 ? NULL : fdopen(out_fd, "w");
+
+	if (!out) {
+		if (out_fd != -1)
+			close(out_fd);
+
+		close(fd);
+		return;
+	}
+
+	set_output_stream(out);
+
+	session_t session = {.fd = fd};
+	char *line;
+
+	while ((line = next_request(&session)) != NULL) {
+		line[strcspn(line, "\r")] = '\0';
+
+		COMMAND_TYPE type;
+		char **argv;
+		int argc = split_command(line, &type, &argv);
+
+		// EXIT ends the session, it must never reach the process
+		if (type == EXIT) {
+			free(argv);
+			break;
+		}
+
+		run_parsed_command(type, argv, argc, current_image());
+		free(argv);
+		fflush(out);
+	}
+
+	// whatever the client queued with ON still runs
+	run_queued_commands();
+	use_image(NULL);
+
+	set_output_stream(NULL);
+
+	free(session.data);
+	close(fd);
+	fclose(out);
+}
+
+/*
+ * the next line sent by the client, without its newline, or NULL once the
+ * client hung up or idled with other clients waiting; the client is only
+ * polled when nothing it sent is left in the buffer
+ */
+static char *next_request(session_t *session)
+{
+	if (session->consumed) {
+		session->len -= session->consumed;
+		memmove(session->data, session->data + session->consumed,
+				session->len);
+		session->consumed = 0;
+	}
+
+	while (1) {
+		char *newline = memchr(session->data, '\n', session->len);
+
+		if (newline) {
+			*newline = '\0';
+			session->consumed = newline - session->data + 1;
+			return session->data;
+		}
+
+		// a request that was started is just waited for
+		if (!session->len && !wait_for_request(session->fd))
+			return NULL;
+
+		// room for the terminator of a last request without a newline
+		if (session->len + 1 >= session->capacity) {
+			size_t capacity = session->capacity ? 2 * session->capacity :
+							  SESSION_BUFFER_SIZE;
+			char *data = realloc(session->data, capacity);
+
+			if (!data)
+				return NULL;
+
+			session->data = data;
+			session->capacity = capacity;
+		}
+
+		ssize_t ret = read(session->fd, session->data + session->len,
+						   session->capacity - session->len - 1);
+
+		if (ret == -1 && errno == EINTR)
+			continue;
+
+		if (ret > 0) {
+			session->len += ret;
+			continue;
+		}
+
+		if (ret == -1 || !session->len)
+			return NULL;
+
+		session->data[session->len] = '\0';
+		session->consumed = session->len;
+
+		return session->data;
+	}
+}
+
+// false once the client hung up, or idled with other clients waiting
+static bool wait_for_request(int fd)
+{
+	struct pollfd pfd = {.fd = fd, .events = POLLIN};
+
+	while (1) {
+		int ret = poll(&pfd, 1, SESSION_IDLE_TIMEOUT_MS);
+
+		if (ret > 0)
+			return true;
+
+		if (ret == -1 && errno != EINTR)
+			return false;
+
+		if (!ret && clients_waiting()) {
+			out_printf(IDLE_MSG);
+			return false;
+		}
+	}
+}
@@ -0,0 +1,3 @@
+#pragma once
+
+int run_server(const char *socket_path);
@@ -0,0 +1,92 @@
+#include <setjmp.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+#include "stats_command.h"
+#include "image_cache.h"
+#include "pool.h"
+#include "metrics.h"
+#include "command.h"
+#include "image.h"
+#include "error.h"
+#include "output.h"
+
+#define STATS_ARG_COUNT 0
+
+#define BYTES_PER_MB (1024 * 1024)
+
+static void print_command_metrics(FILE *fp);
+
+/*
+ * STATS
+ * prints the counters of the editor as a single line of JSON
+ */
+void stats_command(image_t *image, char **argv, int argc, jmp_buf ex_buf__)
+{
+	if (!image)
+		longjmp(ex_buf__, E_INVALID_FUNC_ARGS);
+
+	if (argc != STATS_ARG_COUNT)
+		longjmp(ex_buf__, E_INVALID_COMMAND);
+
+	// bypass unused parameter warning
+	if (!argv)
+		argc++;
+
+	print_stats(output_stream());
+}
+
+// writes every counter of the editor as a single line of JSON
+void print_stats(FILE *fp)
+{
+	cache_stats_t cache;
+	pool_stats_t pool;
+
+	get_cache_stats(&cache);
+	get_pool_stats(&pool);
+
+	fprintf(fp, "{\"cache\":{\"hits\":%zu,\"misses\":%zu,\"evictions\":%zu,"
+			"\"entries\":%zu,\"bytes\":%zu,\"limit\":%zu},",
+			cache.hits, cache.misses, cache.evictions, cache.entries,
+			cache.bytes, cache.limit);
+	fprintf(fp, "\"pool\":{\"hits\":%zu,\"misses\":%zu,\"cached_blocks\":%zu,"
+			"\"cached_bytes\":%zu,\"limit\":%zu,\"hugepages\":%s},",
+			pool.hits, pool.misses, pool.cached_blocks, pool.cached_bytes,
+			pool.limit, pool.hugepages ? "true" : "false");
+
+	print_command_metrics(fp);
+
+	fprintf(fp, "\"peak_rss_kb\":%ld}\n", peak_rss());
+}
+
+// only the commands that ran so far, throughput is in MB/s of pixel data
+static void print_command_metrics(FILE *fp)
+{
+	bool first = true;
+
+	fprintf(fp, "\"commands\":{");
+
+	for (COMMAND_TYPE type = 0; type < INVALID_COMMAND_TYPE; type++) {
+		command_metrics_t metrics;
+
+		get_command_metrics(type, &metrics);
+
+		if (!metrics.count)
+			continue;
+
+		double throughput = metrics.wall_time > 0 ?
+			(double)metrics.bytes / BYTES_PER_MB / metrics.wall_time : 0;
+
+		fprintf(fp, "%s\"%s\":{\"count\":%zu,\"failed\":%zu,"
+				"\"wall_ms\":%.3f,\"cpu_ms\":%.3f,\"bytes\":%zu,"
+				"\"mb_per_s\":%.1f,\"allocs\":%zu,\"max_rss_kb\":%ld}",
+				first ? "" : ",", command_type_to_str(type), metrics.count,
+				metrics.failed, metrics.wall_time * 1000,
+				metrics.cpu_time * 1000, metrics.bytes, throughput,
+				metrics.allocs, metrics.max_rss);
+
+		first = false;
+	}
+
+	fprintf(fp, "},");
+}
@@ -0,0 +1,10 @@
+#pragma once
+
+#include <setjmp.h>
+#include <stdio.h>
+
+#include "image.h"
+
+void stats_command(image_t *image, char **argv, int argc, jmp_buf ex_buf__);
+
+void print_stats(FILE *fp);
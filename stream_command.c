@@ -0,0 +1,601 @@
+#include <setjmp.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "stream_command.h"
+#include "apply_command.h"
+#include "load_command.h"
+#include "save_command.h"
+#include "ring_buffer.h"
+#include "async_io.h"
+#include "image.h"
+#include "error.h"
+#include "utils.h"
+#include "pnm.h"
+#include "output.h"
+#include "pool.h"
+#include "trace.h"
+
+#define STREAM_MIN_ARG_COUNT 2
+#define STREAM_SUCCESS_MSG "Streamed %s to %s\n"
+
+#define BAND_ROWS 32
+// bytes of the raster moved at once when the header grows
+#define SHIFT_BLOCK_SIZE (8 * 1024 * 1024)
+#define RING_CAPACITY 4
+
+// a group of consecutive rows travelling between pipeline threads
+typedef struct {
+	size_t row_count;
+	pixel_t pixels[];
+} band_t;
+
+// one APPLY step; it only ever holds the rows the kernel needs
+typedef struct {
+	const double (*kernel)[KERNEL_SIZE];
+	pixel_t *window[KERNEL_SIZE];
+	pixel_t *output;
+	size_t received;
+	unsigned short max_val;
+	pthread_t thread;
+} filter_stage_t;
+
+/*
+ * reader thread -> rings[0] -> stage 0 -> rings[1] -> ... -> writer
+ * every ring has exactly one producer and one consumer
+ */
+typedef struct {
+	image_t header;
+	FILE *in;
+	FILE *out;
+	long max_val_pos;
+	int max_val_len;
+	filter_stage_t *stages;
+	size_t stage_count;
+	ring_buffer_t *rings;
+	atomic_bool abort;
+} stream_t;
+
+typedef struct {
+	stream_t *stream;
+	size_t idx;
+} stage_arg_t;
+
+static int open_stream(stream_t *stream, char **argv, int argc);
+static void close_stream(stream_t *stream);
+static int run_stream(stream_t *stream);
+static void *reader_main(void *arg);
+static void *stage_main(void *arg);
+static int writer_main(stream_t *stream);
+static band_t *create_band(stream_t *stream);
+static void free_band(stream_t *stream, band_t *band);
+static int emit_row(stream_t *stream, size_t ring, band_t **band,
+					const pixel_t *row);
+static const pixel_t *stage_push(stream_t *stream, filter_stage_t *stage,
+								 const pixel_t *row);
+static const pixel_t *stage_flush(stream_t *stream, filter_stage_t *stage);
+static int patch_max_val(stream_t *stream);
+static int shift_tail(FILE *file, long from, long by);
+
+/*
+ * STREAM <input> <output> [filter...]
+ * runs a binary image through a chain of APPLY filters band by band and saves
+ * it as binary, without ever holding the whole image in memory; decoding,
+ * every filter and encoding run on their own threads. The header is the one
+ * SAVE writes, so when the filters give the max value another digit, the
+ * raster already written is moved by a byte once the value is known
+ */
+void stream_command(image_t *image, char **argv, int argc, jmp_buf ex_buf__)
+{
+	if (!image)
+		longjmp(ex_buf__, E_INVALID_FUNC_ARGS);
+
+	if (argc < STREAM_MIN_ARG_COUNT)
+		longjmp(ex_buf__, E_INVALID_COMMAND);
+
+	for (int i = STREAM_MIN_ARG_COUNT; i < argc; i++)
+		if (str_to_apply_param(argv[i]) == INVALID_APPLY_PARAM)
+			longjmp(ex_buf__, E_INVALID_APPLY_PARAM);
+
+	// either file might still be written by a SAVE ... ASYNC
+	if (wait_pending_save(argv[0]) == -1 || wait_pending_save(argv[1]) == -1)
+		longjmp(ex_buf__, E_FUNC_FAILED);
+
+	stream_t stream;
+	int ret = open_stream(&stream, argv, argc);
+
+	if (ret) {
+		close_stream(&stream);
+		longjmp(ex_buf__, ret);
+	}
+
+	ret = run_stream(&stream);
+	close_stream(&stream);
+
+	if (ret == -1)
+		longjmp(ex_buf__, E_FUNC_FAILED);
+
+	out_printf(STREAM_SUCCESS_MSG, argv[0], argv[1]);
+}
+
+// opens both files, sets up the filter chain and writes the output header
+static int open_stream(stream_t *stream, char **argv, int argc)
+{
+	memset(stream, 0, sizeof(*stream));
+	atomic_init(&stream->abort, false);
+
+	stream->in = fopen(argv[0], "rb");
+
+	// the bands hold interleaved rows, which PAM images don't have
+	if (!stream->in || read_header(stream->in, &stream->header) == -1 ||
+		!is_binary(stream->header.magic_word) ||
+		is_pam(stream->header.magic_word))
+		return E_LOAD_FAILED;
+
+	// skip the whitespace between the header and the raster
+	fgetc(stream->in);
+
+	stream->stage_count = argc - STREAM_MIN_ARG_COUNT;
+
+	if (stream->stage_count && !is_color(stream->header.magic_word))
+		return E_GRAYSCALE_IMAGE;
+
+	size_t width = stream->header.width;
+
+	stream->stages = calloc(stream->stage_count, sizeof(*stream->stages));
+	stream->rings = calloc(stream->stage_count + 1, sizeof(*stream->rings));
+
+	if ((stream->stage_count && !stream->stages) || !stream->rings)
+		return E_FUNC_FAILED;
+
+	for (size_t i = 0; i <= stream->stage_count; i++)
+		if (ring_init(&stream->rings[i], RING_CAPACITY) == -1)
+			return E_FUNC_FAILED;
+
+	for (size_t i = 0; i < stream->stage_count; i++) {
+		filter_stage_t *stage = &stream->stages[i];
+
+		stage->kernel = apply_param_to_kernel(str_to_apply_param(argv[i + 2]));
+		stage->max_val = stream->header.max_val;
+		stage->output = malloc(width * sizeof(pixel_t));
+
+		if (!stage->output)
+			return E_FUNC_FAILED;
+
+		for (size_t k = 0; k < KERNEL_SIZE; k++) {
+			stage->window[k] = malloc(width * sizeof(pixel_t));
+
+			if (!stage->window[k])
+				return E_FUNC_FAILED;
+		}
+	}
+
+	// opened for reading too, the raster may have to move to fit the header
+	stream->out = fopen(argv[1], "w+b");
+
+	if (!stream->out)
+		return E_FUNC_FAILED;
+
+	// the input is binary already, so the output has the same format
+	fprintf(stream->out, "%s\n", magic_word_to_str(stream->header.magic_word));
+	fprintf(stream->out, "%zu %zu\n", width, stream->header.height);
+
+	// bitmaps have no max value and no filters to raise it
+	if (is_bitmap(stream->header.magic_word))
+		return 0;
+
+	/*
+	 * filters may raise the max value, which is only known at the end, so
+	 * remember where it is and patch it once the raster is written
+	 */
+	stream->max_val_pos = ftell(stream->out);
+	stream->max_val_len = fprintf(stream->out, "%hu",
+								  stream->header.max_val);
+	fputc('\n', stream->out);
+
+	return 0;
+}
+
+static void close_stream(stream_t *stream)
+{
+	if (stream->in)
+		fclose(stream->in);
+
+	if (stream->out)
+		fclose(stream->out);
+
+	for (size_t i = 0; stream->stages && i < stream->stage_count; i++) {
+		free(stream->stages[i].output);
+
+		for (size_t k = 0; k < KERNEL_SIZE; k++)
+			free(stream->stages[i].window[k]);
+	}
+
+	for (size_t i = 0; stream->rings && i <= stream->stage_count; i++) {
+		void *band;
+
+		// bands left behind by an aborted run
+		while (stream->rings[i].slots &&
+			   atomic_load(&stream->rings[i].head) !=
+			   atomic_load(&stream->rings[i].tail) &&
+			   ring_pop(&stream->rings[i], &band, NULL))
+			free_band(stream, band);
+
+		ring_destroy(&stream->rings[i]);
+	}
+
+	free(stream->rings);
+	free(stream->stages);
+}
+
+static int run_stream(stream_t *stream)
+{
+	pthread_t reader;
+	size_t started = 0;
+	int ret = 0;
+
+	stage_arg_t *args = calloc(stream->stage_count + 1, sizeof(*args));
+
+	if (!args || pthread_create(&reader, NULL, reader_main, stream)) {
+		free(args);
+		return -1;
+	}
+
+	for (; started < stream->stage_count; started++) {
+		args[started].stream = stream;
+		args[started].idx = started;
+
+		if (pthread_create(&stream->stages[started].thread, NULL, stage_main,
+						   &args[started])) {
+			atomic_store(&stream->abort, true);
+			break;
+		}
+	}
+
+	// the calling thread does the encoding
+	if (started == stream->stage_count)
+		ret = writer_main(stream);
+	else
+		ret = -1;
+
+	pthread_join(reader, NULL);
+
+	for (size_t i = 0; i < started; i++)
+		pthread_join(stream->stages[i].thread, NULL);
+
+	free(args);
+
+	if (ret == -1 || atomic_load(&stream->abort))
+		return -1;
+
+	for (size_t i = 0; i < stream->stage_count; i++)
+		if (stream->stages[i].max_val > stream->header.max_val)
+			stream->header.max_val = stream->stages[i].max_val;
+
+	if (is_bitmap(stream->header.magic_word))
+		return ferror(stream->out) ? -1 : 0;
+
+	return patch_max_val(stream);
+}
+
+// decodes the raster into bands; a NULL band marks the end of the image
+static void *reader_main(void *arg)
+{
+	stream_t *stream = arg;
+	size_t width = stream->header.width;
+	size_t row_size = binary_row_size(width, stream->header.magic_word,
+									  stream->header.max_val);
+
+	unsigned char *buffer = malloc(BAND_ROWS * row_size);
+
+	if (!buffer) {
+		atomic_store(&stream->abort, true);
+		return NULL;
+	}
+
+	for (size_t i = 0; i < stream->header.height; i += BAND_ROWS) {
+		band_t *band = create_band(stream);
+
+		if (!band) {
+			atomic_store(&stream->abort, true);
+			break;
+		}
+
+		band->row_count = min(BAND_ROWS, stream->header.height - i);
+
+		trace_span_t span;
+
+		trace_begin(&span, "band", "decode band", i / BAND_ROWS);
+
+		if (fread(buffer, row_size, band->row_count, stream->in) !=
+			band->row_count) {
+			trace_end(&span);
+			free_band(stream, band);
+			atomic_store(&stream->abort, true);
+			break;
+		}
+
+		for (size_t r = 0; r < band->row_count; r++)
+			decode_binary_row(buffer + r * row_size, band->pixels + r * width,
+							  width, stream->header.magic_word,
+							  stream->header.max_val);
+
+		trace_end(&span);
+
+		if (!ring_push(&stream->rings[0], band, &stream->abort)) {
+			free_band(stream, band);
+			break;
+		}
+	}
+
+	free(buffer);
+
+	if (!atomic_load(&stream->abort))
+		ring_push(&stream->rings[0], NULL, &stream->abort);
+
+	return NULL;
+}
+
+// runs one filter over every band coming from the previous thread
+static void *stage_main(void *arg)
+{
+	stage_arg_t *stage_arg = arg;
+	stream_t *stream = stage_arg->stream;
+	filter_stage_t *stage = &stream->stages[stage_arg->idx];
+	size_t width = stream->header.width;
+
+	band_t *out_band = NULL;
+	long band_idx = 0;
+	void *item;
+
+	while (ring_pop(&stream->rings[stage_arg->idx], &item, &stream->abort)) {
+		band_t *band = item;
+
+		if (!band)
+			break;
+
+		trace_span_t span;
+
+		trace_begin(&span, "band", "filter band", band_idx++);
+
+		for (size_t r = 0; r < band->row_count; r++)
+			if (emit_row(stream, stage_arg->idx + 1, &out_band,
+						 stage_push(stream, stage,
+									band->pixels + r * width)) == -1)
+				break;
+
+		trace_end(&span);
+		free_band(stream, band);
+	}
+
+	if (atomic_load(&stream->abort)) {
+		free_band(stream, out_band);
+		return NULL;
+	}
+
+	// the last row is still in the window
+	emit_row(stream, stage_arg->idx + 1, &out_band,
+			 stage_flush(stream, stage));
+
+	if (out_band &&
+		!ring_push(&stream->rings[stage_arg->idx + 1], out_band,
+				   &stream->abort))
+		free_band(stream, out_band);
+
+	ring_push(&stream->rings[stage_arg->idx + 1], NULL, &stream->abort);
+
+	return NULL;
+}
+
+// encodes and writes every band leaving the last stage
+static int writer_main(stream_t *stream)
+{
+	size_t width = stream->header.width;
+	size_t row_size = binary_row_size(width, stream->header.magic_word,
+									  stream->header.max_val);
+	int ret = 0;
+	long band_idx = 0;
+	void *item;
+
+	unsigned char *buffer = malloc(BAND_ROWS * row_size);
+
+	if (!buffer) {
+		atomic_store(&stream->abort, true);
+		return -1;
+	}
+
+	while (ring_pop(&stream->rings[stream->stage_count], &item,
+					&stream->abort)) {
+		band_t *band = item;
+
+		if (!band)
+			break;
+
+		trace_span_t span;
+
+		trace_begin(&span, "band", "encode band", band_idx++);
+
+		for (size_t r = 0; r < band->row_count; r++)
+			encode_binary_row(band->pixels + r * width,
+							  buffer + r * row_size, width,
+							  stream->header.magic_word, stream->header.max_val);
+
+		if (fwrite(buffer, row_size, band->row_count, stream->out) !=
+			band->row_count) {
+			atomic_store(&stream->abort, true);
+			ret = -1;
+		}
+
+		trace_end(&span);
+		free_band(stream, band);
+
+		if (ret == -1)
+			break;
+	}
+
+	free(buffer);
+
+	return ret;
+}
+
+static size_t band_size(stream_t *stream)
+{
+	return sizeof(band_t) + BAND_ROWS * stream->header.width * sizeof(pixel_t);
+}
+
+// bands all have the same size, so they keep coming back from the pool
+static band_t *create_band(stream_t *stream)
+{
+	band_t *band = pool_alloc(band_size(stream));
+
+	if (band)
+		band->row_count = 0;
+
+	return band;
+}
+
+static void free_band(stream_t *stream, band_t *band)
+{
+	pool_free(band, band_size(stream));
+}
+
+// appends a row to the band being built and passes full bands downstream
+static int emit_row(stream_t *stream, size_t ring, band_t **band,
+					const pixel_t *row)
+{
+	if (!row)
+		return 0;
+
+	if (!*band) {
+		*band = create_band(stream);
+
+		if (!*band) {
+			atomic_store(&stream->abort, true);
+			return -1;
+		}
+	}
+
+	memcpy((*band)->pixels + (*band)->row_count * stream->header.width, row,
+		   stream->header.width * sizeof(*row));
+
+	if (++(*band)->row_count < BAND_ROWS)
+		return 0;
+
+	if (!ring_push(&stream->rings[ring], *band, &stream->abort)) {
+		free_band(stream, *band);
+		*band = NULL;
+		return -1;
+	}
+
+	*band = NULL;
+
+	return 0;
+}
+
+/*
+ * stores a new row in the stage's window and returns the previous row once
+ * both of its neighbours are known, or NULL if nothing can be emitted yet
+ */
+static const pixel_t *stage_push(stream_t *stream, filter_stage_t *stage,
+								 const pixel_t *row)
+{
+	size_t width = stream->header.width;
+	pixel_t *oldest = stage->window[0];
+
+	for (size_t k = 0; k < KERNEL_SIZE - 1; k++)
+		stage->window[k] = stage->window[k + 1];
+
+	stage->window[KERNEL_SIZE - 1] = oldest;
+	memcpy(oldest, row, width * sizeof(*row));
+
+	if (!stage->received++)
+		return NULL;
+
+	// first row is on the border and can't be processed
+	if (stage->received == 2)
+		return stage->window[1];
+
+	const pixel_t *const rows[KERNEL_SIZE] = {
+		stage->window[0], stage->window[1], stage->window[2]
+	};
+
+	memcpy(stage->output, stage->window[1], width * sizeof(pixel_t));
+	convolve_row(rows, stage->output, 0, width, width, stage->kernel,
+				 &stage->max_val);
+
+	return stage->output;
+}
+
+// returns the last row of the image, which is on the border
+static const pixel_t *stage_flush(stream_t *stream, filter_stage_t *stage)
+{
+	if (stage->received != stream->header.height)
+		return NULL;
+
+	return stage->window[KERNEL_SIZE - 1];
+}
+
+/*
+ * writes the final max value over the one in the header, the same way SAVE
+ * does; if it has more digits, the raster is moved forward to make room,
+ * which reads and writes the whole output again
+ */
+static int patch_max_val(stream_t *stream)
+{
+	char max_val[sizeof("65535")];
+	int len = snprintf(max_val, sizeof(max_val), "%hu",
+					   stream->header.max_val);
+
+	if (fflush(stream->out) == EOF)
+		return -1;
+
+	if (len > stream->max_val_len &&
+		shift_tail(stream->out, stream->max_val_pos + stream->max_val_len,
+				   len - stream->max_val_len) == -1)
+		return -1;
+
+	if (fseek(stream->out, stream->max_val_pos, SEEK_SET) == -1)
+		return -1;
+
+	fwrite(max_val, 1, len, stream->out);
+
+	return ferror(stream->out) ? -1 : 0;
+}
+
+/*
+ * moves everything from the offset to the end of the file by bytes forward,
+ * in large blocks that go straight to the file descriptor
+ */
+static int shift_tail(FILE *file, long from, long by)
+{
+	int fd = fileno(file);
+	off_t end = lseek(fd, 0, SEEK_END);
+
+	if (end == -1)
+		return -1;
+
+	unsigned char *buffer = pool_alloc(SHIFT_BLOCK_SIZE);
+
+	if (!buffer)
+		return -1;
+
+	int ret = 0;
+
+	// back to front, so that no byte is overwritten before it's moved
+	while (end > from && ret != -1) {
+		size_t chunk = end - from < SHIFT_BLOCK_SIZE ?
+					   (size_t)(end - from) : SHIFT_BLOCK_SIZE;
+
+		end -= chunk;
+
+		if (async_read(fd, buffer, chunk, end) == -1 ||
+			async_write(fd, buffer, chunk, end + by) == -1)
+			ret = -1;
+	}
+
+	pool_free(buffer, SHIFT_BLOCK_SIZE);
+
+	return ret;
+}
@@ -0,0 +1,27 @@
+#include <setjmp.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+#include "sync_command.h"
+#include "image.h"
+#include "error.h"
+
+#define SYNC_ARG_COUNT 0
+
+/*
+ * SYNC
+ * does nothing by itself, but like any other command it waits for the
+ * commands queued with ON
+ */
+void sync_command(image_t *image, char **argv, int argc, jmp_buf ex_buf__)
+{
+	if (!image)
+		longjmp(ex_buf__, E_INVALID_FUNC_ARGS);
+
+	if (argc != SYNC_ARG_COUNT)
+		longjmp(ex_buf__, E_INVALID_COMMAND);
+
+	// bypass unused parameter warning
+	if (!argv)
+		argc++;
+}
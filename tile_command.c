@@ -0,0 +1,190 @@
+#include <setjmp.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdatomic.h>
+
+#include "tile_command.h"
+#include "save_command.h"
+#include "worker_pool.h"
+#include "image.h"
+#include "error.h"
+#include "utils.h"
+#include "output.h"
+#include "trace.h"
+
+#define TILE_MIN_ARG_COUNT 3
+#define TILE_MAX_ARG_COUNT 4
+#define TILE_SUCCESS_MSG "Saved %zu tiles\n"
+
+#define MAX_TILE_NAME_LENGTH 4096
+// "_<y>_<x>" with two 64-bit numbers
+#define MAX_TILE_SUFFIX_LENGTH 48
+
+typedef struct {
+	image_t *image;
+	const char *pattern;
+	size_t tile_width;
+	size_t tile_height;
+	size_t columns;
+	bool ascii;
+	// set by any of the workers
+	atomic_bool failed;
+} tile_job_t;
+
+static void save_tile(void *ctx, size_t idx);
+static int format_tile_name(char *buffer, size_t size, const char *pattern,
+							size_t x, size_t y);
+
+/*
+ * TILE <w> <h> <pattern> [ascii]
+ * cuts the selection into w x h tiles (smaller at the right and bottom edges)
+ * and saves all of them concurrently; in the pattern, %x and %y are replaced
+ * by the tile's column and row
+ */
+void tile_command(image_t *image, char **argv, int argc, jmp_buf ex_buf__)
+{
+	if (!image)
+		longjmp(ex_buf__, E_INVALID_FUNC_ARGS);
+
+	if (argc < TILE_MIN_ARG_COUNT || argc > TILE_MAX_ARG_COUNT)
+		longjmp(ex_buf__, E_INVALID_COMMAND);
+
+	if (argc == TILE_MAX_ARG_COUNT && strcmp(argv[3], "ascii"))
+		longjmp(ex_buf__, E_INVALID_COMMAND);
+
+	if (!image->is_loaded)
+		longjmp(ex_buf__, E_NO_IMAGE_LOADED);
+
+	int size[2];
+
+	for (int i = 0; i < 2; i++) {
+		size[i] = atoi(argv[i]);
+
+		if (size[i] <= 0)
+			longjmp(ex_buf__, E_INVALID_COMMAND);
+	}
+
+	size_t sel_width  = image->selection.lower_right.x -
+						image->selection.upper_left.x;
+	size_t sel_height = image->selection.lower_right.y -
+						image->selection.upper_left.y;
+
+	tile_job_t job = {
+		.image = image,
+		.pattern = argv[2],
+		.tile_width = size[0],
+		.tile_height = size[1],
+		.columns = (sel_width + size[0] - 1) / size[0],
+		.ascii = (argc == TILE_MAX_ARG_COUNT)
+	};
+
+	atomic_init(&job.failed, false);
+
+	size_t rows = (sel_height + size[1] - 1) / size[1];
+	size_t tile_count = rows * job.columns;
+
+	if (run_parallel(tile_count, save_tile, &job) == -1 ||
+		atomic_load(&job.failed))
+		longjmp(ex_buf__, E_FUNC_FAILED);
+
+	out_printf(TILE_SUCCESS_MSG, tile_count);
+}
+
+// worker task: encodes a single tile straight from the loaded image
+static void save_tile(void *ctx, size_t idx)
+{
+	tile_job_t *job = ctx;
+	image_t *image = job->image;
+
+	size_t x = idx % job->columns;
+	size_t y = idx / job->columns;
+
+	selection_t region;
+
+	region.upper_left.x = image->selection.upper_left.x + x * job->tile_width;
+	region.upper_left.y = image->selection.upper_left.y + y * job->tile_height;
+	region.lower_right.x = min(region.upper_left.x + job->tile_width,
+							   image->selection.lower_right.x);
+	region.lower_right.y = min(region.upper_left.y + job->tile_height,
+							   image->selection.lower_right.y);
+
+	char filename[MAX_TILE_NAME_LENGTH];
+
+	if (format_tile_name(filename, sizeof(filename), job->pattern, x, y) == -1) {
+		atomic_store(&job->failed, true);
+		return;
+	}
+
+	if (wait_pending_save(filename) == -1) {
+		atomic_store(&job->failed, true);
+		return;
+	}
+
+	trace_span_t span;
+
+	trace_begin(&span, "tile", "tile", idx);
+
+	if (save_image(filename, image, region, job->ascii) == -1)
+		atomic_store(&job->failed, true);
+
+	trace_end(&span);
+}
+
+/*
+ * expands %x and %y in the pattern; the coordinates the pattern lacks are
+ * added as "_<y>" and "_<x>" in front of the extension, so that every tile
+ * gets a name of its own
+ */
+static int format_tile_name(char *buffer, size_t size, const char *pattern,
+							size_t x, size_t y)
+{
+	size_t len = 0;
+	bool has_x = false, has_y = false;
+
+	for (const char *p = pattern; *p && len < size; p++) {
+		if (*p == '%' && (p[1] == 'x' || p[1] == 'y')) {
+			int ret = snprintf(buffer + len, size - len, "%zu",
+							   p[1] == 'x' ? x : y);
+
+			if (ret < 0)
+				return -1;
+
+			len += ret;
+			has_x |= p[1] == 'x';
+			has_y |= p[1] == 'y';
+			p++;
+		} else {
+			buffer[len++] = *p;
+		}
+	}
+
+	if (len >= size)
+		return -1;
+
+	buffer[len] = '\0';
+
+	if (has_x && has_y)
+		return 0;
+
+	// the extension starts at the last dot of the file name, if any
+	char *dot = strrchr(buffer, '.');
+	char *slash = strrchr(buffer, '/');
+	size_t ext = dot && (!slash || dot > slash) ? (size_t)(dot - buffer) : len;
+	char suffix[MAX_TILE_SUFFIX_LENGTH] = "";
+	size_t suffix_len = 0;
+
+	if (!has_y)
+		suffix_len += snprintf(suffix, sizeof(suffix), "_%zu", y);
+
+	if (!has_x)
+		suffix_len += snprintf(suffix + suffix_len, sizeof(suffix) - suffix_len,
+							   "_%zu", x);
+
+	if (len + suffix_len >= size)
+		return -1;
+
+	memmove(buffer + ext + suffix_len, buffer + ext, len - ext + 1);
+	memcpy(buffer + ext, suffix, suffix_len);
+
+	return 0;
+}
@@ -0,0 +1,394 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "tiled.h"
+#include "async_io.h"
+#include "crop_command.h"
+#include "image.h"
+#include "lz.h"
+#include "pnm.h"
+#include "pool.h"
+#include "trace.h"
+#include "utils.h"
+
+/*
+ * the editor's own container for images that get loaded a region at a time
+ * (SAVE ... TILED): a fixed header, an index with the offset, size and
+ * encoding of every tile, row by row, and the tiles themselves. A tile holds
+ * the binary raster of its rows, as the PNM format of the image would have
+ * it, either raw or LZ compressed when that is smaller. All numbers are
+ * little-endian:
+ *
+ *   0  "PNMTILED"     12 width             24 tile size
+ *   8  magic word     16 height            28 tuple type, NUL padded
+ *  10  max value      20 depth             92 index, 16 bytes per tile
+ */
+
+#define TILED_MAGIC "PNMTILED"
+#define TILED_MAGIC_LENGTH 8
+#define TILED_HEADER_SIZE (28 + MAX_TUPLE_TYPE_LENGTH + 1)
+#define TILED_ENTRY_SIZE 16
+
+// tiles start on a multiple of 8 pixels, so on a byte of the rows of a P4
+#define TILED_TILE_SIZE 256
+#define TILED_MAX_TILE_SIZE 4096
+
+typedef enum {
+	TILE_RAW,
+	TILE_LZ
+} tile_encoding_t;
+
+typedef struct {
+	size_t tile_size;
+	size_t columns;
+	size_t rows;
+	off_t data_start;
+	off_t file_size;
+} tiled_layout_t;
+
+static int read_layout(int fd, image_t *image, tiled_layout_t *layout);
+static int read_tile(int fd, tiled_layout_t *layout, const unsigned char *entry,
+					 unsigned char *tile, size_t raw_size, size_t capacity);
+static int write_tiled_image(int fd, image_t *image);
+static size_t raster_bytes(const image_t *image, size_t width);
+static void put_le(unsigned char *dest, uint64_t value, size_t bytes);
+static uint64_t get_le(const unsigned char *src, size_t bytes);
+
+// whether the file starts like a tiled one, whatever follows
+bool is_tiled_file(int fd)
+{
+	char magic[TILED_MAGIC_LENGTH];
+
+	return pread(fd, magic, sizeof(magic), 0) == (ssize_t)sizeof(magic) &&
+		   !memcmp(magic, TILED_MAGIC, sizeof(magic));
+}
+
+// the size, format and max value of a tiled file, the matrix is left alone
+int read_tiled_header(int fd, image_t *image)
+{
+	tiled_layout_t layout;
+
+	return read_layout(fd, image, &layout);
+}
+
+/*
+ * reads the tiles of a tiled file that intersect the region, and nothing
+ * else; the image ends up the size of the region
+ */
+int read_tiled_region(int fd, image_t *image, selection_t region)
+{
+	tiled_layout_t layout;
+
+	if (!image || read_layout(fd, image, &layout) == -1)
+		return -1;
+
+	size_t full_width = image->width;
+	size_t full_height = image->height;
+
+	if (region.upper_left.x >= region.lower_right.x ||
+		region.upper_left.y >= region.lower_right.y ||
+		region.lower_right.x > full_width || region.lower_right.y > full_height)
+		return -1;
+
+	size_t side = layout.tile_size;
+	size_t first_column = region.upper_left.x / side;
+	size_t last_column = (region.lower_right.x - 1) / side;
+	size_t first_row = region.upper_left.y / side;
+	size_t last_row = (region.lower_right.y - 1) / side;
+	size_t columns = last_column - first_column + 1;
+
+	// the matrix holds the tiles read, which cover the region
+	size_t x = first_column * side;
+	size_t y = first_row * side;
+
+	image->width = min((last_column + 1) * side, full_width) - x;
+	image->height = min((last_row + 1) * side, full_height) - y;
+
+	if (create_matrix(image) == -1)
+		return -1;
+
+	size_t row_bytes = encoded_row_size(image);
+	size_t capacity = side * raster_bytes(image, side);
+	unsigned char *band = pool_alloc(side * row_bytes);
+	unsigned char *tile = pool_alloc(2 * capacity);
+	unsigned char *entries = malloc(columns * TILED_ENTRY_SIZE);
+	int ret = band && tile && entries ? 0 : -1;
+	trace_span_t span;
+
+	trace_begin(&span, "phase", "raster decode", -1);
+
+	for (size_t r = first_row; r <= last_row && !ret; r++) {
+		size_t tile_height = min(side, full_height - r * side);
+
+		// the index entries of a row of tiles are next to each other
+		ret = async_read(fd, entries, columns * TILED_ENTRY_SIZE,
+						 TILED_HEADER_SIZE + (r * layout.columns +
+											  first_column) * TILED_ENTRY_SIZE);
+
+		for (size_t c = first_column; c <= last_column && !ret; c++) {
+			size_t tile_row = raster_bytes(image, min(side, full_width -
+															c * side));
+			size_t start = raster_bytes(image, (c - first_column) * side);
+
+			ret = read_tile(fd, &layout,
+							entries + (c - first_column) * TILED_ENTRY_SIZE,
+							tile, tile_height * tile_row, capacity);
+
+			for (size_t i = 0; i < tile_height && !ret; i++)
+				memcpy(band + i * row_bytes + start, tile + i * tile_row,
+					   tile_row);
+		}
+
+		for (size_t i = 0; i < tile_height && !ret; i++) {
+			advise_row_access(image, r * side - y + i);
+			decode_image_row(band + i * row_bytes, image, r * side - y + i);
+		}
+	}
+
+	trace_end(&span);
+
+	pool_free(band, side * row_bytes);
+	pool_free(tile, 2 * capacity);
+	free(entries);
+
+	if (ret == -1)
+		return -1;
+
+	image->selection.upper_left.x = region.upper_left.x - x;
+	image->selection.upper_left.y = region.upper_left.y - y;
+	image->selection.lower_right.x = region.lower_right.x - x;
+	image->selection.lower_right.y = region.lower_right.y - y;
+
+	// the parts of the tiles around the region are cut off
+	if (whole_matrix_is_selected(image))
+		return 0;
+
+	return crop_image(image);
+}
+
+// writes the whole image to a file as tiles
+int save_tiled_image(const char *filename, image_t *image)
+{
+	if (!filename || !image)
+		return -1;
+
+	int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+
+	if (fd == -1)
+		return -1;
+
+	int ret = write_tiled_image(fd, image);
+
+	if (close(fd) == -1)
+		ret = -1;
+
+	return ret;
+}
+
+/*
+ * checks the header and the size of the index against the file; the raster
+ * can't be larger than what the file holds, compressed as far as it goes
+ */
+static int read_layout(int fd, image_t *image, tiled_layout_t *layout)
+{
+	unsigned char header[TILED_HEADER_SIZE];
+	struct stat st;
+
+	if (fstat(fd, &st) == -1 || st.st_size < TILED_HEADER_SIZE ||
+		async_read(fd, header, sizeof(header), 0) == -1 ||
+		memcmp(header, TILED_MAGIC, TILED_MAGIC_LENGTH))
+		return -1;
+
+	MAGIC_WORD magic_word = header[8];
+	size_t width = get_le(header + 12, 4);
+	size_t height = get_le(header + 16, 4);
+	size_t depth = get_le(header + 20, 4);
+	size_t tile_size = get_le(header + 24, 4);
+
+	if (magic_word >= INVALID_MAGIC_WORD || !width || width > INT_MAX ||
+		!height || height > INT_MAX || !tile_size || tile_size % 8 ||
+		tile_size > TILED_MAX_TILE_SIZE)
+		return -1;
+
+	image->magic_word = magic_word;
+	image->width = width;
+	image->height = height;
+	image->max_val = get_le(header + 10, 2);
+	image->depth = 0;
+	image->tuple_type[0] = '\0';
+
+	if (is_bitmap(magic_word) && image->max_val != 1)
+		return -1;
+
+	if (is_pam(magic_word)) {
+		if (!depth || depth > MAX_PAM_DEPTH || !image->max_val ||
+			header[TILED_HEADER_SIZE - 1])
+			return -1;
+
+		image->depth = depth;
+		memcpy(image->tuple_type, header + 28, sizeof(image->tuple_type));
+	}
+
+	layout->tile_size = tile_size;
+	layout->columns = (width + tile_size - 1) / tile_size;
+	layout->rows = (height + tile_size - 1) / tile_size;
+	layout->file_size = st.st_size;
+
+	size_t index_size = layout->columns * layout->rows * TILED_ENTRY_SIZE;
+
+	if (index_size > (size_t)(st.st_size - TILED_HEADER_SIZE) ||
+		encoded_row_size(image) > (size_t)st.st_size * LZ_MAX_RATIO / height)
+		return -1;
+
+	layout->data_start = TILED_HEADER_SIZE + index_size;
+
+	return 0;
+}
+
+/*
+ * reads the tile of an index entry into the first capacity bytes of tile,
+ * the ones after that hold it while it is decompressed
+ */
+static int read_tile(int fd, tiled_layout_t *layout, const unsigned char *entry,
+					 unsigned char *tile, size_t raw_size, size_t capacity)
+{
+	uint64_t offset = get_le(entry, 8);
+	size_t size = get_le(entry + 8, 4);
+	tile_encoding_t encoding = get_le(entry + 12, 4);
+
+	if (offset < (uint64_t)layout->data_start ||
+		offset > (uint64_t)layout->file_size ||
+		size > (uint64_t)layout->file_size - offset)
+		return -1;
+
+	if (encoding == TILE_RAW)
+		return size == raw_size ? async_read(fd, tile, size, offset) : -1;
+
+	if (encoding != TILE_LZ || size >= raw_size ||
+		raw_size > size * LZ_MAX_RATIO)
+		return -1;
+
+	if (async_read(fd, tile + capacity, size, offset) == -1)
+		return -1;
+
+	return lz_decompress(tile + capacity, size, tile, raw_size);
+}
+
+/*
+ * encodes a row of tiles at a time and writes every tile right after the
+ * one before; the index is only known at the end, it goes in last
+ */
+static int write_tiled_image(int fd, image_t *image)
+{
+	size_t side = TILED_TILE_SIZE;
+	size_t columns = (image->width + side - 1) / side;
+	size_t rows = (image->height + side - 1) / side;
+	size_t index_size = columns * rows * TILED_ENTRY_SIZE;
+	size_t row_bytes = encoded_row_size(image);
+	size_t capacity = side * raster_bytes(image, side);
+
+	unsigned char *header = calloc(1, TILED_HEADER_SIZE + index_size);
+	unsigned char *band = pool_alloc(side * row_bytes);
+	unsigned char *tile = pool_alloc(2 * capacity);
+	off_t offset = TILED_HEADER_SIZE + index_size;
+	int ret = header && band && tile ? 0 : -1;
+	trace_span_t span;
+
+	trace_begin(&span, "phase", "encode", -1);
+
+	for (size_t r = 0; r < rows && !ret; r++) {
+		size_t tile_height = min(side, image->height - r * side);
+
+		for (size_t i = 0; i < tile_height; i++) {
+			advise_row_access(image, r * side + i);
+			encode_image_row(image, r * side + i, band + i * row_bytes);
+		}
+
+		for (size_t c = 0; c < columns && !ret; c++) {
+			size_t tile_row = raster_bytes(image, min(side, image->width -
+															c * side));
+			size_t start = raster_bytes(image, c * side);
+			size_t raw_size = tile_height * tile_row;
+
+			for (size_t i = 0; i < tile_height; i++)
+				memcpy(tile + i * tile_row, band + i * row_bytes + start,
+					   tile_row);
+
+			// a tile that doesn't get smaller is kept as it is
+			size_t size = lz_compress(tile, raw_size, tile + capacity,
+									  raw_size - 1);
+			tile_encoding_t encoding = size ? TILE_LZ : TILE_RAW;
+
+			if (!size)
+				size = raw_size;
+
+			ret = async_write(fd, size < raw_size ? tile + capacity : tile,
+							  size, offset);
+
+			unsigned char *entry = header + TILED_HEADER_SIZE +
+								   (r * columns + c) * TILED_ENTRY_SIZE;
+
+			put_le(entry, offset, 8);
+			put_le(entry + 8, size, 4);
+			put_le(entry + 12, encoding, 4);
+			offset += size;
+		}
+	}
+
+	trace_end(&span);
+
+	if (!ret) {
+		memcpy(header, TILED_MAGIC, TILED_MAGIC_LENGTH);
+		header[8] = image->magic_word;
+		put_le(header + 10, image->max_val, 2);
+		put_le(header + 12, image->width, 4);
+		put_le(header + 16, image->height, 4);
+		put_le(header + 20, image->depth, 4);
+		put_le(header + 24, side, 4);
+
+		if (is_pam(image->magic_word))
+			memcpy(header + 28, image->tuple_type, sizeof(image->tuple_type));
+
+		ret = async_write(fd, header, TILED_HEADER_SIZE + index_size, 0);
+	}
+
+	free(header);
+	pool_free(band, side * row_bytes);
+	pool_free(tile, 2 * capacity);
+
+	return ret;
+}
+
+/*
+ * bytes of the binary raster of width pixels of a row; with width a
+ * multiple of 8 this is also where the pixel after them starts
+ */
+static size_t raster_bytes(const image_t *image, size_t width)
+{
+	if (is_pam(image->magic_word))
+		return pam_row_size(width, image->depth, image->max_val);
+
+	return binary_row_size(width, image->magic_word, image->max_val);
+}
+
+static void put_le(unsigned char *dest, uint64_t value, size_t bytes)
+{
+	for (size_t k = 0; k < bytes; k++)
+		dest[k] = value >> (8 * k) & 0xff;
+}
+
+static uint64_t get_le(const unsigned char *src, size_t bytes)
+{
+	uint64_t value = 0;
+
+	for (size_t k = bytes; k; k--)
+		value = value << 8 | src[k - 1];
+
+	return value;
+}
@@ -0,0 +1,13 @@
+#pragma once
+
+#include <stdbool.h>
+
+#include "image.h"
+
+bool is_tiled_file(int fd);
+
+int read_tiled_header(int fd, image_t *image);
+
+int read_tiled_region(int fd, image_t *image, selection_t region);
+
+int save_tiled_image(const char *filename, image_t *image);
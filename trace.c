@@ -0,0 +1,242 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+#define TRACE_CHUNK_SIZE 1024
+
+typedef struct {
+	const char *cat;
+	const char *name;
+	long arg;
+	uint64_t start;
+	uint64_t duration;
+} trace_event_t;
+
+/*
+ * events are only appended by the thread owning the buffer; the chunks never
+ * move, so they can be written out while the thread is still running
+ */
+typedef struct trace_chunk_t {
+	trace_event_t events[TRACE_CHUNK_SIZE];
+	atomic_size_t count;
+	struct trace_chunk_t *_Atomic next;
+} trace_chunk_t;
+
+typedef struct trace_buffer_t {
+	int tid;
+	trace_chunk_t head;
+	trace_chunk_t *tail;
+	struct trace_buffer_t *next;
+	struct trace_buffer_t *next_free;
+} trace_buffer_t;
+
+// set up once, before any other thread exists
+static bool tracing;
+static FILE *trace_fp;
+static struct timespec epoch;
+
+/*
+ * the buffers of threads that exited are kept for the file and handed to the
+ * next threads, which carry on their track
+ */
+static struct {
+	pthread_mutex_t lock;
+	trace_buffer_t *head;
+	trace_buffer_t *free;
+	int thread_count;
+} buffers = {
+	.lock = PTHREAD_MUTEX_INITIALIZER
+};
+
+static _Thread_local trace_buffer_t *buffer;
+static pthread_key_t buffer_key;
+
+static uint64_t now(void);
+static trace_buffer_t *thread_buffer(void);
+static void release_buffer(void *arg);
+static void write_trace(void);
+
+/*
+ * records spans from now on and writes them to the file as Chrome trace
+ * events (chrome://tracing, ui.perfetto.dev) when the process exits
+ */
+int start_trace(const char *path)
+{
+	trace_fp = fopen(path, "w");
+
+	if (!trace_fp)
+		return -1;
+
+	if (pthread_key_create(&buffer_key, release_buffer)) {
+		fclose(trace_fp);
+		return -1;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &epoch);
+	tracing = true;
+
+	atexit(write_trace);
+
+	return 0;
+}
+
+void trace_begin(trace_span_t *span, const char *cat, const char *name,
+				 long arg)
+{
+	span->active = tracing;
+
+	if (!span->active)
+		return;
+
+	span->cat = cat;
+	span->name = name;
+	span->arg = arg;
+	span->start = now();
+}
+
+void trace_end(trace_span_t *span)
+{
+	if (!span->active)
+		return;
+
+	trace_buffer_t *thread = thread_buffer();
+
+	if (!thread)
+		return;
+
+	trace_chunk_t *chunk = thread->tail;
+	size_t count = atomic_load_explicit(&chunk->count, memory_order_relaxed);
+
+	if (count == TRACE_CHUNK_SIZE) {
+		trace_chunk_t *next = calloc(1, sizeof(*next));
+
+		if (!next)
+			return;
+
+		atomic_store_explicit(&chunk->next, next, memory_order_release);
+		thread->tail = chunk = next;
+		count = 0;
+	}
+
+	chunk->events[count] = (trace_event_t){
+		.cat = span->cat,
+		.name = span->name,
+		.arg = span->arg,
+		.start = span->start,
+		.duration = now() - span->start
+	};
+
+	atomic_store_explicit(&chunk->count, count + 1, memory_order_release);
+}
+
+// nanoseconds since the trace started
+static uint64_t now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)(ts.tv_sec - epoch.tv_sec) * 1000000000 +
+		   ts.tv_nsec - epoch.tv_nsec;
+}
+
+/*
+ * the buffer of the calling thread, taken on its first event from a thread
+ * that exited or made if there is none
+ */
+static trace_buffer_t *thread_buffer(void)
+{
+	if (buffer)
+		return buffer;
+
+	pthread_mutex_lock(&buffers.lock);
+
+	trace_buffer_t *new_buffer = buffers.free;
+
+	if (new_buffer) {
+		buffers.free = new_buffer->next_free;
+	} else {
+		new_buffer = calloc(1, sizeof(*new_buffer));
+
+		if (new_buffer) {
+			new_buffer->tail = &new_buffer->head;
+			new_buffer->tid = ++buffers.thread_count;
+			new_buffer->next = buffers.head;
+			buffers.head = new_buffer;
+		}
+	}
+
+	pthread_mutex_unlock(&buffers.lock);
+
+	if (!new_buffer)
+		return NULL;
+
+	// returned to the free list when the thread exits
+	pthread_setspecific(buffer_key, new_buffer);
+	buffer = new_buffer;
+
+	return buffer;
+}
+
+static void release_buffer(void *arg)
+{
+	trace_buffer_t *old_buffer = arg;
+
+	pthread_mutex_lock(&buffers.lock);
+
+	old_buffer->next_free = buffers.free;
+	buffers.free = old_buffer;
+
+	pthread_mutex_unlock(&buffers.lock);
+}
+
+// the buffers stay allocated, threads still running may write to them
+static void write_trace(void)
+{
+	pthread_mutex_lock(&buffers.lock);
+
+	bool first = true;
+	int pid = getpid();
+
+	fprintf(trace_fp, "{\"traceEvents\":[");
+
+	for (trace_buffer_t *thread = buffers.head; thread; thread = thread->next) {
+		trace_chunk_t *chunk = &thread->head;
+
+		while (chunk) {
+			size_t count = atomic_load_explicit(&chunk->count,
+												memory_order_acquire);
+
+			for (size_t i = 0; i < count; i++) {
+				trace_event_t *event = &chunk->events[i];
+
+				fprintf(trace_fp, "%s\n{\"name\":\"%s\",\"cat\":\"%s\","
+						"\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,"
+						"\"pid\":%d,\"tid\":%d", first ? "" : ",",
+						event->name, event->cat, event->start / 1e3,
+						event->duration / 1e3, pid, thread->tid);
+
+				if (event->arg >= 0)
+					fprintf(trace_fp, ",\"args\":{\"index\":%ld}",
+							event->arg);
+
+				fprintf(trace_fp, "}");
+				first = false;
+			}
+
+			chunk = atomic_load_explicit(&chunk->next, memory_order_acquire);
+		}
+	}
+
+	fprintf(trace_fp, "\n],\"displayTimeUnit\":\"ms\"}\n");
+	fclose(trace_fp);
+
+	pthread_mutex_unlock(&buffers.lock);
+}
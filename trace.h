@@ -0,0 +1,20 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// a span being timed, the name and category have to outlive the process
+typedef struct {
+	bool active;
+	const char *cat;
+	const char *name;
+	long arg;
+	uint64_t start;
+} trace_span_t;
+
+int start_trace(const char *path);
+
+void trace_begin(trace_span_t *span, const char *cat, const char *name,
+				 long arg);
+
+void trace_end(trace_span_t *span);
@@ -0,0 +1,38 @@
+#include <setjmp.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+#include "undo_command.h"
+#include "history.h"
+#include "image.h"
+#include "error.h"
+#include "output.h"
+
+#define UNDO_ARG_COUNT 0
+#define UNDO_SUCCESS_MSG "Undone\n"
+
+/*
+ * UNDO
+ * goes back to the state before the last APPLY, EQUALIZE, ROTATE, CROP, ERODE
+ * or DILATE
+ */
+void undo_command(image_t *image, char **argv, int argc, jmp_buf ex_buf__)
+{
+	if (!image)
+		longjmp(ex_buf__, E_INVALID_FUNC_ARGS);
+
+	if (argc != UNDO_ARG_COUNT)
+		longjmp(ex_buf__, E_INVALID_COMMAND);
+
+	if (!image->is_loaded)
+		longjmp(ex_buf__, E_NO_IMAGE_LOADED);
+
+	// bypass unused parameter warning
+	if (!argv)
+		argc++;
+
+	if (undo_image(image) == -1)
+		longjmp(ex_buf__, E_NOTHING_TO_UNDO);
+
+	out_printf(UNDO_SUCCESS_MSG);
+}
@@ -0,0 +1,30 @@
+#include <setjmp.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+#include "use_command.h"
+#include "workspace.h"
+#include "image.h"
+#include "error.h"
+#include "output.h"
+
+#define USE_ARG_COUNT 1
+#define USE_SUCCESS_MSG "Using %s\n"
+
+/*
+ * USE <name>
+ * sends the next commands to an image loaded with LOAD <file> AS <name>
+ */
+void use_command(image_t *image, char **argv, int argc, jmp_buf ex_buf__)
+{
+	if (!image)
+		longjmp(ex_buf__, E_INVALID_FUNC_ARGS);
+
+	if (argc != USE_ARG_COUNT)
+		longjmp(ex_buf__, E_INVALID_COMMAND);
+
+	if (use_image(argv[0]) == -1)
+		longjmp(ex_buf__, E_UNKNOWN_IMAGE);
+
+	out_printf(USE_SUCCESS_MSG, argv[0]);
+}
@@ -21,10 +21,10 @@ size_t min(size_t a, size_t b)
 	return (a > b) ? b : a;
 }
 
-double clamp_value(double val)
+double clamp_value(double val, unsigned int limit)
 {
-	if (val > MAX_PIXEL_VAL)
-		return MAX_PIXEL_VAL;
+	if (val > limit)
+		return limit;
 
 	if (val < MIN_PIXEL_VAL)
 		return MIN_PIXEL_VAL;
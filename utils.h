@@ -11,7 +11,7 @@ void check_nullptr(void *p, char error_msg[]);
 
 size_t min(size_t a, size_t b);
 
-double clamp_value(double val);
+double clamp_value(double val, unsigned int limit);
 
 void swap_int(int *a, int *b);
 
@@ -0,0 +1,88 @@
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "worker_pool.h"
+#include "utils.h"
+
+#define MAX_WORKER_COUNT 64
+
+typedef struct {
+	task_func_t task;
+	void *ctx;
+	size_t task_count;
+	atomic_size_t next_task;
+} work_queue_t;
+
+static void *worker_main(void *arg);
+
+// returns the number of workers used for parallel jobs
+size_t worker_count(void)
+{
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+	if (cpus < 1)
+		return 1;
+
+	return min((size_t)cpus, MAX_WORKER_COUNT);
+}
+
+/*
+ * runs task(ctx, idx) for every idx in [0, task_count) on a pool of worker
+ * threads; workers grab the next free index, so uneven tasks balance out
+ */
+int run_parallel(size_t task_count, task_func_t task, void *ctx)
+{
+	return run_parallel_on(worker_count(), task_count, task, ctx);
+}
+
+// same as run_parallel(), with a given number of threads (useful for I/O)
+int run_parallel_on(size_t thread_count, size_t task_count, task_func_t task,
+					void *ctx)
+{
+	if (!task)
+		return -1;
+
+	work_queue_t queue = {
+		.task = task,
+		.ctx = ctx,
+		.task_count = task_count
+	};
+	atomic_init(&queue.next_task, 0);
+
+	thread_count = min(min(thread_count, task_count), MAX_WORKER_COUNT);
+
+	// not worth spawning threads, run on the caller
+	if (thread_count <= 1) {
+		worker_main(&queue);
+		return 0;
+	}
+
+	pthread_t threads[MAX_WORKER_COUNT];
+	size_t started = 0;
+
+	// the caller is one of the workers
+	for (; started < thread_count - 1; started++)
+		if (pthread_create(&threads[started], NULL, worker_main, &queue))
+			break;
+
+	// progress is made even if no thread could be started
+	worker_main(&queue);
+
+	for (size_t i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+
+	return 0;
+}
+
+static void *worker_main(void *arg)
+{
+	work_queue_t *queue = arg;
+	size_t idx;
+
+	while ((idx = atomic_fetch_add(&queue->next_task, 1)) < queue->task_count)
+		queue->task(queue->ctx, idx);
+
+	return NULL;
+}
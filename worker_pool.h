@@ -0,0 +1,12 @@
+#pragma once
+
+#include <stddef.h>
+
+typedef void (*task_func_t)(void *ctx, size_t idx);
+
+size_t worker_count(void);
+
+int run_parallel(size_t task_count, task_func_t task, void *ctx);
+
+int run_parallel_on(size_t thread_count, size_t task_count, task_func_t task,
+					void *ctx);
@@ -0,0 +1,311 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <pthread.h>
+
+#include "workspace.h"
+#include "command.h"
+#include "image.h"
+#include "lazy.h"
+#include "history.h"
+#include "output.h"
+#include "worker_pool.h"
+
+// an image of the workspace; the one without a name is used until a USE
+typedef struct named_image_t {
+	char *name;
+	image_t image;
+	// held while a command runs on the image
+	pthread_mutex_t lock;
+	struct named_image_t *next;
+} named_image_t;
+
+// a command given through ON, run with the next batch
+typedef struct {
+	named_image_t *target;
+	COMMAND_TYPE type;
+	char **argv;
+	int argc;
+	// everything the command printed
+	char *output;
+	size_t output_size;
+} queued_command_t;
+
+typedef struct {
+	queued_command_t *commands;
+	size_t count;
+	size_t capacity;
+	// images with queued commands, while the batch runs
+	named_image_t **targets;
+} command_batch_t;
+
+static named_image_t default_image = {
+	.lock = PTHREAD_MUTEX_INITIALIZER
+};
+// images are only added (until free_workspace()), so lookups can keep them
+static named_image_t *named_images;
+static pthread_mutex_t named_images_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// every thread (a client of the server) has its own current image and queue
+static _Thread_local named_image_t *current = &default_image;
+static _Thread_local command_batch_t batch;
+
+static named_image_t *find_named_image(const char *name);
+static named_image_t *named_image_of(image_t *image);
+static void run_image_batch(void *ctx, size_t idx);
+static void free_queued_command(queued_command_t *command);
+
+// the image the commands go to
+image_t *current_image(void)
+{
+	return &current->image;
+}
+
+// looks an image up by name, optionally adding an empty one if it is missing
+image_t *find_image(const char *name, bool create)
+{
+	pthread_mutex_lock(&named_images_lock);
+
+	named_image_t *it = find_named_image(name);
+
+	if (!it && create) {
+		it = calloc(1, sizeof(*it));
+
+		if (it && !(it->name = strdup(name))) {
+			free(it);
+			it = NULL;
+		}
+
+		if (it) {
+			it->image.is_loaded = false;
+			it->image.matrix = NULL;
+			it->image.pending = NULL;
+			it->image.history = NULL;
+			pthread_mutex_init(&it->lock, NULL);
+
+			it->next = named_images;
+			named_images = it;
+		}
+	}
+
+	pthread_mutex_unlock(&named_images_lock);
+
+	return it ? &it->image : NULL;
+}
+
+// makes the given image the current one, NULL goes back to the unnamed one
+int use_image(const char *name)
+{
+	pthread_mutex_lock(&named_images_lock);
+	named_image_t *it = name ? find_named_image(name) : &default_image;
+	pthread_mutex_unlock(&named_images_lock);
+
+	if (!it)
+		return -1;
+
+	current = it;
+
+	return 0;
+}
+
+// the commands of different threads on the same image take turns
+void lock_image(image_t *image)
+{
+	pthread_mutex_lock(&named_image_of(image)->lock);
+}
+
+void unlock_image(image_t *image)
+{
+	pthread_mutex_unlock(&named_image_of(image)->lock);
+}
+
+/*
+ * keeps a copy of a command for the given image; the commands of a batch
+ * run in order for each image, while different images run concurrently
+ */
+int queue_image_command(const char *name, COMMAND_TYPE type, char **argv,
+						int argc)
+{
+	image_t *image = find_image(name, true);
+
+	if (!image)
+		return -1;
+
+	if (batch.count == batch.capacity) {
+		size_t capacity = batch.capacity ? 2 * batch.capacity : 8;
+		void *ret = realloc(batch.commands,
+							capacity * sizeof(*batch.commands));
+
+		if (!ret)
+			return -1;
+
+		batch.commands = ret;
+		batch.capacity = capacity;
+	}
+
+	queued_command_t *command = &batch.commands[batch.count];
+
+	memset(command, 0, sizeof(*command));
+	command->target = named_image_of(image);
+	command->type = type;
+	command->argv = calloc(argc ? argc : 1, sizeof(*command->argv));
+
+	if (!command->argv)
+		return -1;
+
+	for (; command->argc < argc; command->argc++) {
+		command->argv[command->argc] = strdup(argv[command->argc]);
+
+		if (!command->argv[command->argc]) {
+			free_queued_command(command);
+			return -1;
+		}
+	}
+
+	batch.count++;
+
+	return 0;
+}
+
+/*
+ * runs the queued commands, one task per image, then prints what they
+ * printed in the order they were given
+ */
+int run_queued_commands(void)
+{
+	if (!batch.count)
+		return 0;
+
+	named_image_t **targets = malloc(batch.count * sizeof(*targets));
+
+	if (!targets)
+		return -1;
+
+	batch.targets = targets;
+
+	size_t target_count = 0;
+
+	for (size_t i = 0; i < batch.count; i++) {
+		size_t j = 0;
+
+		while (j < target_count && targets[j] != batch.commands[i].target)
+			j++;
+
+		if (j == target_count)
+			targets[target_count++] = batch.commands[i].target;
+	}
+
+	int ret = run_parallel(target_count, run_image_batch, &batch);
+
+	for (size_t i = 0; i < batch.count; i++) {
+		queued_command_t *command = &batch.commands[i];
+
+		if (command->output)
+			fwrite(command->output, 1, command->output_size,
+				   output_stream());
+
+		free_queued_command(command);
+	}
+
+	free(batch.commands);
+	free(targets);
+
+	memset(&batch, 0, sizeof(batch));
+
+	return ret;
+}
+
+// frees every image of the workspace
+void free_workspace(void)
+{
+	for (size_t i = 0; i < batch.count; i++)
+		free_queued_command(&batch.commands[i]);
+
+	free(batch.commands);
+	batch.commands = NULL;
+	batch.count = 0;
+	batch.capacity = 0;
+
+	discard_image_ops(&default_image.image);
+	clear_history(&default_image.image);
+	reset_image(&default_image.image);
+
+	while (named_images) {
+		named_image_t *it = named_images;
+
+		named_images = it->next;
+
+		discard_image_ops(&it->image);
+		clear_history(&it->image);
+		reset_image(&it->image);
+		pthread_mutex_destroy(&it->lock);
+		free(it->name);
+		free(it);
+	}
+
+	current = &default_image;
+}
+
+static named_image_t *find_named_image(const char *name)
+{
+	if (!name)
+		return NULL;
+
+	for (named_image_t *it = named_images; it; it = it->next)
+		if (!strcmp(it->name, name))
+			return it;
+
+	return NULL;
+}
+
+// the workspace entry an image belongs to
+static named_image_t *named_image_of(image_t *image)
+{
+	return (named_image_t *)((char *)image - offsetof(named_image_t, image));
+}
+
+// runs the queued commands of one image, capturing their output
+static void run_image_batch(void *ctx, size_t idx)
+{
+	// the batch belongs to the thread that queued it
+	command_batch_t *batch = ctx;
+	named_image_t *target = batch->targets[idx];
+	// this may be the thread that queued the batch, keep its stream
+	FILE *previous = output_stream();
+
+	pthread_mutex_lock(&target->lock);
+
+	for (size_t i = 0; i < batch->count; i++) {
+		queued_command_t *command = &batch->commands[i];
+
+		if (command->target != target)
+			continue;
+
+		FILE *stream = open_memstream(&command->output,
+									  &command->output_size);
+
+		set_output_stream(stream);
+		run_image_command(command->type, command->argv, command->argc,
+						  &target->image);
+		set_output_stream(previous);
+
+		if (stream)
+			fclose(stream);
+	}
+
+	pthread_mutex_unlock(&target->lock);
+}
+
+static void free_queued_command(queued_command_t *command)
+{
+	for (int i = 0; i < command->argc; i++)
+		free(command->argv[i]);
+
+	free(command->argv);
+	free(command->output);
+
+	command->argv = NULL;
+	command->output = NULL;
+}
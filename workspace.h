@@ -0,0 +1,23 @@
+#pragma once
+
+#include <stdbool.h>
+
+#include "image.h"
+#include "command.h"
+
+image_t *current_image(void);
+
+image_t *find_image(const char *name, bool create);
+
+int use_image(const char *name);
+
+void lock_image(image_t *image);
+
+void unlock_image(image_t *image);
+
+int queue_image_command(const char *name, COMMAND_TYPE type, char **argv,
+						int argc);
+
+int run_queued_commands(void);
+
+void free_workspace(void);